@@ -1,31 +1,99 @@
+// The host passes these from scene.h, the defaults only serve a standalone build
+#ifndef MAX_RECURSION_DEPTH
 #define MAX_RECURSION_DEPTH 5
+#endif
 #define SHADOW_ENABLED
+#ifndef T_MIN
 #define T_MIN 0.05f
+#endif
+#ifndef BVH_STACK_SIZE
+#define BVH_STACK_SIZE 64
+#endif
 
-typedef struct {
-	float w;
-	float4 v;
-} __attribute__((packed)) quaternion;
+// The host builds a variant per scene configuration with -DSPECIALIZED and
+// REFLECT_DEPTH, NUM_LIGHTS and the HAS_* flags describing the current scene,
+// so the loops below get constant trip counts and unused light types,
+// specular highlights and meshes are compiled out. The generic build checks
+// everything at runtime.
+#ifdef SPECIALIZED
+#define SCENE_REFLECT_DEPTH REFLECT_DEPTH
+#define SCENE_LIGHT_COUNT NUM_LIGHTS
+#define UNROLL _Pragma("unroll")
+#else
+#define SCENE_REFLECT_DEPTH (world->scene->reflect_depth)
+#define SCENE_LIGHT_COUNT (world->scene->light_count)
+#define UNROLL
+#define HAS_AMBIENT_LIGHT
+#define HAS_POINT_LIGHT
+#define HAS_DIRECT_LIGHT
+#define HAS_SPECULAR
+#define HAS_MESHES
+#endif
+
+// With -DACCUMULATE the output is the running mean of the samples traced
+// since the camera or the scene last changed: rt and wf_generate offset the
+// ray inside the pixel by jitter, and history holds the mean so far (sample is
+// the number of samples already in it).
+
+// Structs use natural alignment so they match the host definitions in scene.h,
+// where cl_float4 is 16-byte aligned
 
+// Spheres arrive as two streams in one buffer (packed by the host, see
+// scene.h): sphere_count float4s with the centre in xyz and the radius in w,
+// which is all the traversal loops read, followed by the materials, read once
+// per hit. A material per mesh instance comes after those of the spheres,
+// then the vertices and triangles (vertex indices in xyz) of the mesh objects
+// and the instances. The BVH buffer holds the tree over the spheres, the
+// trees of the objects from node mesh_node_offset and the top-level tree over
+// the instances from instance_node_offset. A hit is numbered by its sphere, or
+// by sphere_count plus its triangle along with the instance it belongs to.
 typedef struct {
-	float4 center;
 	float4 color;
-	float radius;
 	float reflect;
 	int specular;
-} __attribute__((packed)) rt_sphere;
+} rt_material;
+
+typedef struct {
+	float4 bbox_min;
+	float4 bbox_max;
+	int left_first;
+	int count;
+} rt_bvh_node;
+
+typedef struct {
+	float4 world_to_object[3];
+	int root;
+	int first_triangle;
+	int material;
+} rt_instance;
+
+typedef struct {
+	float4 bbox_min;
+	float4 bbox_max;
+	float intensity;
+	int left;
+	int light;
+	float reach;
+} rt_light_node;
 
 typedef enum { Ambient, Point, Direct } lightType;
 
 typedef struct {
 	lightType type;
 	float intensity;
+	float radius;
 	float4 position;
 	float4 direction;
-} __attribute__((packed)) rt_light;
+} rt_light;
+
+typedef struct {
+	float4 origin;
+	float4 right;
+	float4 up;
+	float4 forward;
+} rt_camera_frame;
 
 typedef struct {
-	float4 camera_pos;
 	float4 bg_color;
 	float canvas_width;
 	float canvas_height;
@@ -37,55 +105,93 @@ typedef struct {
 	int sphere_count;
 	int light_count;
 
-	quaternion camera_rotation;
+	float4 light_grid_min;
+	int4 light_grid_dims;
+	float light_grid_cell;
 
-	rt_sphere spheres[64];
-	rt_light lights[16];
-} rt_scene;
+	int light_node_count;
+	int light_global_count;
 
-quaternion multiplyQuaternion(quaternion *q1, quaternion *q2) {
-	quaternion result;
+	int instance_count;
+	int vertex_count;
+	int triangle_count;
+	int mesh_node_offset;
+	int instance_node_offset;
+} rt_scene;
 
-	result.w =   q1->w*q2->w - q1->v.x * q2->v.x - q1->v.y * q2->v.y - q1->v.z * q2->v.z;
-	result.v.x = q1->w*q2->v.x + q1->v.x * q2->w + q1->v.y * q2->v.z - q1->v.z * q2->v.y;
-	result.v.y = q1->w*q2->v.y + q1->v.y * q2->w + q1->v.z * q2->v.x - q1->v.x * q2->v.z;
-	result.v.z = q1->w*q2->v.z + q1->v.z * q2->w + q1->v.x * q2->v.y - q1->v.y * q2->v.x;
+// Kernel-side view of the scene: the per-frame params block plus the
+// geometry buffers, bundled so the helpers take a single argument
+typedef struct {
+	__constant rt_scene *scene;
+	__global const float4 *spheres;
+	__global const rt_material *materials;
+	__global const rt_light *lights;
+	__global const rt_bvh_node *bvh;
+#ifdef LIGHT_GRID
+	__global const int2 *lightCells;
+	__global const int *lightIndices;
+#endif
+#ifdef LIGHT_SAMPLES
+	__global const rt_light_node *lightNodes;
+	__global const int *globalLights;
+#endif
+#ifdef HAS_MESHES
+	__global const rt_bvh_node *meshBvh;
+	__global const rt_bvh_node *instanceBvh;
+	__global const float4 *vertices;
+	__global const int4 *triangles;
+	__global const rt_instance *instances;
+#endif
+} rt_world;
 
-	return result;
+// Direction through canvas point (x, y). The host folds the camera rotation
+// and the canvas to viewport scale into the basis once per frame.
+float4 CanvasToViewport(float x, float y, const rt_camera_frame *camera)
+{
+	return x * camera->right + y * camera->up + camera->forward;
 }
 
-float4 Rotate(__constant quaternion *q, float4 *v)
+// With -DLIGHT_GRID the light buffer continues with the cells and the light
+// indices of the host built light grid (see light_grid.h), the same way the
+// materials follow the sphere geometry. With -DLIGHT_SAMPLES it continues with
+// the light tree and the lights outside it (see light_tree.h) instead.
+rt_world MakeWorld(__constant rt_scene *scene, __global const rt_bvh_node *bvh, __global const float4 *spheres, __global const rt_light *lights)
 {
-	quaternion qv;
-	qv.w = 0;
-	qv.v = *v;
-
-	quaternion tmp = *q;
-	quaternion mult = multiplyQuaternion(&tmp, &qv);
-	quaternion inverse;
-	float scale = 1 / (q->w*q->w + dot(q->v, q->v));
-	inverse.w = scale * q->w;
-	inverse.v = - scale * q->v;
-	quaternion result = multiplyQuaternion(&mult, &inverse);
-
-	return result.v;
+	rt_world world;
+	world.scene = scene;
+	world.spheres = spheres;
+	world.materials = (__global const rt_material *)(spheres + scene->sphere_count);
+	world.lights = lights;
+	world.bvh = bvh;
+#ifdef LIGHT_GRID
+	world.lightCells = (__global const int2 *)(lights + scene->light_count);
+	world.lightIndices = (__global const int *)(world.lightCells + scene->light_grid_dims.w);
+#endif
+#ifdef LIGHT_SAMPLES
+	world.lightNodes = (__global const rt_light_node *)(lights + scene->light_count);
+	world.globalLights = (__global const int *)(world.lightNodes + scene->light_node_count);
+#endif
+#ifdef HAS_MESHES
+	world.meshBvh = bvh + scene->mesh_node_offset;
+	world.instanceBvh = bvh + scene->instance_node_offset;
+	world.vertices = (__global const float4 *)(world.materials + scene->sphere_count + scene->instance_count);
+	world.triangles = (__global const int4 *)(world.vertices + scene->vertex_count);
+	world.instances = (__global const rt_instance *)(world.triangles + scene->triangle_count);
+#endif
+	return world;
 }
 
-float4 CanvasToViewport(float x, float y, __constant rt_scene* scene)
+float4 SphereCenter(float4 sphere)
 {
-	float4 result = (float4) (x * scene->viewport_width / scene->canvas_width,
-		y * scene->viewport_height / scene->canvas_height,
-		scene->viewport_dist,
-		0);
-	return Rotate(&scene->camera_rotation, &result);
+	return (float4)(sphere.x, sphere.y, sphere.z, 0);
 }
 
-float IntersectRaySphere(float4 o, float4 d, float tMin, __constant rt_sphere* sphere)
+float IntersectRaySphere(float4 o, float4 d, float tMin, float4 sphere)
 {
 	float t1, t2;
 
-	float4 c = sphere->center;
-	float r = sphere->radius;
+	float4 c = SphereCenter(sphere);
+	float r = sphere.w;
 	float4 oc = o - c;
 
 	float k1 = dot(d, d);
@@ -116,117 +222,590 @@ float IntersectRaySphere(float4 o, float4 d, float tMin, __constant rt_sphere* s
 	return t;
 }
 
+#ifdef HAS_MESHES
+// Möller-Trumbore, triangles are hit from both sides
+float IntersectRayTriangle(float4 o, float4 d, float tMin, int4 triangle, __global const float4 *vertices)
+{
+	float4 v0 = vertices[triangle.x];
+	float4 e1 = vertices[triangle.y] - v0;
+	float4 e2 = vertices[triangle.z] - v0;
+
+	float4 p = cross(d, e2);
+	float det = dot(e1, p);
+	if (det == 0) return INFINITY;
+	float invDet = 1 / det;
+
+	float4 s = o - v0;
+	float u = dot(s, p) * invDet;
+	if (u < 0 || u > 1) return INFINITY;
+	float4 q = cross(s, e1);
+	float v = dot(d, q) * invDet;
+	if (v < 0 || u + v > 1) return INFINITY;
+
+	float t = dot(e2, q) * invDet;
+	return t >= tMin ? t : INFINITY;
+}
+
+// v moved into an instance with w = 1 for a point and w = 0 for a direction.
+// Directions keep the length the transform gives them, so t along an object
+// space ray is the same as along the world ray.
+float4 ToObject(__global const float4 *worldToObject, float4 v, float w)
+{
+	float4 h = (float4)(v.x, v.y, v.z, w);
+	return (float4)(dot(worldToObject[0], h), dot(worldToObject[1], h), dot(worldToObject[2], h), 0);
+}
+#endif
+
+// Material of the sphere or the triangle of an instance hit
+__global const rt_material *HitMaterial(int hit, int instance, const rt_world *world)
+{
+#ifdef HAS_MESHES
+	const int sphereCount = world->scene->sphere_count;
+	if (hit >= sphereCount)
+		return world->materials + sphereCount + world->instances[instance].material;
+#endif
+	return world->materials + hit;
+}
+
+// Unit normal at point p of the surface hit by a ray along d. Triangle normals
+// face the ray, sphere normals always point outwards.
+float4 SurfaceNormal(float4 p, float4 d, int hit, int instance, const rt_world *world)
+{
+#ifdef HAS_MESHES
+	const int sphereCount = world->scene->sphere_count;
+	if (hit >= sphereCount) {
+		int4 triangle = world->triangles[hit - sphereCount];
+		float4 v0 = world->vertices[triangle.x];
+		float4 n = cross(world->vertices[triangle.y] - v0, world->vertices[triangle.z] - v0);
+		// the transpose of world_to_object takes object normals to the world
+		__global const float4 *m = world->instances[instance].world_to_object;
+		float4 normal = n.x * m[0] + n.y * m[1] + n.z * m[2];
+		normal.w = 0;
+		normal = normalize(normal);
+		return dot(normal, d) > 0 ? -normal : normal;
+	}
+#endif
+	return normalize(p - SphereCenter(world->spheres[hit]));
+}
+
 float4 ReflectRay(float4 r, float4 normal) {
 	return 2*normal*dot(r, normal) - r;
 }
 
-void ClosestIntersection(float4 o, float4 d, float tMin, float tMax, __constant rt_scene *scene, float *t, int *sphereIndex) {
-	float closest = INFINITY;
-	int sphere_index = -1;
+float IntersectRayBox(float4 o, float4 invD, float tMin, float tMax, __global const rt_bvh_node *node)
+{
+	float4 t0 = (node->bbox_min - o) * invD;
+	float4 t1 = (node->bbox_max - o) * invD;
+	float4 tNear = fmin(t0, t1);
+	float4 tFar = fmax(t0, t1);
+
+	float enter = fmax(fmax(tNear.x, tNear.y), fmax(tNear.z, tMin));
+	float exit = fmin(fmin(tFar.x, tFar.y), fmin(tFar.z, tMax));
 
-	for (int i = 0; i < scene->sphere_count; i++)
+	return enter <= exit ? enter : INFINITY;
+}
+
+// Closest hit among the primitives of the tree at bvh: the spheres, or with
+// mesh the triangles of an object, whose leaves count from triangle first.
+// Only hits before *closest count, which is updated along with *hit.
+void ClosestInTree(float4 o, float4 d, float4 invD, float tMin, float tMax, const rt_world *world,
+	__global const rt_bvh_node *bvh, bool mesh, int first, float *closestHit, int *hit)
+{
+	float closest = *closestHit;
+	int hit_index = *hit;
+
+	int stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+	int nodeIndex = 0;
+
+	while (true)
 	{
-		float t = IntersectRaySphere(o, d, tMin, scene->spheres + i);
+		__global const rt_bvh_node *node = bvh + nodeIndex;
+
+		if (node->count > 0)
+		{
+			for (int i = node->left_first; i < node->left_first + node->count; i++)
+			{
+#ifdef HAS_MESHES
+				float t = mesh ? IntersectRayTriangle(o, d, tMin, world->triangles[first + i], world->vertices)
+					: IntersectRaySphere(o, d, tMin, world->spheres[i]);
+#else
+				float t = IntersectRaySphere(o, d, tMin, world->spheres[i]);
+#endif
 
-		if (t >= tMin && t <= tMax && t < closest)
+				if (t >= tMin && t <= tMax && t < closest)
+				{
+					closest = t;
+					hit_index = mesh ? world->scene->sphere_count + first + i : i;
+				}
+			}
+		}
+		else
 		{
-			closest = t;
-			sphere_index = i;
+			// visit the nearer child first, the other one waits on the stack
+			int nearChild = node->left_first;
+			int farChild = nearChild + 1;
+			float tNear = IntersectRayBox(o, invD, tMin, fmin(tMax, closest), bvh + nearChild);
+			float tFar = IntersectRayBox(o, invD, tMin, fmin(tMax, closest), bvh + farChild);
+			if (tFar < tNear)
+			{
+				int tmpIndex = nearChild; nearChild = farChild; farChild = tmpIndex;
+				float tmp = tNear; tNear = tFar; tFar = tmp;
+			}
+
+			if (tNear != INFINITY)
+			{
+				if (tFar != INFINITY)
+					stack[stackSize++] = farChild;
+				nodeIndex = nearChild;
+				continue;
+			}
 		}
+
+		if (stackSize == 0) break;
+		nodeIndex = stack[--stackSize];
 	}
 
-	*t = closest;
-	*sphereIndex = sphere_index;
+	*closestHit = closest;
+	*hit = hit_index;
 }
 
-float ComputeLighting(float4 point, float4 normal, __constant rt_scene *scene, float4 view, int specular)
+#ifdef HAS_MESHES
+// Closest triangle hit through the top-level tree: every instance whose world
+// bounds the ray enters traces the ray in object space through its object's
+// tree. *hitInstance is updated along with *hit.
+void ClosestInstance(float4 o, float4 d, float4 invD, float tMin, float tMax, const rt_world *world,
+	float *closestHit, int *hit, int *hitInstance)
 {
-	float sum = 0;
-	float4 L;
+	__global const rt_bvh_node *bvh = world->instanceBvh;
+	float closest = *closestHit;
+	int hit_index = *hit;
+	int hit_instance = *hitInstance;
 
-	for (int i = 0; i < scene->light_count; i++)
+	int stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+	int nodeIndex = 0;
+
+	while (true)
 	{
-		__constant rt_light *light = scene->lights + i;
-		if (light->type == Ambient) {
-			sum += light->intensity;
+		__global const rt_bvh_node *node = bvh + nodeIndex;
+
+		if (node->count > 0)
+		{
+			for (int i = node->left_first; i < node->left_first + node->count; i++)
+			{
+				__global const rt_instance *instance = world->instances + i;
+				float4 objectO = ToObject(instance->world_to_object, o, 1);
+				float4 objectD = ToObject(instance->world_to_object, d, 0);
+				int before = hit_index;
+				ClosestInTree(objectO, objectD, 1.0f / objectD, tMin, tMax, world, world->meshBvh + instance->root, true,
+					instance->first_triangle, &closest, &hit_index);
+				if (hit_index != before)
+					hit_instance = i;
+			}
 		}
-		else {
-			float tMax = 0;
-			if (light->type == Point) {
-				L = light->position - point;
-				tMax = 1;
+		else
+		{
+			int nearChild = node->left_first;
+			int farChild = nearChild + 1;
+			float tNear = IntersectRayBox(o, invD, tMin, fmin(tMax, closest), bvh + nearChild);
+			float tFar = IntersectRayBox(o, invD, tMin, fmin(tMax, closest), bvh + farChild);
+			if (tFar < tNear)
+			{
+				int tmpIndex = nearChild; nearChild = farChild; farChild = tmpIndex;
+				float tmp = tNear; tNear = tFar; tFar = tmp;
 			}
-			if (light->type == Direct) {
-				L = light->direction;
-				tMax = INFINITY;
+
+			if (tNear != INFINITY)
+			{
+				if (tFar != INFINITY)
+					stack[stackSize++] = farChild;
+				nodeIndex = nearChild;
+				continue;
 			}
+		}
 
-			#ifdef SHADOW_ENABLED
-			int sphereIndex;
-			float t;
-			ClosestIntersection(point, L, T_MIN, tMax, scene, &t, &sphereIndex);
-			if (sphereIndex != -1) continue;
-			#endif
+		if (stackSize == 0) break;
+		nodeIndex = stack[--stackSize];
+	}
+
+	*closestHit = closest;
+	*hit = hit_index;
+	*hitInstance = hit_instance;
+}
+#endif
 
-			float nDotL = dot(normal, L);
-			if (nDotL > 0) {
-				sum += light->intensity * nDotL / (length(normal) * length(L));
+// Closest sphere or triangle hit within [tMin, tMax], hitIndex is -1 for a
+// miss. hitInstance is the instance of a triangle hit, -1 otherwise.
+void ClosestIntersection(float4 o, float4 d, float tMin, float tMax, const rt_world *world, float *t, int *hitIndex, int *hitInstance) {
+	float4 invD = 1.0f / d;
+	float closest = INFINITY;
+	int hit = -1;
+	int instance = -1;
+
+	if (world->scene->sphere_count > 0)
+		ClosestInTree(o, d, invD, tMin, tMax, world, world->bvh, false, 0, &closest, &hit);
+#ifdef HAS_MESHES
+	// the sphere hit already bounds the mesh traversal
+	if (world->scene->instance_count > 0)
+		ClosestInstance(o, d, invD, tMin, tMax, world, &closest, &hit, &instance);
+#endif
+
+	*t = closest;
+	*hitIndex = hit;
+	*hitInstance = instance;
+}
+
+// Any-hit query for shadow rays in the tree at bvh: returns as soon as some
+// primitive is hit within [tMin, tMax], so there is no closest hit to track
+// and no child ordering to keep. Triangles are counted from first as in
+// ClosestInTree.
+bool OccludedInTree(float4 o, float4 d, float4 invD, float tMin, float tMax, const rt_world *world,
+	__global const rt_bvh_node *bvh, bool mesh, int first)
+{
+	int stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+	int nodeIndex = 0;
+
+	while (true)
+	{
+		__global const rt_bvh_node *node = bvh + nodeIndex;
+
+		if (node->count > 0)
+		{
+			for (int i = node->left_first; i < node->left_first + node->count; i++)
+			{
+#ifdef HAS_MESHES
+				float t = mesh ? IntersectRayTriangle(o, d, tMin, world->triangles[first + i], world->vertices)
+					: IntersectRaySphere(o, d, tMin, world->spheres[i]);
+#else
+				float t = IntersectRaySphere(o, d, tMin, world->spheres[i]);
+#endif
+
+				// a miss is INFINITY, which tMax of a directional light would let through
+				if (t <= tMax && t != INFINITY)
+					return true;
+			}
+		}
+		else
+		{
+			int leftChild = node->left_first;
+			int rightChild = leftChild + 1;
+			bool hitLeft = IntersectRayBox(o, invD, tMin, tMax, bvh + leftChild) != INFINITY;
+			bool hitRight = IntersectRayBox(o, invD, tMin, tMax, bvh + rightChild) != INFINITY;
+
+			if (hitLeft)
+			{
+				if (hitRight)
+					stack[stackSize++] = rightChild;
+				nodeIndex = leftChild;
+				continue;
+			}
+			if (hitRight)
+			{
+				nodeIndex = rightChild;
+				continue;
 			}
+		}
+
+		if (stackSize == 0) break;
+		nodeIndex = stack[--stackSize];
+	}
+
+	return false;
+}
+
+#ifdef HAS_MESHES
+// OccludedInTree through the top-level tree and the trees of the instances
+bool OccludedInstance(float4 o, float4 d, float4 invD, float tMin, float tMax, const rt_world *world)
+{
+	__global const rt_bvh_node *bvh = world->instanceBvh;
+	int stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+	int nodeIndex = 0;
+
+	while (true)
+	{
+		__global const rt_bvh_node *node = bvh + nodeIndex;
 
-			if (specular <= 0) continue;
+		if (node->count > 0)
+		{
+			for (int i = node->left_first; i < node->left_first + node->count; i++)
+			{
+				__global const rt_instance *instance = world->instances + i;
+				float4 objectO = ToObject(instance->world_to_object, o, 1);
+				float4 objectD = ToObject(instance->world_to_object, d, 0);
+				if (OccludedInTree(objectO, objectD, 1.0f / objectD, tMin, tMax, world, world->meshBvh + instance->root, true,
+						instance->first_triangle))
+					return true;
+			}
+		}
+		else
+		{
+			int leftChild = node->left_first;
+			int rightChild = leftChild + 1;
+			bool hitLeft = IntersectRayBox(o, invD, tMin, tMax, bvh + leftChild) != INFINITY;
+			bool hitRight = IntersectRayBox(o, invD, tMin, tMax, bvh + rightChild) != INFINITY;
 
-			float4 r = ReflectRay(L, normal);
-			float rDotV = dot (r, view);
-			if (rDotV > 0)
+			if (hitLeft)
+			{
+				if (hitRight)
+					stack[stackSize++] = rightChild;
+				nodeIndex = leftChild;
+				continue;
+			}
+			if (hitRight)
 			{
-				sum += light->intensity * pow(rDotV / (length(r) * length(view)), specular);
+				nodeIndex = rightChild;
+				continue;
 			}
 		}
+
+		if (stackSize == 0) break;
+		nodeIndex = stack[--stackSize];
 	}
+
+	return false;
+}
+#endif
+
+bool Occluded(float4 o, float4 d, float tMin, float tMax, const rt_world *world) {
+	float4 invD = 1.0f / d;
+	if (world->scene->sphere_count > 0 && OccludedInTree(o, d, invD, tMin, tMax, world, world->bvh, false, 0))
+		return true;
+#ifdef HAS_MESHES
+	if (world->scene->instance_count > 0)
+		return OccludedInstance(o, d, invD, tMin, tMax, world);
+#endif
+	return false;
+}
+
+// Smooth window reaching zero at the radius of a point light, L points from
+// the shaded point to the light
+float PointLightFalloff(float4 L, float radius)
+{
+	float window = 1 - dot(L, L) / (radius * radius);
+	return window > 0 ? window * window : 0;
+}
+
+#ifdef LIGHT_GRID
+// Lights that can reach point, as a range of world->lightIndices
+int2 LightCell(float4 point, const rt_world *world)
+{
+	__constant rt_scene *scene = world->scene;
+	const int4 dims = scene->light_grid_dims;
+	float4 cell = floor((point - scene->light_grid_min) / scene->light_grid_cell);
+	// the last cell lists the lights that reach everywhere
+	int index = dims.w - 1;
+	if (cell.x >= 0 && cell.y >= 0 && cell.z >= 0 && cell.x < dims.x && cell.y < dims.y && cell.z < dims.z)
+		index = ((int)cell.z * dims.y + (int)cell.y) * dims.x + (int)cell.x;
+	return world->lightCells[index];
+}
+#endif
+
+// Adds the light reaching point from light, diffuse and specular, scaled by weight
+void AddLight(float *sum, float4 point, float4 normal, __global const rt_light *light, float weight, const rt_world *world, float4 view, int specular)
+{
+	float intensity = light->intensity * weight;
+	#ifdef HAS_AMBIENT_LIGHT
+	if (light->type == Ambient) {
+		*sum += intensity;
+		return;
+	}
+	#endif
+	#if defined(HAS_POINT_LIGHT) || defined(HAS_DIRECT_LIGHT)
+	float4 L;
+	float tMax = 0;
+	#if defined(HAS_POINT_LIGHT) && defined(HAS_DIRECT_LIGHT)
+	if (light->type == Point) {
+		L = light->position - point;
+		tMax = 1;
+	}
+	if (light->type == Direct) {
+		L = light->direction;
+		tMax = INFINITY;
+	}
+	#elif defined(HAS_POINT_LIGHT)
+	L = light->position - point;
+	tMax = 1;
+	#else
+	L = light->direction;
+	tMax = INFINITY;
+	#endif
+
+	#ifdef HAS_POINT_LIGHT
+	if (light->type == Point && light->radius > 0) {
+		// out of reach, not even a shadow ray
+		float falloff = PointLightFalloff(L, light->radius);
+		if (falloff <= 0) return;
+		intensity *= falloff;
+	}
+	#endif
+
+	#ifdef SHADOW_ENABLED
+	if (Occluded(point, L, T_MIN, tMax, world)) return;
+	#endif
+
+	float nDotL = dot(normal, L);
+	if (nDotL > 0) {
+		*sum += intensity * nDotL / (length(normal) * length(L));
+	}
+
+	#ifdef HAS_SPECULAR
+	if (specular <= 0) return;
+
+	float4 r = ReflectRay(L, normal);
+	float rDotV = dot (r, view);
+	if (rDotV > 0)
+	{
+		*sum += intensity * pow(rDotV / (length(r) * length(view)), specular);
+	}
+	#endif
+	#endif
+}
+
+#ifdef LIGHT_SAMPLES
+// PCG hash, the sample streams of neighbouring pixels are unrelated
+uint Hash(uint x)
+{
+	uint state = x * 747796405u + 2891336453u;
+	uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+// Uniform in [0, 1), advances the state
+float RandomFloat(uint *state)
+{
+	*state = Hash(*state);
+	return (*state >> 8) * (1.0f / 16777216.0f);
+}
+
+// Estimated contribution of the lights below node at point: their intensity
+// over the squared distance to the node centre, which is not allowed to drop
+// below the node size so a point inside a cluster does not favour it without
+// bound. 0 when point is out of reach of all of them.
+float LightImportance(__global const rt_light_node *node, float4 point)
+{
+	if (node->reach > 0) {
+		float4 outside = fmax(fmax(node->bbox_min - point, point - node->bbox_max), 0.0f);
+		if (dot(outside, outside) >= node->reach * node->reach) return 0;
+	}
+	float4 d = point - (node->bbox_min + node->bbox_max) * 0.5f;
+	float4 extent = node->bbox_max - node->bbox_min;
+	float d2 = fmax(dot(d, d), 0.25f * dot(extent, extent));
+	return node->intensity / fmax(d2, 1e-4f);
+}
+
+// Walks the light tree choosing children in proportion to their importance;
+// returns the light of the leaf reached and the probability of reaching it in
+// *pdf, or -1 if no light matters at point
+int SampleLight(float4 point, const rt_world *world, uint *rng, float *pdf)
+{
+	__global const rt_light_node *nodes = world->lightNodes;
+	float u = RandomFloat(rng);
+	float p = 1;
+	int index = 0;
+	while (nodes[index].light < 0)
+	{
+		const int left = nodes[index].left;
+		const float wLeft = LightImportance(nodes + left, point);
+		const float wRight = LightImportance(nodes + left + 1, point);
+		if (wLeft + wRight <= 0) return -1;
+		// u is rescaled to the chosen side and reused for the next level
+		const float pLeft = wLeft / (wLeft + wRight);
+		if (u < pLeft) {
+			u = u / pLeft;
+			p *= pLeft;
+			index = left;
+		} else {
+			u = (u - pLeft) / (1 - pLeft);
+			p *= 1 - pLeft;
+			index = left + 1;
+		}
+		u = fmin(u, 0.99999994f);
+	}
+	*pdf = p;
+	return nodes[index].light;
+}
+#endif
+
+float ComputeLighting(float4 point, float4 normal, const rt_world *world, float4 view, int specular
+#ifdef LIGHT_SAMPLES
+	, uint *rng
+#endif
+	)
+{
+	float sum = 0;
+
+#if defined(LIGHT_SAMPLES)
+	// LIGHT_SAMPLES point lights picked from the tree, each weighted by
+	// 1 / (pdf * LIGHT_SAMPLES) so the expected sum is that of every light
+	for (int j = 0; j < world->scene->light_global_count; j++)
+		AddLight(&sum, point, normal, world->lights + world->globalLights[j], 1, world, view, specular);
+	for (int s = 0; s < LIGHT_SAMPLES; s++)
+	{
+		float pdf;
+		int light = SampleLight(point, world, rng, &pdf);
+		if (light >= 0)
+			AddLight(&sum, point, normal, world->lights + light, 1 / (pdf * LIGHT_SAMPLES), world, view, specular);
+	}
+#elif defined(LIGHT_GRID)
+	const int2 cell = LightCell(point, world);
+	for (int j = cell.x; j < cell.x + cell.y; j++)
+		AddLight(&sum, point, normal, world->lights + world->lightIndices[j], 1, world, view, specular);
+#else
+	UNROLL
+	for (int i = 0; i < SCENE_LIGHT_COUNT; i++)
+		AddLight(&sum, point, normal, world->lights + i, 1, world, view, specular);
+#endif
 	return sum;
 }
 
-float4 TraceRay(float4 o, float4 d, float tMin, float tMax,
-	__constant rt_scene *scene)
+float4 TraceRay(float4 o, float4 d, float tMin, float tMax, const rt_world *world
+#ifdef LIGHT_SAMPLES
+	, uint *rng
+#endif
+	)
 {
-	if (scene->reflect_depth == 0) return (float4)(0,0,0,0);
+	__constant rt_scene *scene = world->scene;
+
+	if (SCENE_REFLECT_DEPTH == 0) return (float4)(0,0,0,0);
 
 	float closest;
-	int sphere_index;
+	int hit, instance;
 
 	float4 colors[MAX_RECURSION_DEPTH];
     float reflects[MAX_RECURSION_DEPTH];
 
 	int recursionCount = 0;
 
-	for (int i = 0; i < scene->reflect_depth; i++)
+	UNROLL
+	for (int i = 0; i < SCENE_REFLECT_DEPTH; i++)
 	{
-		ClosestIntersection(o, d, tMin, tMax, scene, &closest, &sphere_index);
+		ClosestIntersection(o, d, tMin, tMax, world, &closest, &hit, &instance);
 		
-		if (sphere_index == -1)
+		if (hit == -1)
 		{
 			colors[recursionCount] = scene->bg_color;
 			reflects[recursionCount] = 0;
 			++recursionCount;
 			break;
 		}
-		__constant rt_sphere *sphere = scene->spheres+sphere_index;
+		__global const rt_material *material = HitMaterial(hit, instance, world);
 		float4 p = o + (d * closest);
-		float4 normal = normalize(p - sphere->center);
-
-		//good for surfaces, bad for box, sphere
-		// if (dot(normal, d) > 0)
-		// {
-		// 	normal = -normal;
-		// }
+		float4 normal = SurfaceNormal(p, d, hit, instance, world);
 		float4 view = -d;
-		colors[recursionCount] = sphere->color * ComputeLighting(p, normal, scene, view, sphere->specular);
-		reflects[recursionCount] = sphere->reflect;
+#ifdef LIGHT_SAMPLES
+		colors[recursionCount] = material->color * ComputeLighting(p, normal, world, view, material->specular, rng);
+#else
+		colors[recursionCount] = material->color * ComputeLighting(p, normal, world, view, material->specular);
+#endif
+		reflects[recursionCount] = material->reflect;
 		++recursionCount;
-		if (recursionCount >= MAX_RECURSION_DEPTH || sphere->reflect <= 0 || scene->reflect_depth == 1)
+		if (recursionCount >= MAX_RECURSION_DEPTH || material->reflect <= 0 || SCENE_REFLECT_DEPTH == 1)
 			break;
 
-		if (i < scene->reflect_depth - 1) {
+		if (i < SCENE_REFLECT_DEPTH - 1) {
 			//setup for next iteration
 			o = p;
 			d = ReflectRay(view, normal);
@@ -248,21 +827,533 @@ float4 TraceRay(float4 o, float4 d, float tMin, float tMax,
 	return totalColor;
 }
 
+#ifdef ACCUMULATE
+float4 Accumulate(__global float4 *mean, float4 color, int sample)
+{
+	if (sample > 0)
+		color = *mean + (color - *mean) / (sample + 1);
+	*mean = color;
+	return color;
+}
+#endif
+
+// Traces pixel (x, y) of a width x height canvas and writes it to output
+void TracePixel(int x, int y, int width, int height, __write_only image2d_t output, rt_world *world, const rt_camera_frame *camera
+#ifdef ACCUMULATE
+	, __global float4 *history,
+	float2 jitter,
+	int sample
+#endif
+	)
+{
+	int xCartesian = x - width / 2.0f;
+	int yCartesian = height / 2.0f - y;
+
+#ifdef ACCUMULATE
+	float4 d = CanvasToViewport(xCartesian + jitter.x, yCartesian + jitter.y, camera);
+#else
+	float4 d = CanvasToViewport(xCartesian, yCartesian, camera);
+#endif
+#ifdef LIGHT_SAMPLES
+	// a new light sample per pixel in every accumulated frame
+#ifdef ACCUMULATE
+	uint rng = Hash((y * width + x) ^ Hash(sample));
+#else
+	uint rng = Hash(y * width + x);
+#endif
+	float4 color = TraceRay(camera->origin, d, T_MIN, INFINITY, world, &rng);
+#else
+	float4 color = TraceRay(camera->origin, d, T_MIN, INFINITY, world);
+#endif
+
+#ifdef ACCUMULATE
+	color = Accumulate(history + y * width + x, color, sample);
+#endif
+	write_imagef(output, (int2)(x, y), color);
+}
+
+// With -DPERSISTENT rt runs a fixed number of TILE_SIZE x TILE_SIZE work-groups
+// that keep taking the next tile from the tiles counter (zeroed by the host
+// before the launch) until the frame is done, so a group that drew cheap tiles
+// moves on instead of the frame waiting for the groups stuck in reflective ones.
+// Without it rt is launched with one work-item per pixel. TILE_SIZE comes
+// from the host along with -DPERSISTENT.
+
 __kernel void rt(
 	__constant rt_scene *scene,
-	__write_only image2d_t output)
+	__write_only image2d_t output,
+	__global const rt_bvh_node *bvh,
+	__global const float4 *spheres,
+	__global const rt_light *lights,
+	rt_camera_frame camera
+#ifdef ACCUMULATE
+	, __global float4 *history,
+	float2 jitter,
+	int sample
+#endif
+#ifdef PERSISTENT
+	, __global uint *tiles
+#endif
+	)
 {
+	const int width = scene->canvas_width;
+	const int height = scene->canvas_height;
+
+	rt_world world = MakeWorld(scene, bvh, spheres, lights);
+
+#ifdef ACCUMULATE
+#define TRACE_PIXEL(x, y) TracePixel(x, y, width, height, output, &world, &camera, history, jitter, sample)
+#else
+#define TRACE_PIXEL(x, y) TracePixel(x, y, width, height, output, &world, &camera)
+#endif
+
+#ifdef PERSISTENT
+	__local uint tile;
+	const uint tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+	const uint tileCount = tilesX * ((height + TILE_SIZE - 1) / TILE_SIZE);
+	const int lx = get_local_id(0);
+	const int ly = get_local_id(1);
+
+	while (true) {
+		if (lx == 0 && ly == 0)
+			tile = atomic_inc(tiles);
+		barrier(CLK_LOCAL_MEM_FENCE);
+		const uint t = tile;
+		// nobody overwrites tile before everyone has read it
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (t >= tileCount) return;
+
+		const int x = (t % tilesX) * TILE_SIZE + lx;
+		const int y = (t / tilesX) * TILE_SIZE + ly;
+		if (x < width && y < height)
+			TRACE_PIXEL(x, y);
+	}
+#else
 	const int x = get_global_id(0);
 	const int y = get_global_id(1);
+
+	if (x >= width || y >= height) return;
+	TRACE_PIXEL(x, y);
+#endif
+#undef TRACE_PIXEL
+}
+// Wavefront pipeline: the same image as rt, traced in passes that each do one
+// thing for every live path, with the paths kept in compacted global queues.
+// Per frame the host runs wf_generate, then per bounce wf_extend, wf_shadow,
+// wf_connect and wf_shade, and finally wf_output. Paths that end drop out of
+// the queue, so later passes run only on the survivors instead of leaving
+// their lanes idle inside TraceRay. wf_shadow appends the shadow rays of a
+// path towards all its lights as one block, wf_connect clears the blocked
+// ones and wf_shade adds the block to the pixel, so with one path per pixel
+// the accumulation stays free of atomics; only the queue appends use them.
+//
+// The reflection blend of TraceRay is applied front to back: a path carries
+// the product of the reflect factors so far, and every surface adds its colour
+// weighted by that product, times (1 - reflect) unless the path ends there.
+
+// counters[bounce] is the number of paths entering that bounce. The host
+// passes the layout, the defaults only serve a standalone build.
+#ifndef WF_SHADOW_COUNTER
+#define WF_SHADOW_COUNTER (MAX_RECURSION_DEPTH + 1)
+#endif
+#ifndef WF_COUNTERS
+#define WF_COUNTERS (MAX_RECURSION_DEPTH + 2)
+#endif
+// Lights per path a wf_shadow pass handles, the host runs more passes for
+// paths that see more
+#ifndef WF_SHADOW_SLOTS
+#define WF_SHADOW_SLOTS 4
+#endif
+
+typedef struct {
+	float4 o;
+	float4 d;
+	float throughput;	// product of the reflect factors of the surfaces before this one
+	int pixel;
+	float t;			// closest hit, written by wf_extend
+	int sphere;			// sphere or sphere_count + triangle hit, -1 for a miss
+	int instance;		// of a triangle hit
+	int shadowFirst;	// block of shadow rays of the last wf_shadow pass
+	int shadowCount;
+} wf_ray;
+
+// The origin and direction follow from the path's hit and the light
+typedef struct {
+	float4 contribution;	// added to the pixel if nothing blocks the ray, cleared by wf_connect otherwise
+	int path;				// in the queue of the bounce
+	int light;
+} wf_shadow_ray;
+
+// Work-group aggregated queue append of count entries per item: one global
+// atomic per group instead of one per item. Every item of the group has to
+// call it, pushing or not. Returns the first index of the item's entries.
+int QueuePush(uint count, volatile __global uint *counter, volatile __local uint *groupCount, volatile __local uint *groupBase)
+{
+	if (get_local_id(0) == 0)
+		*groupCount = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	uint index = count > 0 ? atomic_add(groupCount, count) : 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (get_local_id(0) == 0)
+		*groupBase = atomic_add(counter, *groupCount);
+	barrier(CLK_LOCAL_MEM_FENCE);
+	return count > 0 ? (int)(*groupBase + index) : -1;
+}
+
+// Whether the path continues after the surface it hit on this bounce
+bool PathContinues(__global const rt_material *material, int bounce, const rt_world *world)
+{
+	return material->reflect > 0 && bounce + 1 < min(SCENE_REFLECT_DEPTH, MAX_RECURSION_DEPTH);
+}
+
+#ifdef HAS_AMBIENT_LIGHT
+float AmbientLight(const rt_world *world)
+{
+	float sum = 0;
+	UNROLL
+	for (int i = 0; i < SCENE_LIGHT_COUNT; i++)
+	{
+		if (world->lights[i].type == Ambient)
+			sum += world->lights[i].intensity;
+	}
+	return sum;
+}
+#endif
+
+// Lights a hit at point may see, as a range of world->lightIndices with the
+// grid and of the lights otherwise
+int2 LightList(float4 point, const rt_world *world)
+{
+#ifdef LIGHT_GRID
+	return LightCell(point, world);
+#else
+	return (int2)(0, SCENE_LIGHT_COUNT);
+#endif
+}
+
+int LightListEntry(int j, const rt_world *world)
+{
+#ifdef LIGHT_GRID
+	return world->lightIndices[j];
+#else
+	return j;
+#endif
+}
+
+// Direction from point towards a point or directional light, and the end of
+// the shadow ray along it
+float4 LightVector(float4 point, __global const rt_light *light, float *tMax)
+{
+	if (light->type == Point) {
+		*tMax = 1;
+		return light->position - point;
+	}
+	*tMax = INFINITY;
+	return light->direction;
+}
+
+// Diffuse and specular term a non-ambient light adds at point if visible, 0
+// for a light out of reach
+float LightTerm(float4 point, float4 normal, float4 view, __global const rt_light *light, int specular)
+{
+	float tMax;
+	float4 L = LightVector(point, light, &tMax);
+
+	// a point out of reach gets no shadow ray, its sum stays 0
+	float intensity = light->intensity;
+	if (light->type == Point && light->radius > 0) {
+		float falloff = PointLightFalloff(L, light->radius);
+		if (falloff <= 0) return 0;
+		intensity *= falloff;
+	}
+
+	float sum = 0;
+	float nDotL = dot(normal, L);
+	if (nDotL > 0) {
+		sum += intensity * nDotL / (length(normal) * length(L));
+	}
+
+	#ifdef HAS_SPECULAR
+	if (specular > 0)
+	{
+		float4 r = ReflectRay(L, normal);
+		float rDotV = dot (r, view);
+		if (rDotV > 0)
+		{
+			sum += intensity * pow(rDotV / (length(r) * length(view)), specular);
+		}
+	}
+	#endif
+	return sum;
+}
+
+// Light of the path's last block of shadow rays that reached it, in light order
+float4 ConnectedLight(const wf_ray *ray, __global const wf_shadow_ray *shadows)
+{
+	float4 sum = (float4)(0,0,0,0);
+	for (int j = 0; j < ray->shadowCount; j++)
+		sum += shadows[ray->shadowFirst + j].contribution;
+	return sum;
+}
+
+__kernel void wf_generate(
+	__constant rt_scene *scene,
+	__global const rt_bvh_node *bvh,
+	__global const float4 *spheres,
+	__global const rt_light *lights,
+	__global wf_ray *rays,
+	__global float4 *accum,
+	__global uint *counters,
+	rt_camera_frame camera
+#ifdef ACCUMULATE
+	, float2 jitter
+#endif
+	)
+{
+	const int i = get_global_id(0);
 	const int width = scene->canvas_width;
 	const int height = scene->canvas_height;
 
-	if (x >= width || y >= height) return;
+	if (i == 0)
+		counters[0] = width * height;
+	if (i >= width * height) return;
+
+	const int x = i % width;
+	const int y = i / width;
 	int xCartesian = x - width / 2.0f;
 	int yCartesian = height / 2.0f - y;
 
-	float4 d = CanvasToViewport(xCartesian, yCartesian, scene);
-	float4 color = TraceRay(scene->camera_pos, d, T_MIN, INFINITY, scene);
+	wf_ray ray;
+	ray.o = camera.origin;
+#ifdef ACCUMULATE
+	ray.d = CanvasToViewport(xCartesian + jitter.x, yCartesian + jitter.y, &camera);
+#else
+	ray.d = CanvasToViewport(xCartesian, yCartesian, &camera);
+#endif
+	ray.throughput = 1;
+	ray.pixel = i;
+	ray.t = INFINITY;
+	ray.sphere = -1;
+	ray.instance = -1;
+	ray.shadowFirst = 0;
+	ray.shadowCount = 0;
+	rays[i] = ray;
+	accum[i] = (float4)(0,0,0,0);
+}
 
-	write_imagef(output, (int2)(x, y), color);
-}
\ No newline at end of file
+__kernel void wf_extend(
+	__constant rt_scene *scene,
+	__global const rt_bvh_node *bvh,
+	__global const float4 *spheres,
+	__global const rt_light *lights,
+	__global wf_ray *rays,
+	__global const uint *counters,
+	int bounce)
+{
+	const uint i = get_global_id(0);
+	if (i >= counters[bounce]) return;
+
+	rt_world world = MakeWorld(scene, bvh, spheres, lights);
+
+	float4 o = rays[i].o;
+	float4 d = rays[i].d;
+	float t;
+	int sphere, instance;
+	ClosestIntersection(o, d, T_MIN, INFINITY, &world, &t, &sphere, &instance);
+	rays[i].t = t;
+	rays[i].sphere = sphere;
+	rays[i].instance = instance;
+}
+
+// Misses, ambient light and the shadow rays wf_connect let through go to the
+// pixel, reflective hits append the reflected ray to the next queue
+__kernel void wf_shade(
+	__constant rt_scene *scene,
+	__global const rt_bvh_node *bvh,
+	__global const float4 *spheres,
+	__global const rt_light *lights,
+	__global const wf_ray *rays,
+	__global wf_ray *nextRays,
+	__global const wf_shadow_ray *shadows,
+	__global float4 *accum,
+	volatile __global uint *counters,
+	int bounce)
+{
+	__local uint groupCount;
+	__local uint groupBase;
+	const uint i = get_global_id(0);
+
+	rt_world world = MakeWorld(scene, bvh, spheres, lights);
+
+	bool push = false;
+	wf_ray next;
+	if (i < counters[bounce])
+	{
+		wf_ray ray = rays[i];
+		if (ray.sphere == -1)
+		{
+			accum[ray.pixel] += ray.throughput * scene->bg_color;
+		}
+		else
+		{
+			__global const rt_material *material = HitMaterial(ray.sphere, ray.instance, &world);
+			float4 p = ray.o + (ray.d * ray.t);
+			float4 normal = SurfaceNormal(p, ray.d, ray.sphere, ray.instance, &world);
+			bool continues = PathContinues(material, bounce, &world);
+			float weight = continues ? ray.throughput * (1 - material->reflect) : ray.throughput;
+
+			float4 light = ConnectedLight(&ray, shadows);
+			#ifdef HAS_AMBIENT_LIGHT
+			light += weight * material->color * AmbientLight(&world);
+			#endif
+			accum[ray.pixel] += light;
+
+			if (continues)
+			{
+				next.o = p;
+				next.d = ReflectRay(-ray.d, normal);
+				next.throughput = ray.throughput * material->reflect;
+				next.pixel = ray.pixel;
+				next.t = INFINITY;
+				next.sphere = -1;
+				next.instance = -1;
+				next.shadowFirst = 0;
+				next.shadowCount = 0;
+				push = true;
+			}
+		}
+	}
+
+	int slot = QueuePush(push, counters + bounce + 1, &groupCount, &groupBase);
+	if (push)
+		nextRays[slot] = next;
+}
+
+// Shadow rays from every hit of the bounce towards the lights at positions
+// firstLight to firstLight + WF_SHADOW_SLOTS of its light list, each carrying
+// the diffuse and specular term it adds if the light is visible. The rays of a
+// path form one block in light order. A pass after the first one adds the
+// previous block to the pixel; the host alternates such passes between two
+// halves of the queue, so that block is not refilled meanwhile.
+__kernel void wf_shadow(
+	__constant rt_scene *scene,
+	__global const rt_bvh_node *bvh,
+	__global const float4 *spheres,
+	__global const rt_light *lights,
+	__global wf_ray *rays,
+	__global wf_shadow_ray *shadows,
+	__global float4 *accum,
+	volatile __global uint *counters,
+	int bounce,
+	int firstLight)
+{
+	__local uint groupCount;
+	__local uint groupBase;
+	const uint i = get_global_id(0);
+
+	rt_world world = MakeWorld(scene, bvh, spheres, lights);
+
+	const bool hit = i < counters[bounce] && rays[i].sphere != -1;
+	wf_ray ray;
+	__global const rt_material *material;
+	float4 p, normal, view;
+	int2 list;
+	uint count = 0;
+	if (hit)
+	{
+		ray = rays[i];
+		if (firstLight > 0)
+			accum[ray.pixel] += ConnectedLight(&ray, shadows);
+
+		material = HitMaterial(ray.sphere, ray.instance, &world);
+		p = ray.o + (ray.d * ray.t);
+		normal = SurfaceNormal(p, ray.d, ray.sphere, ray.instance, &world);
+		view = -ray.d;
+		list = LightList(p, &world);
+		list.y = min(list.x + list.y, list.x + firstLight + WF_SHADOW_SLOTS);
+		list.x += firstLight;
+		for (int j = list.x; j < list.y; j++)
+		{
+			__global const rt_light *light = lights + LightListEntry(j, &world);
+			if (light->type != Ambient && LightTerm(p, normal, view, light, material->specular) > 0)
+				count++;
+		}
+	}
+
+	// the terms are cheap next to the traversal in wf_connect, so they are
+	// computed again rather than kept per light until the block is placed
+	int slot = QueuePush(count, counters + WF_SHADOW_COUNTER, &groupCount, &groupBase);
+	if (hit)
+	{
+		rays[i].shadowFirst = slot;
+		rays[i].shadowCount = count;
+		float weight = PathContinues(material, bounce, &world) ? ray.throughput * (1 - material->reflect) : ray.throughput;
+		for (int j = list.x; j < list.y; j++)
+		{
+			const int lightIndex = LightListEntry(j, &world);
+			__global const rt_light *light = lights + lightIndex;
+			if (light->type == Ambient) continue;
+			float sum = LightTerm(p, normal, view, light, material->specular);
+			if (sum > 0)
+			{
+				wf_shadow_ray shadow;
+				shadow.contribution = weight * material->color * sum;
+				shadow.path = i;
+				shadow.light = lightIndex;
+				shadows[slot++] = shadow;
+			}
+		}
+	}
+}
+
+// Clears the shadow rays from first on that something blocks, wf_shade or
+// the next wf_shadow pass adds the rest to their pixels
+__kernel void wf_connect(
+	__constant rt_scene *scene,
+	__global const rt_bvh_node *bvh,
+	__global const float4 *spheres,
+	__global const rt_light *lights,
+	__global const wf_ray *rays,
+	__global wf_shadow_ray *shadows,
+	__global const uint *counters,
+	uint first)
+{
+	const uint i = first + get_global_id(0);
+	if (i >= counters[WF_SHADOW_COUNTER]) return;
+
+	rt_world world = MakeWorld(scene, bvh, spheres, lights);
+
+	#ifdef SHADOW_ENABLED
+	const int path = shadows[i].path;
+	float4 p = rays[path].o + (rays[path].d * rays[path].t);
+	float tMax;
+	float4 L = LightVector(p, lights + shadows[i].light, &tMax);
+	if (Occluded(p, L, T_MIN, tMax, &world))
+		shadows[i].contribution = (float4)(0,0,0,0);
+	#endif
+}
+
+__kernel void wf_output(
+	__constant rt_scene *scene,
+	__global const rt_bvh_node *bvh,
+	__global const float4 *spheres,
+	__global const rt_light *lights,
+	__global const float4 *accum,
+	__write_only image2d_t output
+#ifdef ACCUMULATE
+	, __global float4 *history,
+	int sample
+#endif
+	)
+{
+	const int i = get_global_id(0);
+	const int width = scene->canvas_width;
+	const int height = scene->canvas_height;
+	if (i >= width * height) return;
+
+	float4 color = accum[i];
+#ifdef ACCUMULATE
+	color = Accumulate(history + i, color, sample);
+#endif
+	write_imagef(output, (int2)(i % width, i / width), color);
+}
@@ -1,11 +1,15 @@
 #version 330
 
 uniform sampler2D tex;
+uniform vec2 extent;
 in vec2 texcoord;
 
 out vec4 fragColor;
 
 void main()
 {
-    fragColor = texture2D(tex,texcoord);
+    // texcoord is in texels; clamped to the outer texel centers so filtering
+    // never reads past the traced corner
+    vec2 size = vec2(textureSize(tex,0));
+    fragColor = texture2D(tex,clamp(texcoord,vec2(0.5),extent-0.5)/size);
 }
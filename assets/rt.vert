@@ -4,10 +4,12 @@ layout(location = 0) in vec3 pos;
 layout(location = 1) in vec2 tex;
 
 uniform mat4 matrix;
+// traced size in texels, the top left corner of the texture
+uniform vec2 extent;
 
 out vec2 texcoord;
 
 void main() {
-    texcoord = tex;
+    texcoord = tex * extent;
     gl_Position = matrix * vec4(pos,1.0);
 }
@@ -6,6 +6,18 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+
+#ifdef OS_WIN
+#include <windows.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
 
 using namespace cl;
 
@@ -56,6 +68,7 @@ Platform getPlatform()
     FIND_PLATFORM(INTEL_PLATFORM)
     FIND_PLATFORM(APPLE_PLATFORM)
     FIND_PLATFORM(MESA_PLATFORM)
+    FIND_PLATFORM(POCL_PLATFORM)
 
     // If no platforms are found
     exit(252);
@@ -77,10 +90,10 @@ bool checkExtnAvailability(Device pDevice, std::string pName)
             }
         }
         if (found==1) {
-            std::cout<<"Found CL_GL_SHARING extension: "<<item<<std::endl;
+            std::cout<<"Found extension: "<<item<<std::endl;
             ret_val = true;
         } else {
-            std::cout<<"CL_GL_SHARING extension not found\n";
+            std::cout<<pName<<" extension not found\n";
             ret_val = false;
         }
     } catch (Error err) {
@@ -107,3 +120,170 @@ Program getProgram(Context pContext, std::string file, cl_int &error)
     }
     return ret_val;
 }
+
+// Cache file: magic, key length, key, binary size, binary. The full key is
+// stored so a hash collision in the file name can not load a foreign binary.
+static const char CACHE_MAGIC[8] = { 'R', 'T', 'C', 'L', 'B', 'I', 'N', '1' };
+
+static uint64_t fnv1a(const std::string &data)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static std::string toHex(uint64_t value)
+{
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)value);
+    return buf;
+}
+
+static std::string cacheKey(Device pDevice, const std::string &source, const std::string &options)
+{
+    Platform platform(pDevice.getInfo<CL_DEVICE_PLATFORM>());
+    std::ostringstream key;
+    key << platform.getInfo<CL_PLATFORM_NAME>() << "\n"
+        << pDevice.getInfo<CL_DEVICE_NAME>() << "\n"
+        << pDevice.getInfo<CL_DEVICE_VERSION>() << "\n"
+        << pDevice.getInfo<CL_DRIVER_VERSION>() << "\n"
+        << options << "\n"
+        << toHex(fnv1a(source));
+    return key.str();
+}
+
+static bool readCachedBinary(const std::string &path, const std::string &key, std::vector<unsigned char> &binary)
+{
+    std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+    if (!in.is_open())
+        return false;
+    char magic[sizeof(CACHE_MAGIC)];
+    uint64_t keySize = 0, binarySize = 0;
+    in.read(magic, sizeof(magic));
+    in.read((char*)&keySize, sizeof(keySize));
+    if (!in || memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0 || keySize != key.size())
+        return false;
+    std::string storedKey(keySize, '\0');
+    in.read(&storedKey[0], keySize);
+    in.read((char*)&binarySize, sizeof(binarySize));
+    if (!in || storedKey != key || binarySize == 0)
+        return false;
+    binary.resize(binarySize);
+    in.read((char*)binary.data(), binarySize);
+    return (bool)in;
+}
+
+// Temporary name next to path, unique to this process and call, so
+// concurrent writers never share a file
+static std::string uniqueTempPath(const std::string &path)
+{
+    static std::atomic<unsigned> counter(0);
+    std::ostringstream name;
+    name << path << "." << getpid() << "." << counter++ << ".tmp";
+    return name.str();
+}
+
+// Moves tmp over path in one step, replacing an older entry, so a reader
+// finds either the old file or the new one
+static bool replaceFile(const std::string &tmp, const std::string &path)
+{
+#ifdef OS_WIN
+    return MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return std::rename(tmp.c_str(), path.c_str()) == 0;
+#endif
+}
+
+static void writeCachedBinary(const std::string &path, const std::string &key, Program pProgram, Device pDevice)
+{
+    // the binaries are returned for every device of the program, pick ours
+    std::vector<Device> devices = pProgram.getInfo<CL_PROGRAM_DEVICES>();
+    std::vector< ::size_t> sizes = pProgram.getInfo<CL_PROGRAM_BINARY_SIZES>();
+    std::vector< std::vector<unsigned char> > binaries(sizes.size());
+    std::vector<unsigned char*> ptrs(sizes.size());
+    for (unsigned i = 0; i < sizes.size(); ++i) {
+        binaries[i].resize(sizes[i]);
+        ptrs[i] = binaries[i].data();
+    }
+    cl_int err = clGetProgramInfo(pProgram(), CL_PROGRAM_BINARIES, ptrs.size() * sizeof(unsigned char*), ptrs.data(), NULL);
+    if (err != CL_SUCCESS)
+        return;
+    for (unsigned i = 0; i < devices.size(); ++i) {
+        if (devices[i]() != pDevice() || binaries[i].empty())
+            continue;
+        // written under a temporary name so a concurrent start never reads half a file
+        std::string tmp = uniqueTempPath(path);
+        std::ofstream out(tmp.c_str(), std::ios::out | std::ios::binary);
+        if (!out.is_open()) {
+            std::cout<<"Unable to write kernel cache "<<tmp<<std::endl;
+            return;
+        }
+        uint64_t keySize = key.size(), binarySize = binaries[i].size();
+        out.write(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        out.write((const char*)&keySize, sizeof(keySize));
+        out.write(key.data(), key.size());
+        out.write((const char*)&binarySize, sizeof(binarySize));
+        out.write((const char*)binaries[i].data(), binaries[i].size());
+        out.close();
+        if (!out || !replaceFile(tmp, path))
+            std::remove(tmp.c_str());
+        return;
+    }
+}
+
+void buildProgram(Context pContext, Device pDevice, std::string file, std::string options,
+                  std::string cacheDir, Program &pProgram)
+{
+    buildProgram(pContext, std::vector<Device>(1, pDevice), file, options, cacheDir, pProgram);
+}
+
+void buildProgram(Context pContext, std::vector<Device> pDevices, std::string file, std::string options,
+                  std::string cacheDir, Program &pProgram)
+{
+    if (cacheDir.empty()) {
+        cl_int errCode;
+        pProgram = getProgram(pContext, file, errCode);
+        pProgram.build(pDevices, options.c_str());
+        return;
+    }
+
+    std::ifstream sourceFile(file.c_str());
+    std::string sourceCode(
+            std::istreambuf_iterator<char>(sourceFile),
+            (std::istreambuf_iterator<char>()));
+    // includes are not followed, rt.cl is self-contained
+    std::vector<std::string> keys, paths;
+    for (auto &device : pDevices) {
+        keys.push_back(cacheKey(device, sourceCode, options));
+        paths.push_back(cacheDir + "/" + toHex(fnv1a(keys.back())) + ".bin");
+    }
+
+    // the binaries are only used when every device has one
+    std::vector< std::vector<unsigned char> > binary(pDevices.size());
+    bool cached = true;
+    for (unsigned i = 0; i < pDevices.size() && cached; ++i)
+        cached = readCachedBinary(paths[i], keys[i], binary[i]);
+    if (cached) {
+        try {
+            Program::Binaries binaries;
+            for (auto &b : binary)
+                binaries.push_back(std::make_pair((const void*)b.data(), b.size()));
+            pProgram = Program(pContext, pDevices, binaries);
+            pProgram.build(pDevices, options.c_str());
+            std::cout<<"Loaded kernel binary from cache"<<std::endl;
+            return;
+        } catch(Error err) {
+            // stale or rejected by the driver, fall back to the source
+            std::cout<<"Cached kernel binary rejected: "<<err.what()<<"("<<err.err()<<")"<<std::endl;
+        }
+    }
+
+    Program::Sources source(1, std::make_pair(sourceCode.c_str(), sourceCode.length()+1));
+    pProgram = Program(pContext, source);
+    pProgram.build(pDevices, options.c_str());
+    for (unsigned i = 0; i < pDevices.size(); ++i)
+        writeCachedBinary(paths[i], keys[i], pProgram, pDevices[i]);
+}
@@ -9,12 +9,14 @@ static const std::string CL_GL_SHARING_EXT = "cl_APPLE_gl_sharing";
 #else
 static const std::string CL_GL_SHARING_EXT = "cl_khr_gl_sharing";
 #endif
+static const std::string CL_GL_EVENT_EXT = "cl_khr_gl_event";
 
 static const std::string NVIDIA_PLATFORM = "NVIDIA";
 static const std::string AMD_PLATFORM = "AMD";
 static const std::string MESA_PLATFORM = "Clover";
 static const std::string INTEL_PLATFORM = "Intel";
 static const std::string APPLE_PLATFORM = "Apple";
+static const std::string POCL_PLATFORM = "Portable Computing Language";
 
 cl::Platform getPlatform(std::string pName, cl_int &error);
 
@@ -24,4 +26,14 @@ bool checkExtnAvailability(cl::Device pDevice, std::string pName);
 
 cl::Program getProgram(cl::Context pContext, std::string file, cl_int &error);
 
+// Creates and builds file for pDevice. With a cache directory the binary of a
+// source build is stored there and reused while the device name, driver
+// version, source and options stay the same; anything else is rebuilt.
+// pProgram is assigned before building, so its build log is available if this throws.
+void buildProgram(cl::Context pContext, cl::Device pDevice, std::string file, std::string options,
+                  std::string cacheDir, cl::Program &pProgram);
+// The same for several devices of pContext, each with its own cache entry
+void buildProgram(cl::Context pContext, std::vector<cl::Device> pDevices, std::string file, std::string options,
+                  std::string cacheDir, cl::Program &pProgram);
+
 #endif//__OPENCL_UTIL_H__
@@ -0,0 +1,301 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
+
+#define BVH_BINS 16
+
+typedef struct {
+	cl_float min[3];
+	cl_float max[3];
+} aabb;
+
+static void reset_box(aabb &box)
+{
+	for (int a = 0; a < 3; a++) {
+		box.min[a] = FLT_MAX;
+		box.max[a] = -FLT_MAX;
+	}
+}
+
+static void grow_box(aabb &box, const aabb &other)
+{
+	for (int a = 0; a < 3; a++) {
+		box.min[a] = std::min(box.min[a], other.min[a]);
+		box.max[a] = std::max(box.max[a], other.max[a]);
+	}
+}
+
+static cl_float box_area(const aabb &box)
+{
+	cl_float e[3];
+	for (int a = 0; a < 3; a++)
+		e[a] = std::max(box.max[a] - box.min[a], 0.0f);
+	return e[0] * e[1] + e[1] * e[2] + e[2] * e[0];
+}
+
+static aabb sphere_box(const rt_sphere &sphere)
+{
+	aabb box;
+	for (int a = 0; a < 3; a++) {
+		box.min[a] = sphere.center.s[a] - sphere.radius;
+		box.max[a] = sphere.center.s[a] + sphere.radius;
+	}
+	return box;
+}
+
+// Bounds and centroid of the primitives the builder sorts: spheres,
+// triangles given by indices into vertices, or boxes of build_box_bvh
+static aabb prim_box(const rt_sphere &sphere, const cl_float4 *)
+{
+	return sphere_box(sphere);
+}
+
+static cl_float prim_center(const rt_sphere &sphere, int axis, const cl_float4 *)
+{
+	return sphere.center.s[axis];
+}
+
+static aabb prim_box(const cl_int4 &triangle, const cl_float4 *vertices)
+{
+	aabb box;
+	reset_box(box);
+	for (int v = 0; v < 3; v++) {
+		const cl_float4 &p = vertices[triangle.s[v]];
+		for (int a = 0; a < 3; a++) {
+			box.min[a] = std::min(box.min[a], p.s[a]);
+			box.max[a] = std::max(box.max[a], p.s[a]);
+		}
+	}
+	return box;
+}
+
+static cl_float prim_center(const cl_int4 &triangle, int axis, const cl_float4 *vertices)
+{
+	return (vertices[triangle.s[0]].s[axis] + vertices[triangle.s[1]].s[axis] + vertices[triangle.s[2]].s[axis]) / 3;
+}
+
+// A box of build_box_bvh and where it came from
+typedef struct {
+	aabb box;
+	int index;
+} box_ref;
+
+static aabb prim_box(const box_ref &ref, const cl_float4 *)
+{
+	return ref.box;
+}
+
+static cl_float prim_center(const box_ref &ref, int axis, const cl_float4 *)
+{
+	return (ref.box.min[axis] + ref.box.max[axis]) / 2;
+}
+
+template<typename T>
+struct bvh_builder {
+	T *prims;
+	const cl_float4 *vertices;	// triangle vertices, NULL for spheres
+	std::vector<rt_bvh_node> nodes;
+};
+
+static void set_node_box(rt_bvh_node &node, const aabb &box)
+{
+	node.bbox_min = { box.min[0], box.min[1], box.min[2], 0 };
+	node.bbox_max = { box.max[0], box.max[1], box.max[2], 0 };
+}
+
+static aabb node_box(const rt_bvh_node &node)
+{
+	aabb box;
+	for (int a = 0; a < 3; a++) {
+		box.min[a] = node.bbox_min.s[a];
+		box.max[a] = node.bbox_max.s[a];
+	}
+	return box;
+}
+
+template<typename T>
+static aabb leaf_box(const T *prims, const cl_float4 *vertices, const rt_bvh_node &node)
+{
+	aabb box;
+	reset_box(box);
+	for (int i = node.left_first; i < node.left_first + node.count; i++)
+		grow_box(box, prim_box(prims[i], vertices));
+	return box;
+}
+
+template<typename T>
+static void update_node_bounds(bvh_builder<T> &b, rt_bvh_node &node)
+{
+	set_node_box(node, leaf_box(b.prims, b.vertices, node));
+}
+
+// Evaluates BVH_BINS candidate planes per axis over the centroid bounds and
+// returns the cheapest one, or FLT_MAX if the centroids can't be separated
+template<typename T>
+static cl_float find_split(bvh_builder<T> &b, const rt_bvh_node &node, int &axis, cl_float &split)
+{
+	cl_float best = FLT_MAX;
+
+	for (int a = 0; a < 3; a++) {
+		cl_float cmin = FLT_MAX, cmax = -FLT_MAX;
+		for (int i = node.left_first; i < node.left_first + node.count; i++) {
+			cmin = std::min(cmin, prim_center(b.prims[i], a, b.vertices));
+			cmax = std::max(cmax, prim_center(b.prims[i], a, b.vertices));
+		}
+		if (cmin == cmax) continue;
+
+		aabb bins[BVH_BINS];
+		int counts[BVH_BINS] = { 0 };
+		for (int i = 0; i < BVH_BINS; i++)
+			reset_box(bins[i]);
+
+		cl_float scale = BVH_BINS / (cmax - cmin);
+		for (int i = node.left_first; i < node.left_first + node.count; i++) {
+			int bin = std::min(BVH_BINS - 1, (int)((prim_center(b.prims[i], a, b.vertices) - cmin) * scale));
+			counts[bin]++;
+			grow_box(bins[bin], prim_box(b.prims[i], b.vertices));
+		}
+
+		// sweep from both sides to get the cost of every plane between bins
+		cl_float leftArea[BVH_BINS - 1], rightArea[BVH_BINS - 1];
+		int leftCount[BVH_BINS - 1], rightCount[BVH_BINS - 1];
+		aabb leftBox, rightBox;
+		reset_box(leftBox);
+		reset_box(rightBox);
+		int leftSum = 0, rightSum = 0;
+		for (int i = 0; i < BVH_BINS - 1; i++) {
+			leftSum += counts[i];
+			grow_box(leftBox, bins[i]);
+			leftCount[i] = leftSum;
+			leftArea[i] = box_area(leftBox);
+
+			rightSum += counts[BVH_BINS - 1 - i];
+			grow_box(rightBox, bins[BVH_BINS - 1 - i]);
+			rightCount[BVH_BINS - 2 - i] = rightSum;
+			rightArea[BVH_BINS - 2 - i] = box_area(rightBox);
+		}
+
+		for (int i = 0; i < BVH_BINS - 1; i++) {
+			if (leftCount[i] == 0 || rightCount[i] == 0) continue;
+			cl_float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+			if (cost < best) {
+				best = cost;
+				axis = a;
+				split = cmin + (i + 1) / scale;
+			}
+		}
+	}
+	return best;
+}
+
+template<typename T>
+static void subdivide(bvh_builder<T> &b, int nodeIndex, int depth)
+{
+	rt_bvh_node &node = b.nodes[nodeIndex];
+	if (node.count <= 1 || depth >= BVH_MAX_DEPTH - 1) return;
+
+	int axis = 0;
+	cl_float split = 0;
+	cl_float splitCost = find_split(b, node, axis, split);
+
+	if (splitCost >= node.count * box_area(node_box(node))) return;
+
+	const cl_float4 *vertices = b.vertices;
+	T *first = b.prims + node.left_first;
+	T *mid = std::partition(first, first + node.count,
+		[axis, split, vertices](const T &prim) { return prim_center(prim, axis, vertices) < split; });
+	int leftCount = (int)(mid - first);
+	if (leftCount == 0 || leftCount == node.count) return;
+
+	int leftIndex = (int)b.nodes.size();
+	rt_bvh_node left, right;
+	left.left_first = node.left_first;
+	left.count = leftCount;
+	right.left_first = node.left_first + leftCount;
+	right.count = node.count - leftCount;
+
+	// node is a reference into b.nodes, so finish with it before growing the vector
+	node.left_first = leftIndex;
+	node.count = 0;
+
+	update_node_bounds(b, left);
+	update_node_bounds(b, right);
+	b.nodes.push_back(left);
+	b.nodes.push_back(right);
+
+	subdivide(b, leftIndex, depth + 1);
+	subdivide(b, leftIndex + 1, depth + 1);
+}
+
+template<typename T>
+static std::vector<rt_bvh_node> build(T *prims, int count, const cl_float4 *vertices)
+{
+	bvh_builder<T> b;
+	b.prims = prims;
+	b.vertices = vertices;
+	b.nodes.reserve(count > 0 ? 2 * count - 1 : 1);
+
+	rt_bvh_node root;
+	root.left_first = 0;
+	root.count = count;
+	update_node_bounds(b, root);
+	b.nodes.push_back(root);
+
+	subdivide(b, 0, 0);
+	return b.nodes;
+}
+
+std::vector<rt_bvh_node> build_bvh(rt_sphere *spheres, int count)
+{
+	return build(spheres, count, (const cl_float4*)NULL);
+}
+
+std::vector<rt_bvh_node> build_mesh_bvh(cl_int4 *triangles, int count, const cl_float4 *vertices)
+{
+	return build(triangles, count, vertices);
+}
+
+std::vector<rt_bvh_node> build_box_bvh(const cl_float4 *boxes, int count, std::vector<int> &order)
+{
+	std::vector<box_ref> refs(count);
+	for (int i = 0; i < count; i++) {
+		for (int a = 0; a < 3; a++) {
+			refs[i].box.min[a] = boxes[2 * i].s[a];
+			refs[i].box.max[a] = boxes[2 * i + 1].s[a];
+		}
+		refs[i].index = i;
+	}
+	std::vector<rt_bvh_node> nodes = build(refs.data(), count, (const cl_float4*)NULL);
+	order.resize(count);
+	for (int i = 0; i < count; i++)
+		order[i] = refs[i].index;
+	return nodes;
+}
+
+dirty_range refit_bvh(std::vector<rt_bvh_node> &nodes, const rt_sphere *spheres)
+{
+	dirty_range changed;
+	clear_range(changed);
+
+	// children are always stored after their parent, so walking backwards
+	// sees every child before the node that contains it
+	for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+		rt_bvh_node &node = nodes[i];
+		aabb box;
+		if (node.count > 0 || nodes.size() == 1) {
+			box = leaf_box(spheres, (const cl_float4*)NULL, node);
+		} else {
+			box = node_box(nodes[node.left_first]);
+			grow_box(box, node_box(nodes[node.left_first + 1]));
+		}
+
+		aabb old = node_box(node);
+		if (memcmp(&old, &box, sizeof(aabb)) != 0) {
+			set_node_box(node, box);
+			mark_dirty(changed, i);
+		}
+	}
+	return changed;
+}
@@ -0,0 +1,26 @@
+#include <vector>
+
+#include "scene.h"
+#include "dirty_range.h"
+
+#ifndef BVH_H
+#define BVH_H
+
+// Builds a BVH over the spheres with a binned SAH builder. Spheres are
+// reordered in place so every leaf covers a contiguous range; node 0 is the root.
+std::vector<rt_bvh_node> build_bvh(rt_sphere *spheres, int count);
+
+// The same over triangles holding vertex indices in xyz (see mesh_io.h),
+// reordered in place like the spheres
+std::vector<rt_bvh_node> build_mesh_bvh(cl_int4 *triangles, int count, const cl_float4 *vertices);
+
+// The same over count boxes given as bbox_min, bbox_max pairs, for the top
+// level over instances. The boxes stay in place, order receives the box
+// index of every leaf item instead.
+std::vector<rt_bvh_node> build_box_bvh(const cl_float4 *boxes, int count, std::vector<int> &order);
+
+// Recomputes the node bounds after spheres moved, keeping the tree topology.
+// Returns the range of nodes whose bounds changed.
+dirty_range refit_bvh(std::vector<rt_bvh_node> &nodes, const rt_sphere *spheres);
+
+#endif
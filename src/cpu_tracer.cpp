@@ -0,0 +1,694 @@
+#include "cpu_tracer.h"
+#include "simd.h"
+
+#include <cmath>
+
+// MAX_RECURSION_DEPTH, T_MIN and BVH_STACK_SIZE come from scene.h, as for rt.cl
+#define SHADOW_ENABLED
+
+#define TILE_SIZE 16
+#define W SIMD_WIDTH
+
+typedef struct {
+	vfloat x, y, z;
+} vec3;
+
+static inline vec3 broadcast(const cl_float4 &v)
+{
+	vec3 r = { v.s[0], v.s[1], v.s[2] };
+	return r;
+}
+
+static inline vec3 operator+(const vec3 &a, const vec3 &b) { vec3 r = { a.x + b.x, a.y + b.y, a.z + b.z }; return r; }
+static inline vec3 operator-(const vec3 &a, const vec3 &b) { vec3 r = { a.x - b.x, a.y - b.y, a.z - b.z }; return r; }
+static inline vec3 operator-(const vec3 &a) { vec3 r = { -a.x, -a.y, -a.z }; return r; }
+static inline vec3 operator*(const vec3 &a, vfloat s) { vec3 r = { a.x * s, a.y * s, a.z * s }; return r; }
+static inline vfloat dot(const vec3 &a, const vec3 &b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+static inline vfloat length(const vec3 &a) { return sqrt(dot(a, a)); }
+static inline vec3 normalize(const vec3 &a) { vfloat l = length(a); vec3 r = { a.x / l, a.y / l, a.z / l }; return r; }
+static inline vec3 cross(const vec3 &a, const vec3 &b)
+{
+	vec3 r = { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x };
+	return r;
+}
+
+static inline vec3 select(vfloat mask, const vec3 &a, const vec3 &b)
+{
+	vec3 r = { select(mask, a.x, b.x), select(mask, a.y, b.y), select(mask, a.z, b.z) };
+	return r;
+}
+
+static inline vec3 ReflectRay(const vec3 &r, const vec3 &normal)
+{
+	return normal * (vfloat(2.0f) * dot(r, normal)) - r;
+}
+
+static inline int popcount(int mask)
+{
+	int n = 0;
+	for (; mask; mask &= mask - 1) n++;
+	return n;
+}
+
+// Same formulation as IntersectRaySphere; a negative discriminant gives NaN
+// roots, which fail every comparison and leave INFINITY
+static inline vfloat IntersectRaySphere(const vec3 &o, const vec3 &d, vfloat tMin, const rt_sphere &sphere)
+{
+	vec3 oc = o - broadcast(sphere.center);
+	vfloat r(sphere.radius);
+
+	vfloat k1 = dot(d, d);
+	vfloat k2 = vfloat(2.0f) * dot(oc, d);
+	vfloat k3 = dot(oc, oc) - r * r;
+	vfloat discr = k2 * k2 - vfloat(4.0f) * k1 * k3;
+
+	vfloat root = sqrt(discr);
+	vfloat t1 = (-k2 + root) / (vfloat(2.0f) * k1);
+	vfloat t2 = (-k2 - root) / (vfloat(2.0f) * k1);
+
+	vfloat t(INFINITY);
+	t = select((t1 < t) & (t1 >= tMin), t1, t);
+	t = select((t2 < t) & (t2 >= tMin), t2, t);
+	return t;
+}
+
+// IntersectRayTriangle with the early returns turned into a lane mask
+static inline vfloat IntersectRayTriangle(const vec3 &o, const vec3 &d, vfloat tMin, const cl_int4 &triangle, const cl_float4 *vertices)
+{
+	const cl_float4 &a = vertices[triangle.s[0]], &b = vertices[triangle.s[1]], &c = vertices[triangle.s[2]];
+	vec3 v0 = broadcast(a);
+	vec3 e1 = { vfloat(b.s[0] - a.s[0]), vfloat(b.s[1] - a.s[1]), vfloat(b.s[2] - a.s[2]) };
+	vec3 e2 = { vfloat(c.s[0] - a.s[0]), vfloat(c.s[1] - a.s[1]), vfloat(c.s[2] - a.s[2]) };
+	const vfloat zero(0.0f), one(1.0f);
+
+	vec3 p = cross(d, e2);
+	vfloat det = dot(e1, p);
+	vfloat invDet = one / det;
+
+	vec3 s = o - v0;
+	vfloat u = dot(s, p) * invDet;
+	vec3 q = cross(s, e1);
+	vfloat v = dot(d, q) * invDet;
+	vfloat t = dot(e2, q) * invDet;
+
+	vfloat hit = (u >= zero) & (u <= one) & (v >= zero) & (u + v <= one) & (t >= tMin);
+	return select(andnot(hit, det == zero), t, vfloat(INFINITY));
+}
+
+static inline vfloat IntersectRayBox(const vec3 &o, const vec3 &invD, vfloat tMin, vfloat tMax, const rt_bvh_node &node)
+{
+	vec3 t0 = { (vfloat(node.bbox_min.s[0]) - o.x) * invD.x, (vfloat(node.bbox_min.s[1]) - o.y) * invD.y, (vfloat(node.bbox_min.s[2]) - o.z) * invD.z };
+	vec3 t1 = { (vfloat(node.bbox_max.s[0]) - o.x) * invD.x, (vfloat(node.bbox_max.s[1]) - o.y) * invD.y, (vfloat(node.bbox_max.s[2]) - o.z) * invD.z };
+
+	vfloat enter = fmax(fmax(fmin(t0.x, t1.x), fmin(t0.y, t1.y)), fmax(fmin(t0.z, t1.z), tMin));
+	vfloat exit = fmin(fmin(fmax(t0.x, t1.x), fmax(t0.y, t1.y)), fmin(fmax(t0.z, t1.z), tMax));
+
+	return select(enter <= exit, enter, vfloat(INFINITY));
+}
+
+static inline vfloat IntersectPrimitive(const vec3 &o, const vec3 &d, vfloat tMin, bool mesh, int i, const cpu_frame &frame)
+{
+	return mesh ? IntersectRayTriangle(o, d, tMin, frame.triangles[i], frame.vertices)
+		: IntersectRaySphere(o, d, tMin, frame.spheres[i]);
+}
+
+// ClosestInTree for a packet: the packet descends into a node when any active
+// lane hits it, each lane keeps its own closest hit and its index. Triangles
+// are counted from first, as in rt.cl.
+static void ClosestInTree(const vec3 &o, const vec3 &d, const vec3 &invD, float tMin, vfloat tMax, vfloat active,
+	const cpu_frame &frame, const rt_bvh_node *bvh, bool mesh, int first, vfloat &closest, vfloat &index)
+{
+	const vfloat vtMin(tMin);
+	int stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+	int nodeIndex = 0;
+
+	while (true)
+	{
+		const rt_bvh_node &node = bvh[nodeIndex];
+
+		if (node.count > 0)
+		{
+			for (int i = node.left_first; i < node.left_first + node.count; i++)
+			{
+				vfloat ti = IntersectPrimitive(o, d, vtMin, mesh, first + i, frame);
+				vfloat hit = active & (ti >= vtMin) & (ti <= tMax) & (ti < closest);
+				closest = select(hit, ti, closest);
+				index = select(hit, vfloat((float)(mesh ? frame.scene->sphere_count + first + i : i)), index);
+			}
+		}
+		else
+		{
+			int nearChild = node.left_first;
+			int farChild = nearChild + 1;
+			vfloat limit = fmin(tMax, closest);
+			vfloat tNear = IntersectRayBox(o, invD, vtMin, limit, bvh[nearChild]);
+			vfloat tFar = IntersectRayBox(o, invD, vtMin, limit, bvh[farChild]);
+			vfloat hitNear = active & (tNear < vfloat(INFINITY));
+			vfloat hitFar = active & (tFar < vfloat(INFINITY));
+
+			// lanes may disagree on the order, follow the majority
+			if (popcount(movemask(hitFar & (tFar < tNear))) > popcount(movemask(hitNear & (tNear <= tFar))))
+			{
+				int tmpIndex = nearChild; nearChild = farChild; farChild = tmpIndex;
+				vfloat tmp = hitNear; hitNear = hitFar; hitFar = tmp;
+			}
+
+			if (any(hitNear))
+			{
+				if (any(hitFar))
+					stack[stackSize++] = farChild;
+				nodeIndex = nearChild;
+				continue;
+			}
+			if (any(hitFar))
+			{
+				nodeIndex = farChild;
+				continue;
+			}
+		}
+
+		if (stackSize == 0) break;
+		nodeIndex = stack[--stackSize];
+	}
+}
+
+// ToObject for a packet: the rows of an instance transform broadcast to the lanes
+static inline vec3 ToObject(const cl_float4 *worldToObject, const vec3 &v, float w)
+{
+	vec3 r = { dot(broadcast(worldToObject[0]), v) + vfloat(worldToObject[0].s[3] * w),
+		dot(broadcast(worldToObject[1]), v) + vfloat(worldToObject[1].s[3] * w),
+		dot(broadcast(worldToObject[2]), v) + vfloat(worldToObject[2].s[3] * w) };
+	return r;
+}
+
+static inline vec3 Reciprocal(const vec3 &d)
+{
+	vec3 r = { vfloat(1.0f) / d.x, vfloat(1.0f) / d.y, vfloat(1.0f) / d.z };
+	return r;
+}
+
+// ClosestInstance for a packet: each lane notes the instance of its closest hit
+static void ClosestInstance(const vec3 &o, const vec3 &d, const vec3 &invD, float tMin, vfloat tMax, vfloat active,
+	const cpu_frame &frame, vfloat &closest, vfloat &index, vfloat &instanceIndex)
+{
+	const rt_bvh_node *bvh = frame.instanceBvh;
+	const vfloat vtMin(tMin);
+	int stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+	int nodeIndex = 0;
+
+	while (true)
+	{
+		const rt_bvh_node &node = bvh[nodeIndex];
+
+		if (node.count > 0)
+		{
+			for (int i = node.left_first; i < node.left_first + node.count; i++)
+			{
+				const rt_instance &instance = frame.instances[i];
+				vec3 objectO = ToObject(instance.world_to_object, o, 1);
+				vec3 objectD = ToObject(instance.world_to_object, d, 0);
+				vfloat before = closest;
+				ClosestInTree(objectO, objectD, Reciprocal(objectD), tMin, tMax, active, frame, frame.meshBvh + instance.root,
+					true, instance.first_triangle, closest, index);
+				instanceIndex = select(closest < before, vfloat((float)i), instanceIndex);
+			}
+		}
+		else
+		{
+			int nearChild = node.left_first;
+			int farChild = nearChild + 1;
+			vfloat limit = fmin(tMax, closest);
+			vfloat tNear = IntersectRayBox(o, invD, vtMin, limit, bvh[nearChild]);
+			vfloat tFar = IntersectRayBox(o, invD, vtMin, limit, bvh[farChild]);
+			vfloat hitNear = active & (tNear < vfloat(INFINITY));
+			vfloat hitFar = active & (tFar < vfloat(INFINITY));
+
+			if (popcount(movemask(hitFar & (tFar < tNear))) > popcount(movemask(hitNear & (tNear <= tFar))))
+			{
+				int tmpIndex = nearChild; nearChild = farChild; farChild = tmpIndex;
+				vfloat tmp = hitNear; hitNear = hitFar; hitFar = tmp;
+			}
+
+			if (any(hitNear))
+			{
+				if (any(hitFar))
+					stack[stackSize++] = farChild;
+				nodeIndex = nearChild;
+				continue;
+			}
+			if (any(hitFar))
+			{
+				nodeIndex = farChild;
+				continue;
+			}
+		}
+
+		if (stackSize == 0) break;
+		nodeIndex = stack[--stackSize];
+	}
+}
+
+// ClosestIntersection for a packet over the spheres and then the instances.
+// hitIndex is the sphere index, sphere_count plus the triangle index for a
+// triangle, and -1 for lanes without a hit; hitInstance is the instance of a
+// triangle hit, -1 otherwise.
+static void ClosestIntersection(const vec3 &o, const vec3 &d, float tMin, vfloat tMax, vfloat active,
+	const cpu_frame &frame, vfloat &t, vfloat &hitIndex, vfloat &hitInstance)
+{
+	const rt_scene &scene = *frame.scene;
+	t = vfloat(INFINITY);
+	hitIndex = vfloat(-1.0f);
+	hitInstance = vfloat(-1.0f);
+	if (none(active)) return;
+
+	vec3 invD = Reciprocal(d);
+	if (scene.sphere_count > 0)
+		ClosestInTree(o, d, invD, tMin, tMax, active, frame, frame.bvh, false, 0, t, hitIndex);
+	if (scene.instance_count > 0)
+		ClosestInstance(o, d, invD, tMin, tMax, active, frame, t, hitIndex, hitInstance);
+}
+
+// OccludedInTree for a packet: lanes stop at their first hit within [tMin, tMax]
+// and the traversal ends once every active lane is occluded. Returns the occluded lanes.
+static vfloat OccludedInTree(const vec3 &o, const vec3 &d, const vec3 &invD, float tMin, vfloat tMax, vfloat active,
+	const cpu_frame &frame, const rt_bvh_node *bvh, bool mesh, int first)
+{
+	vfloat occluded(0.0f);
+	const vfloat vtMin(tMin);
+	const vfloat inf(INFINITY);
+	int stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+	int nodeIndex = 0;
+
+	while (true)
+	{
+		const rt_bvh_node &node = bvh[nodeIndex];
+
+		if (node.count > 0)
+		{
+			for (int i = node.left_first; i < node.left_first + node.count; i++)
+			{
+				vfloat ti = IntersectPrimitive(o, d, vtMin, mesh, first + i, frame);
+				vfloat hit = active & (ti <= tMax) & (ti < inf);
+				occluded = occluded | hit;
+				active = andnot(active, hit);
+			}
+			if (none(active)) break;
+		}
+		else
+		{
+			int leftChild = node.left_first;
+			int rightChild = leftChild + 1;
+			vfloat hitLeft = active & (IntersectRayBox(o, invD, vtMin, tMax, bvh[leftChild]) < inf);
+			vfloat hitRight = active & (IntersectRayBox(o, invD, vtMin, tMax, bvh[rightChild]) < inf);
+
+			if (any(hitLeft))
+			{
+				if (any(hitRight))
+					stack[stackSize++] = rightChild;
+				nodeIndex = leftChild;
+				continue;
+			}
+			if (any(hitRight))
+			{
+				nodeIndex = rightChild;
+				continue;
+			}
+		}
+
+		if (stackSize == 0) break;
+		nodeIndex = stack[--stackSize];
+	}
+
+	return occluded;
+}
+
+// OccludedInstance for a packet, lanes drop out as an instance occludes them
+static vfloat OccludedInstance(const vec3 &o, const vec3 &d, const vec3 &invD, float tMin, vfloat tMax, vfloat active,
+	const cpu_frame &frame)
+{
+	const rt_bvh_node *bvh = frame.instanceBvh;
+	vfloat occluded(0.0f);
+	const vfloat vtMin(tMin);
+	const vfloat inf(INFINITY);
+	int stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+	int nodeIndex = 0;
+
+	while (true)
+	{
+		const rt_bvh_node &node = bvh[nodeIndex];
+
+		if (node.count > 0)
+		{
+			for (int i = node.left_first; i < node.left_first + node.count && any(active); i++)
+			{
+				const rt_instance &instance = frame.instances[i];
+				vec3 objectO = ToObject(instance.world_to_object, o, 1);
+				vec3 objectD = ToObject(instance.world_to_object, d, 0);
+				vfloat hit = OccludedInTree(objectO, objectD, Reciprocal(objectD), tMin, tMax, active, frame,
+					frame.meshBvh + instance.root, true, instance.first_triangle);
+				occluded = occluded | hit;
+				active = andnot(active, hit);
+			}
+			if (none(active)) break;
+		}
+		else
+		{
+			int leftChild = node.left_first;
+			int rightChild = leftChild + 1;
+			vfloat hitLeft = active & (IntersectRayBox(o, invD, vtMin, tMax, bvh[leftChild]) < inf);
+			vfloat hitRight = active & (IntersectRayBox(o, invD, vtMin, tMax, bvh[rightChild]) < inf);
+
+			if (any(hitLeft))
+			{
+				if (any(hitRight))
+					stack[stackSize++] = rightChild;
+				nodeIndex = leftChild;
+				continue;
+			}
+			if (any(hitRight))
+			{
+				nodeIndex = rightChild;
+				continue;
+			}
+		}
+
+		if (stackSize == 0) break;
+		nodeIndex = stack[--stackSize];
+	}
+
+	return occluded;
+}
+
+static vfloat Occluded(const vec3 &o, const vec3 &d, float tMin, vfloat tMax, vfloat active, const cpu_frame &frame)
+{
+	const rt_scene &scene = *frame.scene;
+	vfloat occluded(0.0f);
+	if (none(active)) return occluded;
+
+	vec3 invD = Reciprocal(d);
+	if (scene.sphere_count > 0)
+		occluded = OccludedInTree(o, d, invD, tMin, tMax, active, frame, frame.bvh, false, 0);
+	active = andnot(active, occluded);
+	if (scene.instance_count > 0 && any(active))
+		occluded = occluded | OccludedInstance(o, d, invD, tMin, tMax, active, frame);
+	return occluded;
+}
+
+static vfloat ComputeLighting(const vec3 &point, const vec3 &normal, const vec3 &view, vfloat specular,
+	vfloat active, const cpu_frame &frame)
+{
+	vfloat sum(0.0f);
+	const vfloat zero(0.0f);
+
+	for (int i = 0; i < frame.scene->light_count; i++)
+	{
+		const rt_light &light = frame.lights[i];
+		if (light.type == Ambient) {
+			sum = sum + vfloat(light.intensity);
+			continue;
+		}
+
+		vec3 L;
+		vfloat tMax;
+		if (light.type == Point) {
+			L = broadcast(light.position) - point;
+			tMax = 1.0f;
+		}
+		else if (light.type == Direct) {
+			L = broadcast(light.direction);
+			tMax = INFINITY;
+		}
+		else continue;
+
+		// PointLightFalloff from rt.cl, lanes out of reach trace no shadow ray.
+		// The light grid is not used, a packet skips a light none of its lanes reach.
+		vfloat lit = active;
+		vfloat intensity(light.intensity);
+		if (light.type == Point && light.radius > 0) {
+			vfloat window = vfloat(1.0f) - dot(L, L) / vfloat(light.radius * light.radius);
+			vfloat reached = window > zero;
+			lit = lit & reached;
+			intensity = intensity * select(reached, window * window, zero);
+		}
+		if (none(lit)) continue;
+
+		#ifdef SHADOW_ENABLED
+		lit = andnot(lit, Occluded(point, L, T_MIN, tMax, lit, frame));
+		#endif
+		if (none(lit)) continue;
+
+		vfloat nDotL = dot(normal, L);
+		sum = sum + select(lit & (nDotL > zero), intensity * nDotL / (length(normal) * length(L)), zero);
+
+		vfloat shiny = lit & (specular > zero);
+		if (none(shiny)) continue;
+
+		vec3 r = ReflectRay(L, normal);
+		vfloat rDotV = dot(r, view);
+		shiny = shiny & (rDotV > zero);
+		if (none(shiny)) continue;
+
+		// no vector pow, the highlight is evaluated per lane
+		alignas(32) float base[W], exponent[W], scale[W], highlight[W];
+		store(base, rDotV / (length(r) * length(view)));
+		store(exponent, specular);
+		store(scale, intensity);
+		int mask = movemask(shiny);
+		for (int l = 0; l < W; l++)
+			highlight[l] = (mask >> l) & 1 ? scale[l] * std::pow(base[l], exponent[l]) : 0.0f;
+		sum = sum + load(highlight);
+	}
+	return sum;
+}
+
+// TraceRay for a packet: lanes run the bounces in lock step and drop out on a
+// miss or a non-reflective hit, the colours are blended per lane at the end
+static void TraceRay(vec3 o, vec3 d, vfloat valid, const cpu_frame &frame, float out[4][W])
+{
+	const rt_scene &scene = *frame.scene;
+	const vfloat zero(0.0f);
+
+	if (scene.reflect_depth == 0) {
+		for (int c = 0; c < 4; c++)
+			for (int l = 0; l < W; l++)
+				out[c][l] = 0;
+		return;
+	}
+
+	alignas(32) float colors[MAX_RECURSION_DEPTH][4][W];
+	alignas(32) float reflects[MAX_RECURSION_DEPTH][W];
+	alignas(32) float recursionCount[W];
+
+	vfloat alive = valid;
+	vfloat count = zero;
+	int depth = scene.reflect_depth < MAX_RECURSION_DEPTH ? scene.reflect_depth : MAX_RECURSION_DEPTH;
+
+	for (int i = 0; i < depth && any(alive); i++)
+	{
+		vfloat closest, hitIndex, hitInstance;
+		ClosestIntersection(o, d, T_MIN, vfloat(INFINITY), alive, frame, closest, hitIndex, hitInstance);
+		vfloat hit = alive & (hitIndex >= zero);
+
+		// gather the material of the sphere or triangle each lane hit, for a
+		// triangle the unnormalized face normal in world space instead of a centre
+		alignas(32) float index[W], instanceIndex[W], center[3][W], faceNormal[3][W], isTriangle[W], color[4][W], reflect[W], specular[W];
+		store(index, hitIndex);
+		store(instanceIndex, hitInstance);
+		for (int l = 0; l < W; l++) {
+			const int i = (int)index[l];
+			const rt_sphere *sphere = NULL;
+			const rt_material *material = NULL;
+			float n[3] = { 0, 0, 0 };
+			if (index[l] >= 0 && i >= scene.sphere_count) {
+				const cl_int4 &triangle = frame.triangles[i - scene.sphere_count];
+				const cl_float4 &a = frame.vertices[triangle.s[0]], &b = frame.vertices[triangle.s[1]], &c = frame.vertices[triangle.s[2]];
+				const float e1[3] = { b.s[0] - a.s[0], b.s[1] - a.s[1], b.s[2] - a.s[2] };
+				const float e2[3] = { c.s[0] - a.s[0], c.s[1] - a.s[1], c.s[2] - a.s[2] };
+				const float objectN[3] = {
+					e1[1] * e2[2] - e1[2] * e2[1],
+					e1[2] * e2[0] - e1[0] * e2[2],
+					e1[0] * e2[1] - e1[1] * e2[0],
+				};
+				// normals go back through the transpose of world_to_object
+				const rt_instance &instance = frame.instances[(int)instanceIndex[l]];
+				for (int a = 0; a < 3; a++)
+					for (int r = 0; r < 3; r++)
+						n[a] += objectN[r] * instance.world_to_object[r].s[a];
+				material = frame.meshMaterials + instance.material;
+			} else if (index[l] >= 0) {
+				sphere = frame.spheres + i;
+			}
+			for (int c = 0; c < 3; c++) {
+				center[c][l] = sphere ? sphere->center.s[c] : 0;
+				faceNormal[c][l] = n[c];
+			}
+			isTriangle[l] = material ? 1.0f : 0.0f;
+			for (int c = 0; c < 4; c++)
+				color[c][l] = sphere ? sphere->color.s[c] : material ? material->color.s[c] : 0;
+			reflect[l] = sphere ? sphere->reflect : material ? material->reflect : 0;
+			specular[l] = sphere ? (float)sphere->specular : material ? (float)material->specular : 0;
+		}
+
+		vec3 c = { load(center[0]), load(center[1]), load(center[2]) };
+		vec3 p = o + d * select(hit, closest, zero);
+		vec3 normal = normalize(p - c);
+		if (scene.instance_count > 0) {
+			// SurfaceNormal: the face normal turned towards the ray
+			vec3 n = { load(faceNormal[0]), load(faceNormal[1]), load(faceNormal[2]) };
+			n = normalize(n);
+			n = select(dot(n, d) > zero, -n, n);
+			normal = select(load(isTriangle) > zero, n, normal);
+		}
+		vec3 view = -d;
+		vfloat lighting = ComputeLighting(p, normal, view, load(specular), hit, frame);
+
+		for (int ch = 0; ch < 4; ch++)
+			store(colors[i][ch], select(hit, load(color[ch]) * lighting, vfloat(scene.bg_color.s[ch])));
+		store(reflects[i], select(hit, load(reflect), zero));
+		count = count + select(alive, vfloat(1.0f), zero);
+
+		// a miss or a matte surface ends the path
+		alive = hit & (load(reflect) > zero);
+		if (i < depth - 1) {
+			o = select(alive, p, o);
+			d = select(alive, ReflectRay(view, normal), d);
+		}
+	}
+
+	store(recursionCount, count);
+	for (int l = 0; l < W; l++)
+	{
+		int n = (int)recursionCount[l];
+		if (n == 0) n = 1;
+		for (int ch = 0; ch < 4; ch++)
+		{
+			float total = colors[n - 1][ch][l];
+			for (int i = n - 2; i >= 0; i--)
+			{
+				float reflect = reflects[i][l];
+				total = colors[i][ch][l] * (1 - reflect) + total * reflect;
+			}
+			out[ch][l] = total;
+		}
+	}
+}
+
+CpuTracer::CpuTracer(int threads)
+	: generation(0), working(0), stopping(false), tilesX(0), tileCount(0), nextTile(0)
+{
+	if (threads <= 0)
+		threads = std::thread::hardware_concurrency();
+	if (threads <= 0)
+		threads = 1;
+	for (int i = 0; i < threads; i++)
+		workers.push_back(std::thread(&CpuTracer::run, this));
+}
+
+CpuTracer::~CpuTracer()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+		started.notify_all();
+	}
+	for (auto &worker : workers)
+		worker.join();
+}
+
+const char *CpuTracer::isa()
+{
+	return SIMD_ISA;
+}
+
+void CpuTracer::render(const cpu_frame &f)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	frame = f;
+	const int width = f.scene->canvas_width;
+	const int height = f.scene->canvas_height;
+	tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+	tileCount = tilesX * ((height + TILE_SIZE - 1) / TILE_SIZE);
+	nextTile = 0;
+	working = workers.size();
+	generation++;
+	started.notify_all();
+	finished.wait(lock, [&] { return working == 0; });
+}
+
+void CpuTracer::run()
+{
+	int seen = 0;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			started.wait(lock, [&] { return stopping || generation != seen; });
+			if (stopping) return;
+			seen = generation;
+		}
+
+		int tile;
+		while ((tile = nextTile++) < tileCount)
+			renderTile(tile);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--working == 0)
+			finished.notify_one();
+	}
+}
+
+// Packets are SIMD_WIDTH consecutive pixels of a tile row
+void CpuTracer::renderTile(int tile)
+{
+	const rt_scene &scene = *frame.scene;
+	const rt_camera_frame &camera = *frame.camera;
+	const int width = scene.canvas_width;
+	const int height = scene.canvas_height;
+	const int x0 = (tile % tilesX) * TILE_SIZE;
+	const int y0 = (tile / tilesX) * TILE_SIZE;
+
+	vec3 o = broadcast(camera.origin);
+	const float jitterX = frame.history ? frame.jitter[0] : 0;
+	const float jitterY = frame.history ? frame.jitter[1] : 0;
+	alignas(32) float dir[3][W], valid[W];
+	alignas(32) float color[4][W];
+
+	for (int y = y0; y < y0 + TILE_SIZE && y < height; y++)
+	{
+		for (int px = x0; px < x0 + TILE_SIZE && px < width; px += W)
+		{
+			for (int l = 0; l < W; l++)
+			{
+				int x = px + l;
+				// CanvasToViewport, with the same int truncation as the kernel
+				int xCartesian = x - width / 2.0f;
+				int yCartesian = height / 2.0f - y;
+				for (int c = 0; c < 3; c++)
+					dir[c][l] = (xCartesian + jitterX) * camera.right.s[c] + (yCartesian + jitterY) * camera.up.s[c] + camera.forward.s[c];
+				valid[l] = x < width ? 1.0f : 0.0f;
+			}
+
+			vec3 d = { load(dir[0]), load(dir[1]), load(dir[2]) };
+			TraceRay(o, d, load(valid) > vfloat(0.0f), frame, color);
+
+			for (int l = 0; l < W && px + l < width; l++)
+			{
+				cl_float4 &pixel = frame.output[y * width + px + l];
+				for (int c = 0; c < 4; c++)
+					pixel.s[c] = color[c][l];
+				if (!frame.history) continue;
+
+				// Accumulate from rt.cl
+				cl_float4 &mean = frame.history[y * width + px + l];
+				for (int c = 0; c < 4; c++) {
+					if (frame.sample > 0)
+						pixel.s[c] = mean.s[c] + (pixel.s[c] - mean.s[c]) / (frame.sample + 1);
+					mean.s[c] = pixel.s[c];
+				}
+			}
+		}
+	}
+}
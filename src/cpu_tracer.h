@@ -0,0 +1,68 @@
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "scene.h"
+
+#ifndef CPU_TRACER_H
+#define CPU_TRACER_H
+
+// Everything a frame reads, the same data the rt kernel gets as arguments
+typedef struct {
+	const rt_scene *scene;
+	const rt_camera_frame *camera;
+	const rt_bvh_node *bvh;
+	const rt_sphere *spheres;
+	const rt_light *lights;
+	// triangle meshes, see mesh_io.h: the object trees, the instance tree over
+	// them and the instances in its leaf order
+	const rt_bvh_node *meshBvh;
+	const rt_bvh_node *instanceBvh;
+	const cl_float4 *vertices;
+	const cl_int4 *triangles;
+	const rt_instance *instances;
+	const rt_material *meshMaterials;
+	cl_float4 *output;	// canvas_width * canvas_height pixels, row 0 at the top
+
+	// Progressive accumulation as with -DACCUMULATE in rt.cl, off while history is NULL
+	cl_float jitter[2];
+	int sample;
+	cl_float4 *history;
+} cpu_frame;
+
+// Native port of rt.cl for machines without an OpenCL device (--backend=cpu)
+// and as a reference for the kernel. Rays are traced in SIMD packets of
+// consecutive pixels; a pool of worker threads pulls 16x16 tiles.
+class CpuTracer {
+public:
+	// threads == 0 uses every hardware thread
+	explicit CpuTracer(int threads = 0);
+	~CpuTracer();
+
+	// Renders a frame, returns when every tile is done
+	void render(const cpu_frame &frame);
+
+	int threadCount() const { return (int)workers.size(); }
+	static const char *isa();
+
+private:
+	void run();
+	void renderTile(int tile);
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable started;
+	std::condition_variable finished;
+	int generation;
+	int working;
+	bool stopping;
+
+	cpu_frame frame;
+	int tilesX;
+	int tileCount;
+	std::atomic<int> nextTile;
+};
+
+#endif
@@ -0,0 +1,35 @@
+#include <cstddef>
+
+#ifndef DIRTY_RANGE_H
+#define DIRTY_RANGE_H
+
+// Half-open range of array elements changed on the host since the last upload.
+// Separate edits are merged into one covering range.
+typedef struct {
+	size_t begin;
+	size_t end;
+} dirty_range;
+
+inline void clear_range(dirty_range &range)
+{
+	range.begin = 0;
+	range.end = 0;
+}
+
+inline bool is_dirty(const dirty_range &range)
+{
+	return range.begin < range.end;
+}
+
+inline void mark_dirty(dirty_range &range, size_t first, size_t count = 1)
+{
+	if (!is_dirty(range)) {
+		range.begin = first;
+		range.end = first + count;
+		return;
+	}
+	if (first < range.begin) range.begin = first;
+	if (first + count > range.end) range.end = first + count;
+}
+
+#endif
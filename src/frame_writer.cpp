@@ -0,0 +1,72 @@
+#include "frame_writer.h"
+#include "image_io.h"
+
+#include <iostream>
+
+FrameWriter::FrameWriter(int slots)
+	: busy(slots, false), stopping(false), failed(false)
+{
+	worker = std::thread(&FrameWriter::run, this);
+}
+
+FrameWriter::~FrameWriter()
+{
+	finish();
+}
+
+void FrameWriter::waitForSlot(int slot)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	changed.wait(lock, [&] { return !busy[slot]; });
+}
+
+void FrameWriter::submit(const frame_job &job)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	busy[job.slot] = true;
+	queue.push_back(job);
+	changed.notify_all();
+}
+
+bool FrameWriter::finish()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+		changed.notify_all();
+	}
+	if (worker.joinable())
+		worker.join();
+	return !failed;
+}
+
+void FrameWriter::run()
+{
+	while (true) {
+		frame_job job;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			changed.wait(lock, [&] { return stopping || !queue.empty(); });
+			if (queue.empty()) return;
+			job = queue.front();
+			queue.pop_front();
+		}
+
+		bool ok = true;
+		try {
+			// no event when the pixels were ready at submit (CPU backend)
+			if (job.ready() != NULL)
+				job.ready.wait();
+		} catch (cl::Error err) {
+			std::cout << err.what() << "(" << err.err() << ")" << std::endl;
+			ok = false;
+		}
+		if (ok)
+			ok = write_image(job.fname.c_str(), job.pixels, job.width, job.height);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!ok) failed = true;
+		busy[job.slot] = false;
+		changed.notify_all();
+	}
+}
@@ -0,0 +1,50 @@
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include "cl.hpp"
+
+#ifndef FRAME_WRITER_H
+#define FRAME_WRITER_H
+
+// A frame whose read back has been enqueued but maybe not completed yet
+typedef struct {
+	std::string fname;
+	const cl_float4 *pixels;	// staging memory of the slot, stays valid until the slot is released
+	int width;
+	int height;
+	int slot;
+	cl::Event ready;			// completion of the read into pixels, empty if already done
+} frame_job;
+
+// Encodes and writes frames on a background thread so the tracer never waits
+// for the disk. Staging memory is split into slots; a slot is busy from
+// submit until its frame is written.
+class FrameWriter {
+public:
+	explicit FrameWriter(int slots);
+	~FrameWriter();
+
+	// Blocks until the frame previously submitted for slot has been written
+	void waitForSlot(int slot);
+	void submit(const frame_job &job);
+	// Writes everything still queued; returns false if any frame failed
+	bool finish();
+
+private:
+	void run();
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<frame_job> queue;
+	std::vector<bool> busy;
+	bool stopping;
+	bool failed;
+	std::thread worker;
+};
+
+#endif
@@ -0,0 +1,299 @@
+#include "image_io.h"
+
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static unsigned char to_byte(cl_float v)
+{
+	v = v < 0 ? 0 : (v > 1 ? 1 : v);
+	return (unsigned char)(v * 255.0f + 0.5f);
+}
+
+static bool write_file(const char *fname, const std::vector<unsigned char> &data)
+{
+	std::ofstream file(fname, std::ios::out | std::ios::binary);
+	if (!file.is_open()) {
+		std::cout << "Unable to open file " << fname << std::endl;
+		return false;
+	}
+	file.write((const char*)data.data(), data.size());
+	return file.good();
+}
+
+void encode_ppm(const cl_float4 *pixels, int width, int height, std::vector<unsigned char> &out)
+{
+	std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+	out.assign(header.begin(), header.end());
+	out.reserve(header.size() + (size_t)width * height * 3);
+	for (int i = 0; i < width * height; ++i)
+		for (int c = 0; c < 3; ++c)
+			out.push_back(to_byte(pixels[i].s[c]));
+}
+
+// PNG
+
+static uint32_t crc_table[256];
+
+static void init_crc_table()
+{
+	if (crc_table[1]) return;
+	for (uint32_t n = 0; n < 256; n++) {
+		uint32_t c = n;
+		for (int k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		crc_table[n] = c;
+	}
+}
+
+static uint32_t update_crc(uint32_t crc, const unsigned char *data, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+		crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+static void put_be32(std::vector<unsigned char> &out, uint32_t v)
+{
+	out.push_back(v >> 24);
+	out.push_back(v >> 16);
+	out.push_back(v >> 8);
+	out.push_back(v);
+}
+
+static void put_png_chunk(std::vector<unsigned char> &out, const char type[4], const std::vector<unsigned char> &data)
+{
+	const size_t start = out.size();
+	put_be32(out, data.size());
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data.begin(), data.end());
+	// the CRC covers type and data, not the length
+	uint32_t crc = update_crc(0xffffffffu, out.data() + start + 4, out.size() - start - 4) ^ 0xffffffffu;
+	put_be32(out, crc);
+}
+
+// RGB8 without compression: the zlib stream is made of stored deflate blocks,
+// so encoding costs no more than a copy and needs no zlib dependency
+void encode_png(const cl_float4 *pixels, int width, int height, std::vector<unsigned char> &out)
+{
+	init_crc_table();
+
+	// every scanline starts with filter type 0 (none)
+	const size_t stride = width * 3 + 1;
+	std::vector<unsigned char> raw(stride * height);
+	for (int y = 0; y < height; ++y) {
+		unsigned char *row = &raw[y * stride];
+		row[0] = 0;
+		for (int x = 0; x < width; ++x) {
+			const cl_float4 &px = pixels[y * width + x];
+			for (int c = 0; c < 3; ++c)
+				row[1 + x * 3 + c] = to_byte(px.s[c]);
+		}
+	}
+
+	std::vector<unsigned char> idat;
+	idat.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+	idat.push_back(0x78);
+	idat.push_back(0x01);
+	uint32_t a = 1, b = 0;
+	size_t pos = 0;
+	do {
+		size_t len = raw.size() - pos;
+		if (len > 65535) len = 65535;
+		bool last = pos + len == raw.size();
+		idat.push_back(last ? 1 : 0);
+		idat.push_back(len & 0xff);
+		idat.push_back(len >> 8);
+		idat.push_back(~len & 0xff);
+		idat.push_back((~len >> 8) & 0xff);
+		idat.insert(idat.end(), raw.begin() + pos, raw.begin() + pos + len);
+		for (size_t i = pos; i < pos + len; i++) {
+			a = (a + raw[i]) % 65521;
+			b = (b + a) % 65521;
+		}
+		pos += len;
+	} while (pos < raw.size());
+	put_be32(idat, (b << 16) | a);
+
+	std::vector<unsigned char> ihdr;
+	put_be32(ihdr, width);
+	put_be32(ihdr, height);
+	ihdr.push_back(8);	// bit depth
+	ihdr.push_back(2);	// truecolor
+	ihdr.push_back(0);	// deflate
+	ihdr.push_back(0);	// adaptive filtering
+	ihdr.push_back(0);	// no interlace
+
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	out.assign(signature, signature + sizeof(signature));
+	put_png_chunk(out, "IHDR", ihdr);
+	put_png_chunk(out, "IDAT", idat);
+	put_png_chunk(out, "IEND", std::vector<unsigned char>());
+}
+
+// EXR
+
+static void put_le(std::vector<unsigned char> &out, const void *v, size_t size)
+{
+	// the format is little endian, like every host this runs on
+	const unsigned char *bytes = (const unsigned char*)v;
+	out.insert(out.end(), bytes, bytes + size);
+}
+
+static void put_le32(std::vector<unsigned char> &out, int32_t v)
+{
+	put_le(out, &v, sizeof(v));
+}
+
+static void put_attribute(std::vector<unsigned char> &out, const char *name, const char *type, const std::vector<unsigned char> &value)
+{
+	out.insert(out.end(), name, name + strlen(name) + 1);
+	out.insert(out.end(), type, type + strlen(type) + 1);
+	put_le32(out, value.size());
+	out.insert(out.end(), value.begin(), value.end());
+}
+
+// Single part scanline file, uncompressed 32-bit float R, G, B channels
+void encode_exr(const cl_float4 *pixels, int width, int height, std::vector<unsigned char> &out)
+{
+	// channels are stored in alphabetical order
+	static const char channel_names[3] = { 'B', 'G', 'R' };
+	static const int channel_index[3] = { 2, 1, 0 };
+
+	std::vector<unsigned char> &header = out;
+	header.clear();
+	put_le32(header, 20000630);	// magic
+	put_le32(header, 2);		// version 2, scanline, no flags
+
+	std::vector<unsigned char> value;
+	for (int c = 0; c < 3; c++) {
+		value.push_back(channel_names[c]);
+		value.push_back(0);
+		put_le32(value, 2);		// FLOAT
+		put_le32(value, 0);		// pLinear + reserved
+		put_le32(value, 1);		// xSampling
+		put_le32(value, 1);		// ySampling
+	}
+	value.push_back(0);
+	put_attribute(header, "channels", "chlist", value);
+
+	value.assign(1, 0);			// NO_COMPRESSION
+	put_attribute(header, "compression", "compression", value);
+
+	value.clear();
+	put_le32(value, 0);
+	put_le32(value, 0);
+	put_le32(value, width - 1);
+	put_le32(value, height - 1);
+	put_attribute(header, "dataWindow", "box2i", value);
+	put_attribute(header, "displayWindow", "box2i", value);
+
+	value.assign(1, 0);			// INCREASING_Y
+	put_attribute(header, "lineOrder", "lineOrder", value);
+
+	float one = 1, zero = 0;
+	value.clear();
+	put_le(value, &one, sizeof(one));
+	put_attribute(header, "pixelAspectRatio", "float", value);
+
+	value.clear();
+	put_le(value, &zero, sizeof(zero));
+	put_le(value, &zero, sizeof(zero));
+	put_attribute(header, "screenWindowCenter", "v2f", value);
+
+	value.clear();
+	put_le(value, &one, sizeof(one));
+	put_attribute(header, "screenWindowWidth", "float", value);
+
+	header.push_back(0);
+
+	// one scanline per block: y, data size, then every channel of the line
+	const int32_t lineBytes = width * 3 * sizeof(float);
+	const uint64_t blockBytes = 8 + lineBytes;
+	uint64_t offset = header.size() + (uint64_t)height * sizeof(uint64_t);
+	for (int y = 0; y < height; y++) {
+		put_le(header, &offset, sizeof(offset));
+		offset += blockBytes;
+	}
+
+	out.reserve(offset);
+	for (int32_t y = 0; y < height; y++) {
+		put_le32(out, y);
+		put_le32(out, lineBytes);
+		for (int c = 0; c < 3; c++)
+			for (int x = 0; x < width; x++)
+				put_le(out, &pixels[y * width + x].s[channel_index[c]], sizeof(float));
+	}
+}
+
+bool write_ppm(const char *fname, const cl_float4 *pixels, int width, int height)
+{
+	std::vector<unsigned char> data;
+	encode_ppm(pixels, width, height, data);
+	return write_file(fname, data);
+}
+
+bool write_png(const char *fname, const cl_float4 *pixels, int width, int height)
+{
+	std::vector<unsigned char> data;
+	encode_png(pixels, width, height, data);
+	return write_file(fname, data);
+}
+
+bool write_exr(const char *fname, const cl_float4 *pixels, int width, int height)
+{
+	std::vector<unsigned char> data;
+	encode_exr(pixels, width, height, data);
+	return write_file(fname, data);
+}
+
+static std::string extension(const char *fname)
+{
+	std::string name = fname;
+	size_t dot = name.find_last_of('.');
+	if (dot == std::string::npos) return "";
+	std::string ext = name.substr(dot + 1);
+	for (auto &ch : ext)
+		ch = tolower(ch);
+	return ext;
+}
+
+bool is_image_format_supported(const char *fname)
+{
+	std::string ext = extension(fname);
+	return ext == "ppm" || ext == "png" || ext == "exr";
+}
+
+bool encode_image(const char *format, const cl_float4 *pixels, int width, int height, std::vector<unsigned char> &out)
+{
+	std::string ext = format;
+	for (auto &ch : ext)
+		ch = tolower(ch);
+	if (ext == "png")
+		encode_png(pixels, width, height, out);
+	else if (ext == "exr")
+		encode_exr(pixels, width, height, out);
+	else if (ext == "ppm")
+		encode_ppm(pixels, width, height, out);
+	else
+		return false;
+	return true;
+}
+
+bool write_image(const char *fname, const cl_float4 *pixels, int width, int height)
+{
+	std::string ext = extension(fname);
+	if (ext == "png")
+		return write_png(fname, pixels, width, height);
+	if (ext == "exr")
+		return write_exr(fname, pixels, width, height);
+	if (ext == "ppm")
+		return write_ppm(fname, pixels, width, height);
+
+	std::cout << "Unknown image format: " << fname << std::endl;
+	return false;
+}
@@ -0,0 +1,27 @@
+#include <vector>
+
+#include "primitives.h"
+
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+// Writers for the float RGBA frames read back from the kernel output.
+// PPM and PNG are clamped to 8 bits, EXR keeps the linear float values.
+bool write_ppm(const char *fname, const cl_float4 *pixels, int width, int height);
+bool write_png(const char *fname, const cl_float4 *pixels, int width, int height);
+bool write_exr(const char *fname, const cl_float4 *pixels, int width, int height);
+
+// The same encodings into memory, out is replaced
+void encode_ppm(const cl_float4 *pixels, int width, int height, std::vector<unsigned char> &out);
+void encode_png(const cl_float4 *pixels, int width, int height, std::vector<unsigned char> &out);
+void encode_exr(const cl_float4 *pixels, int width, int height, std::vector<unsigned char> &out);
+// format is "ppm", "png" or "exr"; false for anything else
+bool encode_image(const char *format, const cl_float4 *pixels, int width, int height, std::vector<unsigned char> &out);
+
+// Picks the writer from the file extension (.ppm, .png or .exr)
+bool write_image(const char *fname, const cl_float4 *pixels, int width, int height);
+
+// True if write_image knows the extension of fname
+bool is_image_format_supported(const char *fname);
+
+#endif
@@ -0,0 +1,123 @@
+#include "instance_tree.h"
+#include "bvh.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+void instance_transform(cl_float scale, const cl_float rotation[3], const cl_float4 &position, cl_float4 worldToObject[3])
+{
+	// object to world rotation, each axis applied after the previous ones
+	cl_float r[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+	for (int a = 0; a < 3; a++) {
+		const cl_float angle = rotation[a] * 3.14159265358979f / 180;
+		const cl_float c = std::cos(angle), s = std::sin(angle);
+		const int u = (a + 1) % 3, v = (a + 2) % 3;
+		for (int col = 0; col < 3; col++) {
+			const cl_float ru = r[u][col], rv = r[v][col];
+			r[u][col] = c * ru - s * rv;
+			r[v][col] = s * ru + c * rv;
+		}
+	}
+
+	// the inverse: transposed rotation and 1 / scale, undoing position first
+	for (int i = 0; i < 3; i++) {
+		cl_float4 row = { r[0][i] / scale, r[1][i] / scale, r[2][i] / scale, 0 };
+		row.s[3] = -(row.s[0] * position.s[0] + row.s[1] * position.s[1] + row.s[2] * position.s[2]);
+		worldToObject[i] = row;
+	}
+}
+
+void add_instance(triangle_meshes &meshes, const mesh_object &object, const rt_material &material, const cl_float4 worldToObject[3])
+{
+	rt_instance instance;
+	memset(&instance, 0, sizeof(rt_instance));
+	for (int i = 0; i < 3; i++)
+		instance.world_to_object[i] = worldToObject[i];
+	instance.root = object.root;
+	instance.first_triangle = object.first_triangle;
+	instance.material = (cl_int)meshes.materials.size();
+	meshes.instances.push_back(instance);
+	meshes.materials.push_back(material);
+}
+
+// Inverse of the affine map given by three rows, false if it is singular
+static bool invert_affine(const cl_float4 m[3], cl_float4 inv[3])
+{
+	const cl_float a00 = m[0].s[0], a01 = m[0].s[1], a02 = m[0].s[2];
+	const cl_float a10 = m[1].s[0], a11 = m[1].s[1], a12 = m[1].s[2];
+	const cl_float a20 = m[2].s[0], a21 = m[2].s[1], a22 = m[2].s[2];
+	const cl_float det = a00 * (a11 * a22 - a12 * a21) - a01 * (a10 * a22 - a12 * a20) + a02 * (a10 * a21 - a11 * a20);
+	if (det == 0 || !std::isfinite(det))
+		return false;
+
+	const cl_float b[3][3] = {
+		{ (a11 * a22 - a12 * a21) / det, (a02 * a21 - a01 * a22) / det, (a01 * a12 - a02 * a11) / det },
+		{ (a12 * a20 - a10 * a22) / det, (a00 * a22 - a02 * a20) / det, (a02 * a10 - a00 * a12) / det },
+		{ (a10 * a21 - a11 * a20) / det, (a01 * a20 - a00 * a21) / det, (a00 * a11 - a01 * a10) / det },
+	};
+	for (int i = 0; i < 3; i++) {
+		cl_float4 row = { b[i][0], b[i][1], b[i][2], 0 };
+		row.s[3] = -(b[i][0] * m[0].s[3] + b[i][1] * m[1].s[3] + b[i][2] * m[2].s[3]);
+		inv[i] = row;
+	}
+	return true;
+}
+
+// World bounds of the object box of an instance, slightly padded: rays are
+// transformed into the object, and rounding there must not miss a surface
+// lying on the box. A singular transform gets an empty box and is never hit.
+static void instance_box(const triangle_meshes &meshes, const rt_instance &instance, cl_float4 box[2])
+{
+	box[0] = { FLT_MAX, FLT_MAX, FLT_MAX, 0 };
+	box[1] = { -FLT_MAX, -FLT_MAX, -FLT_MAX, 0 };
+	cl_float4 toWorld[3];
+	if (!invert_affine(instance.world_to_object, toWorld))
+		return;
+
+	const rt_bvh_node &root = meshes.nodes[instance.root];
+	for (int corner = 0; corner < 8; corner++) {
+		cl_float p[3];
+		for (int a = 0; a < 3; a++)
+			p[a] = (corner >> a) & 1 ? root.bbox_max.s[a] : root.bbox_min.s[a];
+		for (int i = 0; i < 3; i++) {
+			const cl_float w = toWorld[i].s[0] * p[0] + toWorld[i].s[1] * p[1] + toWorld[i].s[2] * p[2] + toWorld[i].s[3];
+			box[0].s[i] = std::min(box[0].s[i], w);
+			box[1].s[i] = std::max(box[1].s[i], w);
+		}
+	}
+
+	cl_float extent = 0;
+	for (int a = 0; a < 3; a++)
+		extent = std::max(extent, box[1].s[a] - box[0].s[a]);
+	const cl_float pad = extent * 1e-5f;
+	for (int a = 0; a < 3; a++) {
+		box[0].s[a] -= pad;
+		box[1].s[a] += pad;
+	}
+}
+
+void build_instance_tree(triangle_meshes &meshes)
+{
+	const int count = (int)meshes.instances.size();
+	meshes.instanceNodes.clear();
+	if (count == 0)
+		return;
+
+	std::vector<cl_float4> boxes(2 * count);
+	for (int i = 0; i < count; i++)
+		instance_box(meshes, meshes.instances[i], &boxes[2 * i]);
+	std::vector<int> order;
+	meshes.instanceNodes = build_box_bvh(boxes.data(), count, order);
+
+	std::vector<rt_instance> sorted(count);
+	for (int i = 0; i < count; i++)
+		sorted[i] = meshes.instances[order[i]];
+	meshes.instances.swap(sorted);
+}
+
+int instance_node_capacity(int count)
+{
+	return count > 0 ? 2 * count - 1 : 0;
+}
@@ -0,0 +1,25 @@
+#include <vector>
+
+#include "scene.h"
+#include "mesh_io.h"
+
+#ifndef INSTANCE_TREE_H
+#define INSTANCE_TREE_H
+
+// world_to_object of an instance scaled by scale, then rotated about x, y and
+// z (degrees, in that order) and then moved to position. scale must be positive.
+void instance_transform(cl_float scale, const cl_float rotation[3], const cl_float4 &position, cl_float4 worldToObject[3]);
+
+// Appends an instance of object with its own material; rebuild the tree after
+void add_instance(triangle_meshes &meshes, const mesh_object &object, const rt_material &material, const cl_float4 worldToObject[3]);
+
+// Rebuilds meshes.instanceNodes, the top-level BVH over the world bounds of
+// the instances, and reorders meshes.instances to match its leaves. Moving
+// instances only calls for this: the object BVHs stay as they were built.
+void build_instance_tree(triangle_meshes &meshes);
+
+// Nodes the top-level tree over count instances can take, which the node
+// buffer reserves so any rebuild fits in place
+int instance_node_capacity(int count);
+
+#endif
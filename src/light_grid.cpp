@@ -0,0 +1,100 @@
+#include "light_grid.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+// Slack on the light radius in cells, so a point that rounds into the
+// neighbouring cell in the kernel still finds the lights that reach it
+#define LIGHT_GRID_SLACK 1e-3f
+
+static bool is_bounded(const rt_light &light)
+{
+	return light.type == Point && light.radius > 0;
+}
+
+// Squared distance from p to the box [lo, hi]
+static cl_float box_distance2(const cl_float p[3], const cl_float lo[3], const cl_float hi[3])
+{
+	cl_float d2 = 0;
+	for (int a = 0; a < 3; a++) {
+		cl_float d = std::max(std::max(lo[a] - p[a], p[a] - hi[a]), 0.0f);
+		d2 += d * d;
+	}
+	return d2;
+}
+
+bool build_light_grid(const std::vector<rt_light> &lights, rt_scene &scene, light_grid &grid)
+{
+	grid.cells.clear();
+	grid.indices.clear();
+	memset(&scene.light_grid_min, 0, sizeof(scene.light_grid_min));
+	memset(&scene.light_grid_dims, 0, sizeof(scene.light_grid_dims));
+	scene.light_grid_cell = 0;
+
+	cl_float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	int bounded = 0;
+	for (auto &light : lights) {
+		if (!is_bounded(light)) continue;
+		bounded++;
+		for (int a = 0; a < 3; a++) {
+			lo[a] = std::min(lo[a], light.position.s[a] - light.radius);
+			hi[a] = std::max(hi[a], light.position.s[a] + light.radius);
+		}
+	}
+	if (bounded < LIGHT_GRID_MIN_LIGHTS)
+		return false;
+
+	// cubic cells, as many as LIGHT_GRID_CELLS_PER_LIGHT per light would fill the bounds with
+	cl_float extent[3], volume = 1, longest = 0;
+	for (int a = 0; a < 3; a++) {
+		extent[a] = hi[a] - lo[a];
+		volume *= extent[a];
+		longest = std::max(longest, extent[a]);
+	}
+	cl_float cell = std::cbrt(volume / (bounded * LIGHT_GRID_CELLS_PER_LIGHT));
+	cell = std::max(cell, longest / LIGHT_GRID_MAX_DIM);
+	int dims[3];
+	for (int a = 0; a < 3; a++)
+		dims[a] = std::max(1, std::min(LIGHT_GRID_MAX_DIM, (int)std::ceil(extent[a] / cell)));
+	const int cellCount = dims[0] * dims[1] * dims[2];
+
+	// lights are visited in order, which keeps every list ascending
+	std::vector<std::vector<cl_int> > lists(cellCount + 1);
+	for (int i = 0; i < (int)lights.size(); i++) {
+		const rt_light &light = lights[i];
+		if (!is_bounded(light)) {
+			for (auto &list : lists)
+				list.push_back(i);
+			continue;
+		}
+		const cl_float *p = light.position.s;
+		const cl_float reach = light.radius + cell * LIGHT_GRID_SLACK;
+		int first[3], last[3];
+		for (int a = 0; a < 3; a++) {
+			first[a] = std::max(0, (int)std::floor((p[a] - reach - lo[a]) / cell));
+			last[a] = std::min(dims[a] - 1, (int)std::floor((p[a] + reach - lo[a]) / cell));
+		}
+		for (int z = first[2]; z <= last[2]; z++)
+			for (int y = first[1]; y <= last[1]; y++)
+				for (int x = first[0]; x <= last[0]; x++) {
+					const cl_float cellLo[3] = { lo[0] + x * cell, lo[1] + y * cell, lo[2] + z * cell };
+					const cl_float cellHi[3] = { cellLo[0] + cell, cellLo[1] + cell, cellLo[2] + cell };
+					if (box_distance2(p, cellLo, cellHi) <= reach * reach)
+						lists[(z * dims[1] + y) * dims[0] + x].push_back(i);
+				}
+	}
+
+	grid.cells.resize(lists.size());
+	for (size_t c = 0; c < lists.size(); c++) {
+		grid.cells[c].s[0] = (cl_int)grid.indices.size();
+		grid.cells[c].s[1] = (cl_int)lists[c].size();
+		grid.indices.insert(grid.indices.end(), lists[c].begin(), lists[c].end());
+	}
+
+	scene.light_grid_min = { lo[0], lo[1], lo[2], 0 };
+	scene.light_grid_dims = { dims[0], dims[1], dims[2], cellCount + 1 };
+	scene.light_grid_cell = cell;
+	return true;
+}
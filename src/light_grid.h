@@ -0,0 +1,30 @@
+#include <vector>
+
+#include "scene.h"
+
+#ifndef LIGHT_GRID_H
+#define LIGHT_GRID_H
+
+// Below this many point lights with a radius every light is evaluated at
+// every hit, the grid lookup would cost more than the lights it skips
+#define LIGHT_GRID_MIN_LIGHTS 8
+// Cells per bounded light on average, and per axis at most
+#define LIGHT_GRID_CELLS_PER_LIGHT 4
+#define LIGHT_GRID_MAX_DIM 64
+
+// World-space grid of light lists over the spheres of influence of the point
+// lights with a radius. Each cell lists, in ascending order, the lights that
+// can reach a point inside it: every light without a radius plus the bounded
+// ones whose sphere overlaps the cell. The extra last cell is for points
+// outside the grid and only lists the unbounded lights.
+typedef struct {
+	std::vector<cl_int2> cells;		// first entry in indices and count
+	std::vector<cl_int> indices;
+} light_grid;
+
+// Builds the grid and stores its placement in the light_grid_* fields of
+// scene. Returns false and leaves grid empty when there are too few bounded
+// lights to need one.
+bool build_light_grid(const std::vector<rt_light> &lights, rt_scene &scene, light_grid &grid);
+
+#endif
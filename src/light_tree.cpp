@@ -0,0 +1,81 @@
+#include "light_tree.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+typedef struct {
+	const std::vector<rt_light> *lights;
+	std::vector<cl_int> order;		// point light indices, partitioned as the tree is built
+	std::vector<rt_light_node> nodes;
+} light_tree_builder;
+
+// Fills node from order[first, first + count), splitting at the median of the
+// longest axis of the light positions
+static void build_node(light_tree_builder &b, int nodeIndex, int first, int count)
+{
+	const std::vector<rt_light> &lights = *b.lights;
+	cl_float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	cl_float intensity = 0, reach = 0;
+	bool bounded = true;
+	for (int i = first; i < first + count; i++) {
+		const rt_light &light = lights[b.order[i]];
+		for (int a = 0; a < 3; a++) {
+			lo[a] = std::min(lo[a], light.position.s[a]);
+			hi[a] = std::max(hi[a], light.position.s[a]);
+		}
+		intensity += std::fabs(light.intensity);
+		reach = std::max(reach, light.radius);
+		bounded &= light.radius > 0;
+	}
+
+	rt_light_node node;
+	node.bbox_min = { lo[0], lo[1], lo[2], 0 };
+	node.bbox_max = { hi[0], hi[1], hi[2], 0 };
+	node.intensity = intensity;
+	node.left = -1;
+	node.light = count == 1 ? b.order[first] : -1;
+	node.reach = bounded ? reach : 0;
+	b.nodes[nodeIndex] = node;
+	if (count == 1)
+		return;
+
+	int axis = 0;
+	for (int a = 1; a < 3; a++)
+		if (hi[a] - lo[a] > hi[axis] - lo[axis])
+			axis = a;
+	const int half = count / 2;
+	std::nth_element(b.order.begin() + first, b.order.begin() + first + half, b.order.begin() + first + count,
+		[&](cl_int x, cl_int y) { return lights[x].position.s[axis] < lights[y].position.s[axis]; });
+
+	// children next to each other, like the sphere BVH
+	const int left = (int)b.nodes.size();
+	b.nodes[nodeIndex].left = left;
+	b.nodes.resize(b.nodes.size() + 2);
+	build_node(b, left, first, half);
+	build_node(b, left + 1, first + half, count - half);
+}
+
+void build_light_tree(const std::vector<rt_light> &lights, std::vector<rt_light_node> &nodes, std::vector<cl_int> &globals)
+{
+	light_tree_builder b;
+	b.lights = &lights;
+	globals.clear();
+	for (int i = 0; i < (int)lights.size(); i++) {
+		if (lights[i].type == Point)
+			b.order.push_back(i);
+		else
+			globals.push_back(i);
+	}
+	if (b.order.empty()) {
+		globals.clear();
+		nodes.clear();
+		return;
+	}
+
+	// a binary tree with one light per leaf has 2n - 1 nodes
+	b.nodes.reserve(2 * b.order.size() - 1);
+	b.nodes.resize(1);
+	build_node(b, 0, 0, (int)b.order.size());
+	nodes.swap(b.nodes);
+}
@@ -0,0 +1,16 @@
+#include <vector>
+
+#include "scene.h"
+
+#ifndef LIGHT_TREE_H
+#define LIGHT_TREE_H
+
+// Binary tree over the point lights for importance sampling (--light-samples):
+// the kernel walks it from node 0, choosing a child by the estimated
+// contribution of its lights, and ends at a leaf holding a single light.
+// Ambient and directional lights do not fall off with distance and stay out
+// of the tree; their indices go to globals, they are evaluated at every hit.
+// Leaves the vectors empty when there are no point lights.
+void build_light_tree(const std::vector<rt_light> &lights, std::vector<rt_light_node> &nodes, std::vector<cl_int> &globals);
+
+#endif
@@ -0,0 +1,373 @@
+#include "mesh_io.h"
+#include "bvh.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+// Destination of the file being read
+typedef struct {
+	triangle_meshes *meshes;
+	int firstVertex;		// index in meshes of the first vertex of the file
+} mesh_reader;
+
+static void add_vertex(mesh_reader &r, const cl_float v[3])
+{
+	cl_float4 p = { v[0], v[1], v[2], 0 };
+	r.meshes->vertices.push_back(p);
+}
+
+static int file_vertex_count(const mesh_reader &r)
+{
+	return (int)r.meshes->vertices.size() - r.firstVertex;
+}
+
+// Splits a polygon given by file vertex indices into a fan around its first vertex
+static void add_polygon(mesh_reader &r, const std::vector<int> &face)
+{
+	for (size_t i = 2; i < face.size(); i++) {
+		cl_int4 tri = { r.firstVertex + face[0], r.firstVertex + face[i - 1], r.firstVertex + face[i], 0 };
+		r.meshes->triangles.push_back(tri);
+	}
+}
+
+static std::string at_line(int line, const char *message)
+{
+	return "line " + std::to_string(line) + ": " + message;
+}
+
+// Wavefront OBJ: "v x y z" and "f a b c ..." lines, where a face vertex is
+// "v", "v/vt", "v//vn" or "v/vt/vn" and a negative index counts back from the
+// last vertex read. Every other statement is skipped.
+static bool read_obj(std::istream &in, mesh_reader &r, std::string &error)
+{
+	std::string line;
+	std::vector<int> face;
+	int lineNo = 0;
+	while (std::getline(in, line)) {
+		lineNo++;
+		const char *c = line.c_str();
+		while (isspace((unsigned char)*c)) c++;
+		if (c[0] == 'v' && isspace((unsigned char)c[1])) {
+			cl_float v[3];
+			c++;
+			for (int a = 0; a < 3; a++) {
+				char *end;
+				v[a] = strtof(c, &end);
+				if (end == c) {
+					error = at_line(lineNo, "expected \"v x y z\"");
+					return false;
+				}
+				c = end;
+			}
+			add_vertex(r, v);
+		} else if (c[0] == 'f' && isspace((unsigned char)c[1])) {
+			face.clear();
+			const int count = file_vertex_count(r);
+			c++;
+			while (true) {
+				while (isspace((unsigned char)*c)) c++;
+				if (!*c) break;
+				char *end;
+				long index = strtol(c, &end, 10);
+				if (end == c || (*end && *end != '/' && !isspace((unsigned char)*end))) {
+					error = at_line(lineNo, "expected vertex indices after \"f\"");
+					return false;
+				}
+				index = index < 0 ? count + index : index - 1;
+				if (index < 0 || index >= count) {
+					error = at_line(lineNo, "vertex index out of range");
+					return false;
+				}
+				face.push_back((int)index);
+				// texture and normal indices are not used
+				c = end;
+				while (*c && !isspace((unsigned char)*c)) c++;
+			}
+			if (face.size() < 3) {
+				error = at_line(lineNo, "a face needs at least 3 vertices");
+				return false;
+			}
+			add_polygon(r, face);
+		}
+	}
+	return true;
+}
+
+typedef enum { PlyInt8, PlyUint8, PlyInt16, PlyUint16, PlyInt32, PlyUint32, PlyFloat32, PlyFloat64 } ply_type;
+typedef enum { PlyAscii, PlyLittleEndian, PlyBigEndian } ply_format;
+
+typedef struct {
+	std::string name;
+	ply_type type;
+	bool list;
+	ply_type countType;		// type of the item count of a list
+} ply_property;
+
+typedef struct {
+	std::string name;
+	long count;
+	std::vector<ply_property> properties;
+} ply_element;
+
+static bool parse_ply_type(const std::string &name, ply_type &type)
+{
+	static const struct { const char *name; ply_type type; } types[] = {
+		{ "char", PlyInt8 }, { "int8", PlyInt8 }, { "uchar", PlyUint8 }, { "uint8", PlyUint8 },
+		{ "short", PlyInt16 }, { "int16", PlyInt16 }, { "ushort", PlyUint16 }, { "uint16", PlyUint16 },
+		{ "int", PlyInt32 }, { "int32", PlyInt32 }, { "uint", PlyUint32 }, { "uint32", PlyUint32 },
+		{ "float", PlyFloat32 }, { "float32", PlyFloat32 }, { "double", PlyFloat64 }, { "float64", PlyFloat64 },
+	};
+	for (auto &t : types) {
+		if (name == t.name) {
+			type = t.type;
+			return true;
+		}
+	}
+	return false;
+}
+
+static int ply_size(ply_type type)
+{
+	switch (type) {
+	case PlyInt8: case PlyUint8: return 1;
+	case PlyInt16: case PlyUint16: return 2;
+	case PlyFloat64: return 8;
+	default: return 4;
+	}
+}
+
+static bool host_little_endian()
+{
+	const uint16_t one = 1;
+	unsigned char low;
+	memcpy(&low, &one, 1);
+	return low == 1;
+}
+
+#define PLY_CASE(tag, T) case tag: { T v; memcpy(&v, bytes, sizeof(v)); value = v; break; }
+
+// Next value of the element data, false at its end or on a malformed number
+static bool read_ply_value(std::istream &in, ply_format format, ply_type type, double &value)
+{
+	if (format == PlyAscii)
+		return (bool)(in >> value);
+
+	unsigned char bytes[8];
+	const int size = ply_size(type);
+	if (!in.read((char*)bytes, size))
+		return false;
+	if ((format == PlyLittleEndian) != host_little_endian())
+		std::reverse(bytes, bytes + size);
+	switch (type) {
+	PLY_CASE(PlyInt8, int8_t)
+	PLY_CASE(PlyUint8, uint8_t)
+	PLY_CASE(PlyInt16, int16_t)
+	PLY_CASE(PlyUint16, uint16_t)
+	PLY_CASE(PlyInt32, int32_t)
+	PLY_CASE(PlyUint32, uint32_t)
+	PLY_CASE(PlyFloat32, float)
+	PLY_CASE(PlyFloat64, double)
+	}
+	return true;
+}
+
+#undef PLY_CASE
+
+static bool read_ply_header(std::istream &in, ply_format &format, std::vector<ply_element> &elements, std::string &error)
+{
+	std::string line;
+	bool hasFormat = false;
+	int lineNo = 0;
+	while (std::getline(in, line)) {
+		lineNo++;
+		if (!line.empty() && line[line.size() - 1] == '\r')
+			line.erase(line.size() - 1);
+		if (lineNo == 1) {
+			if (line != "ply") {
+				error = "not a PLY file";
+				return false;
+			}
+			continue;
+		}
+
+		std::istringstream words(line);
+		std::string keyword;
+		words >> keyword;
+		if (keyword == "format") {
+			std::string name;
+			words >> name;
+			if (name == "ascii") format = PlyAscii;
+			else if (name == "binary_little_endian") format = PlyLittleEndian;
+			else if (name == "binary_big_endian") format = PlyBigEndian;
+			else {
+				error = at_line(lineNo, "unknown PLY format");
+				return false;
+			}
+			hasFormat = true;
+		} else if (keyword == "element") {
+			ply_element element;
+			if (!(words >> element.name >> element.count) || element.count < 0) {
+				error = at_line(lineNo, "expected \"element name count\"");
+				return false;
+			}
+			elements.push_back(element);
+		} else if (keyword == "property") {
+			ply_property property;
+			std::string type, countType;
+			words >> type;
+			property.list = type == "list";
+			if (property.list)
+				words >> countType >> type;
+			if (elements.empty() || !parse_ply_type(type, property.type)
+					|| (property.list && (!parse_ply_type(countType, property.countType) || property.countType >= PlyFloat32))
+					|| !(words >> property.name)) {
+				error = at_line(lineNo, "bad property");
+				return false;
+			}
+			elements.back().properties.push_back(property);
+		} else if (keyword == "end_header") {
+			if (!hasFormat) {
+				error = "missing PLY format";
+				return false;
+			}
+			return true;
+		}
+		// comment and obj_info lines are skipped
+	}
+	error = "missing end_header";
+	return false;
+}
+
+// PLY, ASCII or binary: x, y and z of the "vertex" elements and the
+// vertex_indices (or vertex_index) list of the "face" elements. Other
+// properties and elements are read past.
+static bool read_ply(std::istream &in, mesh_reader &r, std::string &error)
+{
+	ply_format format = PlyAscii;
+	std::vector<ply_element> elements;
+	if (!read_ply_header(in, format, elements, error))
+		return false;
+
+	std::vector<int> face;
+	for (auto &element : elements) {
+		const bool isVertex = element.name == "vertex";
+		const bool isFace = element.name == "face";
+		// positions of the used properties in the records, -1 if missing
+		int xyz[3] = { -1, -1, -1 };
+		int indexList = -1;
+		for (int i = 0; i < (int)element.properties.size(); i++) {
+			const ply_property &p = element.properties[i];
+			if (!p.list && p.name.size() == 1 && p.name[0] >= 'x' && p.name[0] <= 'z')
+				xyz[p.name[0] - 'x'] = i;
+			if (p.list && (p.name == "vertex_indices" || p.name == "vertex_index"))
+				indexList = i;
+		}
+		if (isVertex && (xyz[0] < 0 || xyz[1] < 0 || xyz[2] < 0)) {
+			error = "vertices without x, y and z";
+			return false;
+		}
+		if (isFace && indexList < 0) {
+			error = "faces without vertex_indices";
+			return false;
+		}
+
+		const int count = file_vertex_count(r);
+		for (long n = 0; n < element.count; n++) {
+			cl_float v[3] = { 0, 0, 0 };
+			face.clear();
+			for (int i = 0; i < (int)element.properties.size(); i++) {
+				const ply_property &p = element.properties[i];
+				double value;
+				if (!read_ply_value(in, format, p.list ? p.countType : p.type, value) || (p.list && value < 0)) {
+					error = "truncated " + element.name + " data";
+					return false;
+				}
+				if (!p.list) {
+					for (int a = 0; a < 3; a++)
+						if (xyz[a] == i) v[a] = (cl_float)value;
+					continue;
+				}
+				const long items = (long)value;
+				for (long k = 0; k < items; k++) {
+					if (!read_ply_value(in, format, p.type, value)) {
+						error = "truncated " + element.name + " data";
+						return false;
+					}
+					if (i == indexList)
+						face.push_back((int)value);
+				}
+			}
+
+			if (isVertex) {
+				add_vertex(r, v);
+			} else if (isFace) {
+				if (face.size() < 3) {
+					error = "a face needs at least 3 vertices";
+					return false;
+				}
+				for (int index : face) {
+					if (index < 0 || index >= count) {
+						error = "vertex index out of range";
+						return false;
+					}
+				}
+				add_polygon(r, face);
+			}
+		}
+	}
+	return true;
+}
+
+static bool has_extension(const char *fname, const char *ext)
+{
+	const size_t len = strlen(fname), extLen = strlen(ext);
+	if (len < extLen) return false;
+	for (size_t i = 0; i < extLen; i++)
+		if (tolower((unsigned char)fname[len - extLen + i]) != ext[i]) return false;
+	return true;
+}
+
+bool load_mesh(const char *fname, triangle_meshes &meshes, mesh_object &object)
+{
+	const bool obj = has_extension(fname, ".obj");
+	if (!obj && !has_extension(fname, ".ply")) {
+		std::cout << fname << ": unknown mesh format, expected .obj or .ply" << std::endl;
+		return false;
+	}
+	std::ifstream file(fname, std::ios::in | std::ios::binary);
+	if (!file.is_open()) {
+		std::cout << "Unable to open file " << fname << std::endl;
+		return false;
+	}
+
+	mesh_reader r;
+	r.meshes = &meshes;
+	r.firstVertex = (int)meshes.vertices.size();
+	const size_t triangles = meshes.triangles.size();
+	std::string error;
+	bool read = obj ? read_obj(file, r, error) : read_ply(file, r, error);
+	if (read && meshes.triangles.size() == triangles) {
+		error = "no faces";
+		read = false;
+	}
+	if (!read) {
+		std::cout << fname << ": " << error << std::endl;
+		// a broken file adds nothing
+		meshes.vertices.resize(r.firstVertex);
+		meshes.triangles.resize(triangles);
+		return false;
+	}
+
+	object.root = (cl_int)meshes.nodes.size();
+	object.first_triangle = (cl_int)triangles;
+	std::vector<rt_bvh_node> nodes = build_mesh_bvh(meshes.triangles.data() + triangles, (int)(meshes.triangles.size() - triangles), meshes.vertices.data());
+	meshes.nodes.insert(meshes.nodes.end(), nodes.begin(), nodes.end());
+	return true;
+}
@@ -0,0 +1,36 @@
+#include <vector>
+
+#include "scene.h"
+
+#ifndef MESH_IO_H
+#define MESH_IO_H
+
+// Triangle meshes of a scene, all of them in shared arrays laid out as rt.cl
+// reads them (see rt_scene). Every mesh file becomes one object: vertices with
+// w = 0, triangles holding three vertex indices in xyz (w is unused) and a BVH
+// in object space, built once. Instances place objects in the scene with a
+// transform and a material of their own, so repeating an object adds an
+// rt_instance and a material, not another copy of its triangles.
+typedef struct {
+	std::vector<cl_float4> vertices;
+	std::vector<cl_int4> triangles;
+	std::vector<rt_bvh_node> nodes;			// the object BVHs, see mesh_object
+	std::vector<rt_instance> instances;		// in the leaf order of instanceNodes, see instance_tree.h
+	std::vector<rt_bvh_node> instanceNodes;
+	std::vector<rt_material> materials;		// one per instance, in scene file order
+} triangle_meshes;
+
+// An object of triangle_meshes: its BVH starts at node root, and the leaves
+// count triangles from first_triangle on
+typedef struct {
+	cl_int root;
+	cl_int first_triangle;
+} mesh_object;
+
+// Appends the triangles of an OBJ or PLY file (chosen by extension) to meshes
+// as a new object and builds its BVH. The file is read as a stream, one line
+// or record at a time. Only the positions and the faces are used. Polygons are
+// split into triangle fans.
+bool load_mesh(const char *fname, triangle_meshes &meshes, mesh_object &object);
+
+#endif
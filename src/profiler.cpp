@@ -0,0 +1,211 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+
+static const char *stage_names[StageCount] = {
+	"update", "upload", "acquire", "kernel", "release", "readback", "draw", "frame"
+};
+
+static bool ends_with(const std::string &str, const std::string &suffix)
+{
+	return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+FrameProfiler::FrameProfiler(const char *dumpFile)
+	: nextFrame(0), json(false)
+{
+	if (!dumpFile) return;
+
+	std::string name = dumpFile;
+	json = ends_with(name, ".json") || ends_with(name, ".jsonl");
+	out.open(dumpFile);
+	if (!out.is_open()) {
+		std::cout << "Unable to open file " << dumpFile << std::endl;
+		return;
+	}
+	if (!json) {
+		out << "frame";
+		for (int s = 0; s < StageCount; s++)
+			out << "," << stage_names[s] << "_ms";
+		out << "\n";
+	}
+}
+
+FrameProfiler::~FrameProfiler()
+{
+	// GL queries are not deleted, the context is usually gone by now
+}
+
+int FrameProfiler::beginFrame()
+{
+	frame_record record;
+	record.frame = nextFrame++;
+	for (int s = 0; s < StageCount; s++) {
+		record.ms[s] = 0;
+		record.recorded[s] = false;
+	}
+	pending.push_back(record);
+	return record.frame;
+}
+
+FrameProfiler::frame_record *FrameProfiler::find(int frame)
+{
+	for (auto &record : pending)
+		if (record.frame == frame) return &record;
+	return NULL;
+}
+
+void FrameProfiler::addTime(int frame, profile_stage stage, double ms)
+{
+	frame_record *record = find(frame);
+	if (!record) return;
+	record->ms[stage] += ms;
+	record->recorded[stage] = true;
+}
+
+void FrameProfiler::addEvent(int frame, profile_stage stage, const cl::Event &event)
+{
+	frame_record *record = find(frame);
+	if (!record || event() == NULL) return;
+	record->events.push_back(std::make_pair(stage, event));
+}
+
+void FrameProfiler::beginQuery(int frame, profile_stage stage)
+{
+	frame_record *record = find(frame);
+	if (!record) return;
+
+	GLuint query;
+	if (freeQueries.empty()) {
+		glGenQueries(1, &query);
+	} else {
+		query = freeQueries.back();
+		freeQueries.pop_back();
+	}
+	glBeginQuery(GL_TIME_ELAPSED, query);
+	record->queries.push_back(std::make_pair(stage, query));
+}
+
+void FrameProfiler::endQuery()
+{
+	glEndQuery(GL_TIME_ELAPSED);
+}
+
+// Adds the event and query durations once all of them are available
+bool FrameProfiler::resolve(frame_record &record, bool wait)
+{
+	if (!wait) {
+		for (auto &ev : record.events) {
+			if (ev.second.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE)
+				return false;
+		}
+		for (auto &query : record.queries) {
+			GLuint available = 0;
+			glGetQueryObjectuiv(query.second, GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available)
+				return false;
+		}
+	}
+
+	for (auto &ev : record.events) {
+		try {
+			ev.second.wait();
+			cl_ulong start = ev.second.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			cl_ulong end = ev.second.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+			record.ms[ev.first] += (end - start) * 1e-6;
+			record.recorded[ev.first] = true;
+		} catch (cl::Error err) {
+			// queue without profiling or failed command, the stage stays unrecorded
+		}
+	}
+	for (auto &query : record.queries) {
+		GLuint64 ns = 0;
+		glGetQueryObjectui64v(query.second, GL_QUERY_RESULT, &ns);
+		record.ms[query.first] += ns * 1e-6;
+		record.recorded[query.first] = true;
+		freeQueries.push_back(query.second);
+	}
+	record.events.clear();
+	record.queries.clear();
+	return true;
+}
+
+void FrameProfiler::dump(const frame_record &record)
+{
+	if (!out.is_open()) return;
+
+	char buf[32];
+	if (json) {
+		out << "{\"frame\":" << record.frame;
+		for (int s = 0; s < StageCount; s++) {
+			if (!record.recorded[s]) continue;
+			snprintf(buf, sizeof(buf), "%.4f", record.ms[s]);
+			out << ",\"" << stage_names[s] << "_ms\":" << buf;
+		}
+		out << "}\n";
+	} else {
+		out << record.frame;
+		for (int s = 0; s < StageCount; s++) {
+			out << ",";
+			if (!record.recorded[s]) continue;
+			snprintf(buf, sizeof(buf), "%.4f", record.ms[s]);
+			out << buf;
+		}
+		out << "\n";
+	}
+}
+
+void FrameProfiler::collect(bool wait)
+{
+	// in order, so the dump stays sorted by frame; the frame being recorded
+	// (the last one) is only taken when waiting for everything
+	while (pending.size() > (wait ? 0u : 1u)) {
+		frame_record &record = pending.front();
+		if (!resolve(record, wait))
+			break;
+		for (int s = 0; s < StageCount; s++)
+			if (record.recorded[s])
+				samples[s].push_back(record.ms[s]);
+		dump(record);
+		pending.pop_front();
+	}
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+	size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+	return sorted[index];
+}
+
+bool FrameProfiler::stats(profile_stage stage, stage_stats &result) const
+{
+	std::vector<double> sorted = samples[stage];
+	if (sorted.empty()) return false;
+	std::sort(sorted.begin(), sorted.end());
+	double sum = 0;
+	for (double v : sorted)
+		sum += v;
+	result.frames = (int)sorted.size();
+	result.mean = sum / sorted.size();
+	result.p50 = percentile(sorted, 0.50);
+	result.p95 = percentile(sorted, 0.95);
+	result.p99 = percentile(sorted, 0.99);
+	result.max = sorted.back();
+	return true;
+}
+
+void FrameProfiler::printSummary()
+{
+	char line[128];
+	snprintf(line, sizeof(line), "%-10s %8s %10s %10s %10s %10s %10s", "stage", "frames", "mean ms", "p50 ms", "p95 ms", "p99 ms", "max ms");
+	std::cout << line << std::endl;
+	for (int s = 0; s < StageCount; s++) {
+		stage_stats st;
+		if (!stats((profile_stage)s, st)) continue;
+		snprintf(line, sizeof(line), "%-10s %8d %10.3f %10.3f %10.3f %10.3f %10.3f", stage_names[s], st.frames,
+			st.mean, st.p50, st.p95, st.p99, st.max);
+		std::cout << line << std::endl;
+	}
+}
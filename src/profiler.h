@@ -0,0 +1,83 @@
+#include <glad/glad.h>
+
+#include <deque>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include "cl.hpp"
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+typedef enum {
+	StageUpdate,	// UpdateScene on the host
+	StageUpload,	// scene edits written to the device
+	StageAcquire,	// acquire of the interop texture
+	StageKernel,	// rt kernel, or the trace on the CPU backend
+	StageRelease,	// release of the interop texture
+	StageReadback,	// read of the output image in headless modes
+	StageDraw,		// GL screen quad
+	StageFrame,		// host wall time of the whole frame
+	StageCount
+} profile_stage;
+
+typedef struct {
+	int frames;
+	double mean;
+	double p50;
+	double p95;
+	double p99;
+	double max;
+} stage_stats;
+
+// Per-stage frame timings. CL events and GL timer queries complete later than
+// the frame that issued them, so frames stay pending until all their timings
+// are available and are then added to the statistics (and the dump) in order.
+class FrameProfiler {
+public:
+	// dumpFile: one line per frame, JSON lines if it ends in .json/.jsonl, CSV otherwise; NULL for none
+	explicit FrameProfiler(const char *dumpFile);
+	~FrameProfiler();
+
+	// Starts a new frame and returns its id for the calls below
+	int beginFrame();
+
+	void addTime(int frame, profile_stage stage, double ms);
+	// Adds END - START of the event, needs a queue with CL_QUEUE_PROFILING_ENABLE
+	void addEvent(int frame, profile_stage stage, const cl::Event &event);
+	// GL_TIME_ELAPSED query around the commands between the two calls
+	void beginQuery(int frame, profile_stage stage);
+	void endQuery();
+
+	// Resolves the pending frames that completed; with wait, all of them
+	void collect(bool wait);
+	// Statistics of the collected frames; false if the stage was never recorded
+	bool stats(profile_stage stage, stage_stats &result) const;
+	// p50/p95/p99 per stage, after collecting everything
+	void printSummary();
+
+private:
+	typedef struct {
+		int frame;
+		double ms[StageCount];
+		bool recorded[StageCount];
+		std::vector<std::pair<profile_stage, cl::Event> > events;
+		std::vector<std::pair<profile_stage, GLuint> > queries;
+	} frame_record;
+
+	frame_record *find(int frame);
+	bool resolve(frame_record &record, bool wait);
+	void dump(const frame_record &record);
+
+	std::deque<frame_record> pending;
+	std::vector<double> samples[StageCount];
+	std::vector<GLuint> freeQueries;
+	int nextFrame;
+
+	std::ofstream out;
+	bool json;
+};
+
+#endif
@@ -0,0 +1,51 @@
+#include "resolution_scaler.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Weight of the newest frame in the smoothed cost
+#define COST_SMOOTHING 0.2
+// Relative scale change below which the current size is kept
+#define SCALE_DEAD_BAND 0.05f
+// Largest relative scale change per update, a spike only shrinks the frame gradually
+#define SCALE_MAX_STEP 0.25f
+
+ResolutionScaler::ResolutionScaler(int width, int height, double targetMs, float minScale)
+	: fullWidth(width), fullHeight(height), targetMs(targetMs), minScale(minScale), costPerPixel(0)
+{
+	resize(1);
+}
+
+void ResolutionScaler::resize(float scale)
+{
+	current = scale;
+	if (scale >= 1) {
+		scaledWidth = fullWidth;
+		scaledHeight = fullHeight;
+		return;
+	}
+	// multiples of 8 keep the 16x16 groups mostly full and avoid odd sized resizes
+	scaledWidth = std::min(fullWidth, std::max(8, (int)(fullWidth * scale) / 8 * 8));
+	scaledHeight = std::min(fullHeight, std::max(8, (int)(fullHeight * scale) / 8 * 8));
+}
+
+bool ResolutionScaler::update(double ms, int pixels)
+{
+	if (ms <= 0 || pixels <= 0) return false;
+
+	const double cost = ms / pixels;
+	costPerPixel = costPerPixel > 0 ? costPerPixel + COST_SMOOTHING * (cost - costPerPixel) : cost;
+
+	// pixels that fit in the target, the scale applies to both axes
+	float wanted = (float)std::sqrt(targetMs / (costPerPixel * fullWidth * fullHeight));
+	wanted = std::max(current * (1 - SCALE_MAX_STEP), std::min(current * (1 + SCALE_MAX_STEP), wanted));
+	wanted = std::max(minScale, std::min(1.0f, wanted));
+	if (std::fabs(wanted - current) < SCALE_DEAD_BAND * current && wanted < 1 && wanted > minScale)
+		return false;
+	if (wanted == current)
+		return false;
+
+	const int oldWidth = scaledWidth, oldHeight = scaledHeight;
+	resize(wanted);
+	return scaledWidth != oldWidth || scaledHeight != oldHeight;
+}
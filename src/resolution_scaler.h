@@ -0,0 +1,36 @@
+#ifndef RESOLUTION_SCALER_H
+#define RESOLUTION_SCALER_H
+
+// Dynamic resolution: picks the fraction of the window resolution to trace so
+// the trace time stays near a target. The trace cost is modelled as linear in
+// the pixel count; the cost per pixel is smoothed over frames and the scale
+// only moves once the prediction leaves a dead band around the current one,
+// so small jitter neither resizes nor restarts accumulation every frame.
+class ResolutionScaler {
+public:
+	// width x height is the full resolution, scale 1
+	ResolutionScaler(int width, int height, double targetMs, float minScale);
+
+	// Feeds the trace time of a finished frame traced at pixels; true when the size changed
+	bool update(double ms, int pixels);
+
+	// Trace size at the current scale, a multiple of 8 below the full resolution
+	int width() const { return scaledWidth; }
+	int height() const { return scaledHeight; }
+	float scale() const { return current; }
+	double target() const { return targetMs; }
+
+private:
+	void resize(float scale);
+
+	int fullWidth;
+	int fullHeight;
+	double targetMs;
+	float minScale;
+	float current;
+	int scaledWidth;
+	int scaledHeight;
+	double costPerPixel;	// smoothed ms per traced pixel, 0 until the first frame
+};
+
+#endif
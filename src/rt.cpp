@@ -19,15 +19,30 @@
 
 #include "OpenGLUtil.h"
 
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <string>
 #include <chrono>
+#include <map>
+#include <memory>
 
 #include "scene.h"
+#include "bvh.h"
+#include "light_grid.h"
+#include "light_tree.h"
+#include "instance_tree.h"
 #include "quaternion.h"
+#include "image_io.h"
+#include "scene_io.h"
+#include "frame_writer.h"
+#include "cpu_tracer.h"
+#include "profiler.h"
+#include "resolution_scaler.h"
+#include "socket_server.h"
 
 using namespace std;
 using namespace cl;
@@ -63,27 +78,243 @@ static const uint indices[6] = {0,1,2,0,2,3};
 static int wind_width = 720;
 static int wind_height= 720;
 
+// Pinned read back buffers in the batch renderer, frames in flight between the tracer and the writer
+#define STAGING_SLOTS 3
+
+// Interop textures: with event sync frame N is traced into one while N-1 is presented from the other
+#define INTEROP_SLOTS 2
+
+// Wavefront counters, passed to rt.cl as build options: counters[bounce] holds
+// the paths entering that bounce, then comes the shadow queue length
+#define WF_SHADOW_COUNTER (MAX_RECURSION_DEPTH + 1)
+#define WF_COUNTERS (MAX_RECURSION_DEPTH + 2)
+
+// Work-group size of the wavefront passes, any size works with QueuePush
+#define WF_GROUP_SIZE 64
+
+// Lights per path in one wf_shadow pass, passed to rt.cl as a build option.
+// It bounds the shadow rays a pass appends per pixel, paths that see more
+// lights take further passes.
+#define WF_SHADOW_SLOTS 4
+
+// --accumulate stops growing the sample count here, later samples keep a
+// weight of 1 / (ACCUMULATE_MAX_SAMPLES + 1) so float precision holds up
+#define ACCUMULATE_MAX_SAMPLES 256
+
+// -DPERSISTENT groups are TILE_SIZE x TILE_SIZE, passed to rt.cl as a build option
+#define TILE_SIZE 8
+
+// --target-ms never traces below this fraction of the window size per axis
+#define MIN_RESOLUTION_SCALE 0.25f
+
+// cl_khr_gl_event / GL_ARB_cl_event entry points, neither is exposed by the headers we build against
+typedef cl_event (CL_API_CALL *createEventFromGLsync_fn)(cl_context context, cl_GLsync sync, cl_int *errcode_ret);
+typedef GLsync (APIENTRYP createSyncFromCLevent_fn)(struct _cl_context *context, struct _cl_event *event, GLbitfield flags);
+
+// Sync state of one interop texture in the pipelined path
+typedef struct {
+    Event traced;           // release after the kernel wrote the texture
+    GLsync tracedGL;        // the same event as a GL sync object, waited on before presenting
+    GLsync presented;       // GL fence after the quad sampled the texture, waited on by the next acquire
+    GLsync acquireFence;    // fence handed to the pending acquire, deleted once traced completed
+    int width;              // canvas traced into the texture, the quad shows only this corner
+    int height;
+    std::vector<Event> kernels; // trace commands of the frame, timed for --target-ms once traced completed
+} interop_slot;
+
+// One device of --multi-device and the rows of the frame it traces
+typedef struct {
+    Device d;
+    CommandQueue q;
+    Kernel k;               // rt of the current variant, with this device's image and history
+    Image2D image;          // canvas sized, only rows [y0, y0 + rows) are written
+    Buffer history;
+    int y0;
+    int rows;
+    double msPerRow;        // smoothed kernel time per row, 0 until measured
+    Event traced;
+    Event read;
+} device_share;
+
+// The wf_* passes of rt.cl
+typedef struct {
+    Kernel generate;
+    Kernel extend;
+    Kernel shade;
+    Kernel shadow;
+    Kernel connect;
+    Kernel output;
+} wavefront_kernels;
+
+// Kernels of one rt.cl build
+typedef struct {
+    Program program;
+    Kernel rt;
+    wavefront_kernels wf;
+} rt_kernels;
+
 typedef struct {
     Device d;
+    Context context;
     CommandQueue q;
     Program p;
     Kernel k;
-    ImageGL tex;
+    // rt.cl variants built for the scene configurations seen so far, keyed by
+    // build options; k is the one matching the current scene
+    std::map<std::string, rt_kernels> kernels;
+    std::string kernelOptions;
+
+    // --wavefront traces with wf instead of k, through these queues
+    bool wavefront;
+    wavefront_kernels wf;
+    Buffer rayQueues[2];
+    Buffer shadowQueue;
+    Buffer accum;
+    Buffer counters;
+
+    // --light-samples: point lights sampled per hit from a light tree, 0 evaluates all of them
+    int lightSamples;
+
+    // --persistent: rt pulls tiles from tileCounter with persistentGroups work-groups
+    bool persistent;
+    Buffer tileCounter;
+    unsigned persistentGroups;
+
+    // --multi-device: every device of the platform traces its own rows, the
+    // scene buffers are shared through one context and written by q
+    bool multiDevice;
+    std::vector<device_share> shares;
+
+    // --accumulate: running mean of the samples since the camera or scene last
+    // changed, on the device or in cpuHistory. sample is the count of the frame
+    // being traced, -1 forces a restart
+    bool accumulate;
+    Buffer history;
+    std::vector<cl_float4> cpuHistory;
+    int sample;
+    rt_camera sampleCamera;
+
+    ImageGL tex[INTEROP_SLOTS];
+    // headless output target, used instead of tex when there is no GL context
+    Image2D image;
+
+    // falls back to glFinish/clFinish around every frame when the extensions are missing
+    bool eventSync;
+    createEventFromGLsync_fn createEventFromGLsync;
+    interop_slot slots[INTEROP_SLOTS];
+
+    // --backend=cpu traces the host arrays directly, no OpenCL objects are created
+    CpuTracer *cpu;
+    std::vector<cl_float4> cpuPixels;
+
+    // --profile, profileFrame is the id of the frame being recorded
+    FrameProfiler *profiler;
+    int profileFrame;
+
+    // --target-ms: window mode traces canvas_width x canvas_height, a corner of
+    // the window sized textures, and the quad upscales it. traceEvents are the
+    // commands of the last enqueueTrace
+    ResolutionScaler *scaler;
+    std::vector<Event> traceEvents;
 
 	rt_scene scene;
+	rt_camera camera;
+	std::vector<rt_sphere> spheres;
+	std::vector<rt_light> lights;
+	std::vector<rt_bvh_node> bvh;
+	// mesh objects with their BVHs, and the instances placing them, see mesh_io.h
+	triangle_meshes meshes;
+	// position in spheres of each sphere in the order it was created or loaded
+	std::vector<int> sphereSlot;
+	// spheres packed in the device layout, the source of sphereMem uploads
+	std::vector<cl_float4> sphereStreams;
+	// lightMem contents: the lights, then the cells and indices of lightGrid if
+	// the scene has one, or the light tree and the lights outside it
+	light_grid lightGrid;
+	std::vector<rt_light_node> lightNodes;
+	std::vector<cl_int> globalLights;
+	std::vector<unsigned char> lightData;
+	// a loaded .rtsc file, its pages back the device scene buffers
+	mapped_scene sceneMap;
 	
 	Buffer sceneMem;
+	Buffer sphereMem;
+	Buffer lightMem;
+	Buffer bvhMem;
+
+	// host edits not yet uploaded, see uploadSceneChanges
+	Event uploaded;
+	bool sceneDirty;
+	bool instancesDirty;	// the instance tree is rebuilt before the next frame
+	dirty_range sphereDirty;
+	dirty_range lightDirty;
 } process_params;
 
 typedef struct {
     GLuint prg;
     GLuint vao;
-    GLuint tex;
+    GLuint tex[INTEROP_SLOTS];
+    createSyncFromCLevent_fn createSyncFromCLevent;
 } render_params;
 
 process_params params;
 render_params rparams;
 
+typedef std::chrono::steady_clock::time_point time_point;
+
+static double elapsedMs(time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Profiling hooks, no-ops without --profile
+static void profileTime(profile_stage stage, time_point start)
+{
+    if (params.profiler)
+        params.profiler->addTime(params.profileFrame, stage, elapsedMs(start));
+}
+
+static void profileEvent(profile_stage stage, const Event &event)
+{
+    if (params.profiler)
+        params.profiler->addEvent(params.profileFrame, stage, event);
+}
+
+static void profileBeginFrame()
+{
+    if (params.profiler)
+        params.profileFrame = params.profiler->beginFrame();
+}
+
+static void profileEndFrame(time_point start)
+{
+    if (params.profiler) {
+        profileTime(StageFrame, start);
+        params.profiler->collect(false);
+    }
+}
+
+// Kernel commands of a trace, kept for the profiler and the resolution scaler
+static Event *traceEvent(Event &event)
+{
+    return params.profiler || params.scaler ? &event : NULL;
+}
+
+static void recordTrace(const Event &event)
+{
+    profileEvent(StageKernel, event);
+    if (params.scaler && event() != NULL)
+        params.traceEvents.push_back(event);
+}
+
+static void profileFinish()
+{
+    if (params.profiler) {
+        params.profiler->collect(true);
+        params.profiler->printSummary();
+    }
+}
+
 bool w_pressed = false;
 bool a_pressed = false;
 bool s_pressed = false;
@@ -124,13 +355,21 @@ rt_light create_light(lightType type, cl_float intensity, cl_float4 position, cl
 
 
 
-rt_scene create_scene(int width, int height)
+void setCanvas(rt_scene &scene, int width, int height)
 {
 	auto min = width > height ? height : width;
 
-	int spheres_count = 3;
-	std::vector<rt_sphere> spheres;
-	std::vector<rt_light> lights;
+    scene.canvas_height = height;
+    scene.canvas_width = width;
+    scene.viewport_dist = 1;
+    scene.viewport_height = height / (cl_float) min;
+    scene.viewport_width = width / (cl_float) min;
+}
+
+rt_scene create_scene(int width, int height, std::vector<rt_sphere> &spheres, std::vector<rt_light> &lights)
+{
+	spheres.clear();
+	lights.clear();
 
 	spheres.push_back(create_spheres({ 2,0,4 }, { 0,1,0 }, 1, 10, 0.2f));
 	spheres.push_back(create_spheres({ -2,0,4 }, { 0,0,1 }, 1, 500, 0.3f));
@@ -158,24 +397,119 @@ rt_scene create_scene(int width, int height)
 
 	rt_scene scene;
     memset(&scene, 0, sizeof(rt_scene));
-	scene.camera_pos = { 0 };
-    scene.canvas_height = height;
-    scene.canvas_width = width;
-    scene.viewport_dist = 1;
-    scene.viewport_height = height / (cl_float) min;
-    scene.viewport_width = width / (cl_float) min;
+    setCanvas(scene, width, height);
 	scene.bg_color = { 0 };
 	scene.reflect_depth = 3;
 
     scene.sphere_count = spheres.size();
 	scene.light_count = lights.size();
 
-	std::copy(spheres.begin(), spheres.end(), scene.spheres);
-	std::copy(lights.begin(), lights.end(), scene.lights);
-
     return scene;
 }
 
+// Deterministic [0, 1) sequence for the presets, rand() is seeded with the time
+static cl_float presetRandom(unsigned &state)
+{
+	state = state * 1664525u + 1013904223u;
+	return (state >> 8) / (cl_float)(1 << 24);
+}
+
+static rt_scene finish_scene(int width, int height, int reflectDepth, const std::vector<rt_sphere> &spheres, const std::vector<rt_light> &lights)
+{
+	rt_scene scene;
+	memset(&scene, 0, sizeof(rt_scene));
+	setCanvas(scene, width, height);
+	scene.bg_color = { 0 };
+	scene.reflect_depth = reflectDepth;
+	scene.sphere_count = spheres.size();
+	scene.light_count = lights.size();
+	return scene;
+}
+
+// 100x100 grid of small random spheres on the ground sphere
+rt_scene create_grid_scene(int width, int height, std::vector<rt_sphere> &spheres, std::vector<rt_light> &lights)
+{
+	spheres.clear();
+	lights.clear();
+
+	unsigned state = 1;
+	for (int x = 0; x < 100; x++)
+	for (int z = 0; z < 100; z++)
+	{
+		cl_float r = presetRandom(state);
+		cl_float g = presetRandom(state);
+		cl_float b = presetRandom(state);
+		cl_float reflect = presetRandom(state) * 0.5f;
+		cl_int specular = (cl_int)(presetRandom(state) * 500);
+		spheres.push_back(create_spheres({ (x - 49.5f) * 1.2f, -0.6f, z * 1.2f + 4 }, { r,g,b }, 0.4f, specular, reflect));
+	}
+	spheres.push_back(create_spheres({ 0,-5001,3 }, { 1,1,0 }, 5000, 50, 0.2f));
+
+	lights.push_back(create_light(Ambient, 0.2f, { 0 }, { 0 }));
+	lights.push_back(create_light(Point, 0.6f, { 0,10,60 }, { 0 }));
+	lights.push_back(create_light(Direct, 0.2f, { 0 }, { 1,4,4 }));
+
+	return finish_scene(width, height, 3, spheres, lights);
+}
+
+// create_scene spheres lit by a ring of 64 point lights
+rt_scene create_lights_scene(int width, int height, std::vector<rt_sphere> &spheres, std::vector<rt_light> &lights)
+{
+	create_scene(width, height, spheres, lights);
+	lights.clear();
+
+	const int count = 64;
+	lights.push_back(create_light(Ambient, 0.2f, { 0 }, { 0 }));
+	for (int i = 0; i < count; i++) {
+		cl_float a = i * 6.2831853f / count;
+		lights.push_back(create_light(Point, 0.8f / count, { 6 * sinf(a), 1.5f + (i % 4) * 0.5f, 3 - 6 * cosf(a) }, { 0 }));
+	}
+
+	return finish_scene(width, height, 3, spheres, lights);
+}
+
+// Mirror spheres around the create_scene ones at the maximum reflection depth
+rt_scene create_mirror_scene(int width, int height, std::vector<rt_sphere> &spheres, std::vector<rt_light> &lights)
+{
+	create_scene(width, height, spheres, lights);
+	for (auto &sphere : spheres)
+		sphere.reflect = 0.6f;
+
+	const int count = 12;
+	for (int i = 0; i < count; i++) {
+		cl_float a = i * 6.2831853f / count;
+		spheres.push_back(create_spheres({ 5 * sinf(a), 0.5f, 3 - 5 * cosf(a) }, { 0.9f,0.9f,0.9f }, 1, 1000, 0.9f));
+	}
+
+	return finish_scene(width, height, 5, spheres, lights);
+}
+
+typedef rt_scene (*scene_factory)(int width, int height, std::vector<rt_sphere> &spheres, std::vector<rt_light> &lights);
+
+// Canned scenes for rt bench, each with an orbit the default camera path follows
+typedef struct {
+	const char *name;
+	scene_factory create;
+	cl_float center[3];
+	cl_float radius;
+	cl_float height;
+} scene_preset;
+
+static const scene_preset scene_presets[] = {
+	{ "default", create_scene, { 0,0,3 }, 7, 2 },
+	{ "grid", create_grid_scene, { 0,0,64 }, 75, 25 },
+	{ "lights", create_lights_scene, { 0,0,3 }, 7, 2 },
+	{ "mirror", create_mirror_scene, { 0,0,3 }, 3.5f, 1 },
+};
+
+static const scene_preset *findPreset(const std::string &name)
+{
+	for (auto &preset : scene_presets)
+		if (name == preset.name)
+			return &preset;
+	return NULL;
+}
+
 void multiplyVector(cl_float v[3], cl_float s) {
 	v[0] *= s;
 	v[1] *= s;
@@ -201,17 +535,48 @@ void moveCamera(const cl_float direction[3], cl_float4 *vector, const cl_float s
 	addVector(vector, tmp);
 }
 
-void UpdateScene(rt_scene &scene, double frameRate) 
+// Camera orientation from the mouse angles, in degrees
+Quaternion<cl_float> cameraRotation(float pitch, float yaw)
 {
 	const cl_float xAxis[3] = { 1, 0, 0 };
 	const cl_float yAxis[3] = { 0, 1, 0 };
-	const cl_float zAxis[3] = { 0, 0, 1 };
 	const float PI_F = 3.14159265358979f;
 
 	Quaternion<cl_float> qX(xAxis, -pitch * PI_F / 180.0f);
 	Quaternion<cl_float> qY(yAxis, yaw * PI_F / 180.0f);
-	Quaternion<cl_float> q = qY * qX;
-	params.scene.camera_rotation = q.GetStruct();
+	return qY * qX;
+}
+
+// Folds the rotation and the canvas to viewport scale into the basis the
+// kernels build their rays from, so they do not rotate every pixel
+rt_camera_frame cameraFrame(const rt_scene &scene, const rt_camera &camera)
+{
+	const quaternion &r = camera.rotation;
+	Quaternion<cl_float> q(r.w, r.v.s[0], r.v.s[1], r.v.s[2]);
+	cl_float right[3] = { scene.viewport_width / scene.canvas_width, 0, 0 };
+	cl_float up[3] = { 0, scene.viewport_height / scene.canvas_height, 0 };
+	cl_float forward[3] = { 0, 0, scene.viewport_dist };
+	q.QuatRotation(right);
+	q.QuatRotation(up);
+	q.QuatRotation(forward);
+
+	rt_camera_frame frame;
+	frame.origin = camera.position;
+	frame.right = { right[0], right[1], right[2], 0 };
+	frame.up = { up[0], up[1], up[2], 0 };
+	frame.forward = { forward[0], forward[1], forward[2], 0 };
+	return frame;
+}
+
+void UpdateScene(rt_camera &camera, double frameRate) 
+{
+	const time_point start = std::chrono::steady_clock::now();
+	const cl_float xAxis[3] = { 1, 0, 0 };
+	const cl_float yAxis[3] = { 0, 1, 0 };
+	const cl_float zAxis[3] = { 0, 0, 1 };
+
+	Quaternion<cl_float> q = cameraRotation(pitch, yaw);
+	camera.rotation = q.GetStruct();
 
 
 	auto speed = (cl_float)frameRate;
@@ -219,18 +584,20 @@ void UpdateScene(rt_scene &scene, double frameRate)
 		speed *= 3;
 
 	if (w_pressed) 
-		moveCamera(q, zAxis, &params.scene.camera_pos, speed);
+		moveCamera(q, zAxis, &camera.position, speed);
 	if (a_pressed)
-		moveCamera(q, xAxis, &params.scene.camera_pos, -speed);
+		moveCamera(q, xAxis, &camera.position, -speed);
 	if (s_pressed)
-		moveCamera(q, zAxis, &params.scene.camera_pos, -speed);
+		moveCamera(q, zAxis, &camera.position, -speed);
 	if (d_pressed)
-		moveCamera(q, xAxis, &params.scene.camera_pos, speed);
+		moveCamera(q, xAxis, &camera.position, speed);
 	
 	if (space_pressed)
-		moveCamera(yAxis, &params.scene.camera_pos, speed);
+		moveCamera(yAxis, &camera.position, speed);
 	if (ctrl_pressed)
-		moveCamera(yAxis, &params.scene.camera_pos, -speed);
+		moveCamera(yAxis, &camera.position, -speed);
+
+	profileTime(StageUpdate, start);
 }
 
 static void glfw_error_callback(int error, const char* desc)
@@ -299,231 +666,2187 @@ static void glfw_framebuffer_size_callback(GLFWwindow* wind, int width, int heig
     glViewport(0,0,width,height);
 }
 
-void processTimeStep(double frameRate);
-void renderFrame(void);
+void processTimeStep(double frameRate, int slot);
+void processCpuStep(double frameRate);
+void processHeadlessStep(double frameRate, std::vector<cl_float4> &pixels);
+void renderFrame(int slot);
 
-int main()
+inline unsigned divup(unsigned a, unsigned b)
 {
-	srand(time(nullptr));
+	return (a + b - 1) / b;
+}
 
-    if (!glfwInit())
-        return 255;
+static void deleteSync(GLsync &sync)
+{
+    if (sync) {
+        glDeleteSync(sync);
+        sync = 0;
+    }
+}
 
-          GLFWmonitor* monitor = glfwGetPrimaryMonitor();
-    const GLFWvidmode* mode    = glfwGetVideoMode(monitor);
+// Read-only device copy of a scene array, sized to its contents.
+// Zero-sized buffers are invalid, so an empty array still gets one element.
+template<typename T>
+Buffer createSceneBuffer(const Context &context, std::vector<T> &items)
+{
+    if (items.empty())
+        return Buffer(context, CL_MEM_READ_ONLY, sizeof(T));
+    return Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, items.size() * sizeof(T), items.data());
+}
 
-    glfwWindowHint(GLFW_RED_BITS    , mode->redBits    );
-    glfwWindowHint(GLFW_GREEN_BITS  , mode->greenBits  );
-    glfwWindowHint(GLFW_BLUE_BITS   , mode->blueBits   );
-    glfwWindowHint(GLFW_REFRESH_RATE, mode->refreshRate);
+// RT_KERNEL_CACHE overrides the binary cache directory, an empty value disables it
+static std::string kernelCacheDir()
+{
+    const char *dir = getenv("RT_KERNEL_CACHE");
+    return dir ? dir : KERNEL_CACHE_DIR;
+}
 
-    wind_width  = mode->width;
-    wind_height = mode->height;
-    //wind_width = 800;
-    //wind_height = 600;
+#define STRINGIFY(x) #x
+#define TO_STRING(x) STRINGIFY(x)
 
-    GLFWwindow* window;
+// Build options of the rt.cl variant specialised for the current scene
+static std::string kernelOptions()
+{
+    bool ambient = false, point = false, direct = false, specular = false;
+    for (auto &light : params.lights) {
+        ambient |= light.type == Ambient;
+        point |= light.type == Point;
+        direct |= light.type == Direct;
+    }
+    for (auto &sphere : params.spheres)
+        specular |= sphere.specular > 0;
+    for (auto &material : params.meshes.materials)
+        specular |= material.specular > 0;
+
+    std::ostringstream options;
+    options << "-I " << std::string(ASSETS_DIR);
+    // the limits of scene.h, so the kernel and the CPU backend trace alike
+    options << " -DMAX_RECURSION_DEPTH=" << MAX_RECURSION_DEPTH << " -DT_MIN=" << TO_STRING(T_MIN) << " -DBVH_STACK_SIZE=" << BVH_STACK_SIZE;
+    options << " -DWF_SHADOW_COUNTER=" << WF_SHADOW_COUNTER << " -DWF_COUNTERS=" << WF_COUNTERS << " -DWF_SHADOW_SLOTS=" << WF_SHADOW_SLOTS;
+    options << " -DSPECIALIZED -DREFLECT_DEPTH=" << params.scene.reflect_depth << " -DNUM_LIGHTS=" << params.scene.light_count;
+    if (ambient) options << " -DHAS_AMBIENT_LIGHT";
+    if (point) options << " -DHAS_POINT_LIGHT";
+    if (direct) options << " -DHAS_DIRECT_LIGHT";
+    if (specular) options << " -DHAS_SPECULAR";
+    if (params.scene.instance_count > 0) options << " -DHAS_MESHES";
+    if (!params.lightNodes.empty()) options << " -DLIGHT_SAMPLES=" << params.lightSamples;
+    else if (!params.lightGrid.cells.empty()) options << " -DLIGHT_GRID";
+    if (params.accumulate) options << " -DACCUMULATE";
+    if (params.persistent) options << " -DPERSISTENT -DTILE_SIZE=" << TILE_SIZE;
+    return options.str();
+}
 
-    glfwSetErrorCallback(glfw_error_callback);
+// Work-groups --persistent launches for kernel on device: as many tiles as a
+// compute unit can keep resident at once. The kernel's work-group size limit
+// reflects its register use, and a tile occupies whole SIMD batches of the
+// preferred multiple, so their ratio estimates the groups each unit holds.
+static unsigned persistentGroupCount(const Kernel &kernel, const Device &device)
+{
+    const ::size_t maxItems = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+    const ::size_t multiple = std::max< ::size_t>(1, kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device));
+    const ::size_t tileItems = (TILE_SIZE * TILE_SIZE + multiple - 1) / multiple * multiple;
+    ::size_t perUnit = std::max< ::size_t>(1, maxItems / tileItems);
+    // the tile index lives in local memory, which can bound residency as well
+    const cl_ulong localMem = kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device);
+    if (localMem > 0)
+        perUnit = std::min< ::size_t>(perUnit, std::max<cl_ulong>(1, device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / localMem));
+    return device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * (unsigned)perUnit;
+}
 
-    window = glfwCreateWindow(wind_width,wind_height,"RT", monitor,NULL);
-    if (!window) {
-        glfwTerminate();
-        return 254;
+// Switches params.k to the variant for the current scene. New configurations
+// are built on first use (from the binary cache when possible) and kept, so
+// switching back is just a lookup.
+void selectKernel()
+{
+    std::string options = kernelOptions();
+    if (options == params.kernelOptions) return;
+
+    auto it = params.kernels.find(options);
+    if (it == params.kernels.end()) {
+        std::vector<Device> devices(1, params.d);
+        if (params.multiDevice) {
+            devices.clear();
+            for (auto &share : params.shares)
+                devices.push_back(share.d);
+        }
+        buildProgram(params.context, devices, ASSETS_DIR "/rt.cl", options, kernelCacheDir(), params.p);
+        rt_kernels kernels;
+        kernels.program = params.p;
+        kernels.rt = Kernel(params.p, "rt");
+        kernels.wf.generate = Kernel(params.p, "wf_generate");
+        kernels.wf.extend = Kernel(params.p, "wf_extend");
+        kernels.wf.shade = Kernel(params.p, "wf_shade");
+        kernels.wf.shadow = Kernel(params.p, "wf_shadow");
+        kernels.wf.connect = Kernel(params.p, "wf_connect");
+        kernels.wf.output = Kernel(params.p, "wf_output");
+        it = params.kernels.insert(std::make_pair(options, kernels)).first;
+    }
+    params.k = it->second.rt;
+    params.wf = it->second.wf;
+    params.kernelOptions = options;
+
+    // the output image and camera are set per frame
+    params.k.setArg(0, params.sceneMem);
+    params.k.setArg(2, params.bvhMem);
+    params.k.setArg(3, params.sphereMem);
+    params.k.setArg(4, params.lightMem);
+    if (params.accumulate)
+        params.k.setArg(6, params.history);
+    if (params.persistent) {
+        params.k.setArg(params.accumulate ? 9 : 6, params.tileCounter);
+        params.persistentGroups = persistentGroupCount(params.k, params.d);
     }
-	
-    glfwMakeContextCurrent(window);
 
-    if(!gladLoadGL()) {
-        printf("gladLoadGL failed!\n");
-        return 253;
+    // kernel arguments are per kernel object, so each device gets its own
+    for (auto &share : params.shares) {
+        share.k = Kernel(it->second.program, "rt");
+        share.k.setArg(0, params.sceneMem);
+        share.k.setArg(1, share.image);
+        share.k.setArg(2, params.bvhMem);
+        share.k.setArg(3, params.sphereMem);
+        share.k.setArg(4, params.lightMem);
+        if (params.accumulate)
+            share.k.setArg(6, share.history);
     }
-    printf("OpenGL %d.%d\n", GLVersion.major, GLVersion.minor);
 
-    cl_int errCode;
-    try {
-        Platform lPlatform = getPlatform();
-        // Select the default platform and create a context using this platform and the GPU
-#ifdef OS_LNX
-        cl_context_properties cps[] = {
-            CL_GL_CONTEXT_KHR, (cl_context_properties)glfwGetGLXContext(window),
-            CL_GLX_DISPLAY_KHR, (cl_context_properties)glfwGetX11Display(),
-            CL_CONTEXT_PLATFORM, (cl_context_properties)lPlatform(),
-            0
-        };
-#endif
-#ifdef OS_WIN
-        cl_context_properties cps[] = {
-            CL_GL_CONTEXT_KHR, (cl_context_properties)glfwGetWGLContext(window),
-            CL_WGL_HDC_KHR, (cl_context_properties)GetDC(glfwGetWin32Window(window)),
-            CL_CONTEXT_PLATFORM, (cl_context_properties)lPlatform(),
-            0
-        };
-#endif
-        std::vector<Device> devices;
-        lPlatform.getDevices(CL_DEVICE_TYPE_GPU, &devices);
-        // Get a list of devices on this platform
-        for (unsigned d=0; d<devices.size(); ++d) {
-            if (checkExtnAvailability(devices[d],CL_GL_SHARING_EXT)) {
-                params.d = devices[d];
-                break;
-            }
-        }
-        Context context(params.d, cps);
-        // Create a command queue and use the first device
-        params.q = CommandQueue(context, params.d);
-        params.p = getProgram(context, ASSETS_DIR "/rt.cl",errCode);
+    if (!params.wavefront) return;
+    // every pass starts with the scene arguments, the queues follow; the ray
+    // queue, bounce, light range, camera and output are set per launch
+    Kernel *passes[] = { &params.wf.generate, &params.wf.extend, &params.wf.shade, &params.wf.shadow, &params.wf.connect, &params.wf.output };
+    for (Kernel *pass : passes) {
+        pass->setArg(0, params.sceneMem);
+        pass->setArg(1, params.bvhMem);
+        pass->setArg(2, params.sphereMem);
+        pass->setArg(3, params.lightMem);
+    }
+    params.wf.generate.setArg(4, params.rayQueues[0]);
+    params.wf.generate.setArg(5, params.accum);
+    params.wf.generate.setArg(6, params.counters);
+    params.wf.extend.setArg(5, params.counters);
+    params.wf.shade.setArg(6, params.shadowQueue);
+    params.wf.shade.setArg(7, params.accum);
+    params.wf.shade.setArg(8, params.counters);
+    params.wf.shadow.setArg(5, params.shadowQueue);
+    params.wf.shadow.setArg(6, params.accum);
+    params.wf.shadow.setArg(7, params.counters);
+    params.wf.connect.setArg(5, params.shadowQueue);
+    params.wf.connect.setArg(6, params.counters);
+    params.wf.output.setArg(4, params.accum);
+    if (params.accumulate)
+        params.wf.output.setArg(6, params.history);
+}
 
-        std::ostringstream options;
-        options << "-I " << std::string(ASSETS_DIR);
+static bool sphereLess(const rt_sphere &a, const rt_sphere &b)
+{
+    return memcmp(&a, &b, sizeof(rt_sphere)) < 0;
+}
 
-        params.p.build(std::vector<Device>(1, params.d), options.str().c_str());
-        params.k = Kernel(params.p, "rt");
-        // create opengl stuff
-        rparams.prg = initShaders(ASSETS_DIR "/rt.vert", ASSETS_DIR "/rt.frag");
-        rparams.tex = createTexture2D(wind_width,wind_height);
-        GLuint vbo  = createBuffer(12,vertices,GL_STATIC_DRAW);
-        GLuint tbo  = createBuffer(8,texcords,GL_STATIC_DRAW);
-        GLuint ibo;
-        glGenBuffers(1,&ibo);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER,sizeof(uint)*6,indices,GL_STATIC_DRAW);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
-        // bind vao
-        glGenVertexArrays(1,&rparams.vao);
-        glBindVertexArray(rparams.vao);
-        // attach vbo
-        glBindBuffer(GL_ARRAY_BUFFER,vbo);
-        glVertexAttribPointer(0,3,GL_FLOAT,GL_FALSE,0,NULL);
-        glEnableVertexAttribArray(0);
-        // attach tbo
-        glBindBuffer(GL_ARRAY_BUFFER,tbo);
-        glVertexAttribPointer(1,2,GL_FLOAT,GL_FALSE,0,NULL);
-        glEnableVertexAttribArray(1);
-        // attach ibo
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,ibo);
-        glBindVertexArray(0);
-        // create opengl texture reference using opengl texture
-        params.tex = ImageGL(context,CL_MEM_READ_WRITE,GL_TEXTURE_2D,0,rparams.tex,&errCode);
-        if (errCode!=CL_SUCCESS) {
-            std::cout<<"Failed to create OpenGL texture refrence: "<<errCode<<std::endl;
-            return 250;
-        }
+// Fills params.sphereSlot from the spheres before the BVH build. The build only
+// permutes them, so sorting both sides pairs every sphere with its new slot;
+// identical spheres are interchangeable.
+static void matchSphereSlots(const std::vector<rt_sphere> &loaded)
+{
+    const int count = (int)loaded.size();
+    std::vector<int> before(count), after(count);
+    for (int i = 0; i < count; ++i)
+        before[i] = after[i] = i;
+    std::sort(before.begin(), before.end(), [&](int a, int b) { return sphereLess(loaded[a], loaded[b]); });
+    std::sort(after.begin(), after.end(), [&](int a, int b) { return sphereLess(params.spheres[a], params.spheres[b]); });
+    params.sphereSlot.resize(count);
+    for (int i = 0; i < count; ++i)
+        params.sphereSlot[before[i]] = after[i];
+}
 
+// Drops the mapping of the previous binary scene once no command can read it
+static void releaseSceneMap()
+{
+    if (!params.sceneMap.base)
+        return;
+    if (params.q())
+        params.q.finish();
+    for (auto &share : params.shares)
+        share.q.finish();
+    unmap_scene(params.sceneMap);
+}
 
-        params.scene = create_scene(wind_width, wind_height);
-		
-		params.sceneMem = Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(rt_scene), &params.scene, &errCode);
-		if (errCode != CL_SUCCESS) {
-			std::cout << "Failed to create scene buffer: " << errCode << std::endl;
-			return 250;
-		}
+// Takes the scene of a mapped .rtsc file. The BVH comes with it and the spheres
+// are stored in leaf order, so the slots are the identity.
+static void useSceneMap(const mapped_scene &mapped, int width, int height)
+{
+    releaseSceneMap();
+    params.sceneMap = mapped;
+    params.scene = mapped.scene;
+    setCanvas(params.scene, width, height);
+    params.spheres.resize(mapped.scene.sphere_count);
+    unpack_spheres(mapped.spheres, mapped.scene.sphere_count, params.spheres.data());
+    params.lights.assign(mapped.lights, mapped.lights + mapped.scene.light_count);
+    // the object trees and the instance tree follow the sphere tree
+    params.bvh.assign(mapped.nodes, mapped.nodes + mapped.scene.mesh_node_offset);
+    unpack_meshes(mapped.spheres, mapped.scene, params.meshes);
+    rt_bvh_node *instanceNodes = mapped.nodes + mapped.scene.instance_node_offset;
+    params.meshes.nodes.assign(mapped.nodes + mapped.scene.mesh_node_offset, instanceNodes);
+    params.meshes.instanceNodes.assign(instanceNodes, instanceNodes + mapped.instance_node_count);
+    params.sphereSlot.resize(mapped.scene.sphere_count);
+    for (int i = 0; i < mapped.scene.sphere_count; ++i)
+        params.sphereSlot[i] = i;
+}
 
-        // set kernel arguments
-        params.k.setArg(0, params.sceneMem);
-        params.k.setArg(1, params.tex);
+// Records the mesh layout in params.scene. load_scene builds the object trees
+// and the instance tree; in the node buffer the object trees go after the
+// sphere tree and the instance tree last.
+static void setMeshLayout()
+{
+    const triangle_meshes &meshes = params.meshes;
+    params.scene.instance_count = (cl_int)meshes.instances.size();
+    params.scene.vertex_count = (cl_int)meshes.vertices.size();
+    params.scene.triangle_count = (cl_int)meshes.triangles.size();
+    params.scene.mesh_node_offset = (cl_int)params.bvh.size();
+    params.scene.instance_node_offset = params.scene.mesh_node_offset + (cl_int)meshes.nodes.size();
+}
 
-    } catch(Error error) {
-        std::cout << error.what() << "(" << error.err() << ")" << std::endl;
-        std::string val = params.p.getBuildInfo<CL_PROGRAM_BUILD_LOG>(params.d);
-        std::cout<<"Log:\n"<<val<<std::endl;
-        return 249;
+// Loads the scene and builds its BVHs on the host, shared by both backends.
+// Without a scene file the scene comes from factory, create_scene by default.
+bool initScene(int width, int height, const char *sceneFile, scene_factory factory = create_scene)
+{
+    if (sceneFile && is_binary_scene(sceneFile)) {
+        mapped_scene mapped;
+        if (!map_scene(sceneFile, mapped))
+            return false;
+        useSceneMap(mapped, width, height);
+    } else {
+        if (sceneFile) {
+            // defaults for whatever the file leaves out
+            memset(&params.scene, 0, sizeof(rt_scene));
+            params.scene.reflect_depth = 3;
+            if (!load_scene(sceneFile, params.scene, params.spheres, params.lights, params.meshes))
+                return false;
+            setCanvas(params.scene, width, height);
+        } else {
+            params.scene = factory(width, height, params.spheres, params.lights);
+            params.meshes = triangle_meshes();
+        }
+        // reorders the spheres to match the leaves, so build before the upload
+        std::vector<rt_sphere> loaded = params.spheres;
+        params.bvh = build_bvh(params.spheres.data(), params.scene.sphere_count);
+        matchSphereSlots(loaded);
+        setMeshLayout();
+        releaseSceneMap();
     }
 
-	glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
-	glfwSetCursorPosCallback(window, glfw_mouse_callback);
-    glfwSetKeyCallback(window,glfw_key_callback);
-    glfwSetFramebufferSizeCallback(window,glfw_framebuffer_size_callback);
-
-    const auto start = std::chrono::steady_clock::now();
-    int frames_count = 0;
-    
+    memset(&params.camera, 0, sizeof(rt_camera));
+    params.camera.rotation.w = 1;
+    params.sample = -1;
+    if (params.cpu && params.accumulate)
+        params.cpuHistory.assign(width * height, cl_float4());
+
+    params.sceneDirty = false;
+    params.instancesDirty = false;
+    clear_range(params.sphereDirty);
+    clear_range(params.lightDirty);
+    return true;
+}
 
-	glfwSwapInterval(0);
+// Device buffer over count mapped records. The runtime uses the pages in place
+// (zero-copy on devices sharing host memory) instead of a staging copy.
+template<typename T>
+Buffer mapSceneBuffer(const Context &context, T *items, int count)
+{
+    if (count <= 0)
+        return Buffer(context, CL_MEM_READ_ONLY, sizeof(T));
+    return Buffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, count * sizeof(T), items);
+}
 
-	auto currentTime = std::chrono::steady_clock::now();
+// Whether lightMem holds more than the lights
+static bool hasLightIndex()
+{
+    return !params.lightGrid.cells.empty() || !params.lightNodes.empty();
+}
 
-    while (!glfwWindowShouldClose(window)) 
-	{
-        ++frames_count;
+// Lays out the light tree after the lights in params.lightData
+static void packLightTree()
+{
+    const ::size_t lightBytes = params.lights.size() * sizeof(rt_light);
+    const ::size_t nodeBytes = params.lightNodes.size() * sizeof(rt_light_node);
+    params.lightData.resize(lightBytes + nodeBytes + params.globalLights.size() * sizeof(cl_int));
+    unsigned char *data = params.lightData.data();
+    memcpy(data, params.lights.data(), lightBytes);
+    memcpy(data + lightBytes, params.lightNodes.data(), nodeBytes);
+    memcpy(data + lightBytes + nodeBytes, params.globalLights.data(), params.globalLights.size() * sizeof(cl_int));
+}
 
-		auto newTime = std::chrono::steady_clock::now();
-		std::chrono::duration<double> frameTime = (newTime - currentTime);
-		currentTime = newTime;
+// Rebuilds the light tree (--light-samples) or else the light grid, and
+// params.lightData from the lights; their placement lands in params.scene.
+// Returns whether the size changed.
+static bool packLights()
+{
+    const ::size_t oldSize = params.lightData.size();
+    params.lightNodes.clear();
+    params.globalLights.clear();
+    if (params.lightSamples > 0)
+        build_light_tree(params.lights, params.lightNodes, params.globalLights);
+    params.scene.light_node_count = (cl_int)params.lightNodes.size();
+    params.scene.light_global_count = (cl_int)params.globalLights.size();
+    if (!params.lightNodes.empty()) {
+        params.lightGrid.cells.clear();
+        params.lightGrid.indices.clear();
+        params.scene.light_grid_dims.s[3] = 0;
+        packLightTree();
+        return params.lightData.size() != oldSize;
+    }
+    build_light_grid(params.lights, params.scene, params.lightGrid);
+
+    const light_grid &grid = params.lightGrid;
+    const ::size_t lightBytes = params.lights.size() * sizeof(rt_light);
+    const ::size_t cellBytes = grid.cells.size() * sizeof(cl_int2);
+    params.lightData.resize(lightBytes + cellBytes + grid.indices.size() * sizeof(cl_int));
+    if (params.lightData.empty())
+        return oldSize != 0;
+    unsigned char *data = params.lightData.data();
+    memcpy(data, params.lights.data(), lightBytes);
+    memcpy(data + lightBytes, grid.cells.data(), cellBytes);
+    memcpy(data + lightBytes + cellBytes, grid.indices.data(), grid.indices.size() * sizeof(cl_int));
+    return params.lightData.size() != oldSize;
+}
 
-        // process call
-        processTimeStep(frameTime.count());
-        // render call
-        renderFrame();
-        // swap front and back buffers
-        glfwSwapBuffers(window);
-        // poll for events
-        glfwPollEvents();
+// Device copies of the host scene arrays, sized to their contents. A binary
+// scene is uploaded from its mapping; the host arrays mirror it for edits.
+static void createSceneBuffers(const Context &context)
+{
+    const int sphereCount = params.scene.sphere_count;
+    params.sphereStreams.resize(geometry_float4s(params.scene));
+    pack_spheres(params.spheres.data(), sphereCount, 0, sphereCount, params.sphereStreams.data());
+    pack_meshes(params.meshes, sphereCount, params.sphereStreams.data());
+    packLights();
+
+    params.sceneMem = Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(rt_scene), &params.scene);
+    if (params.sceneMap.base) {
+        params.sphereMem = mapSceneBuffer(context, params.sceneMap.spheres, (int)geometry_float4s(params.scene));
+        // the light grid and tree are built at load time and do not live in the file
+        if (!hasLightIndex())
+            params.lightMem = mapSceneBuffer(context, params.sceneMap.lights, params.sceneMap.scene.light_count);
+        else
+            params.lightMem = createSceneBuffer(context, params.lightData);
+        params.bvhMem = mapSceneBuffer(context, params.sceneMap.nodes, params.sceneMap.node_count);
+        return;
     }
+    params.sphereMem = createSceneBuffer(context, params.sphereStreams);
+    params.lightMem = createSceneBuffer(context, params.lightData);
+    // refits only rewrite the sphere tree at the start, moved instances the
+    // instance tree at the end, within its reserve
+    const triangle_meshes &meshes = params.meshes;
+    std::vector<rt_bvh_node> nodes = params.bvh;
+    nodes.insert(nodes.end(), meshes.nodes.begin(), meshes.nodes.end());
+    nodes.insert(nodes.end(), meshes.instanceNodes.begin(), meshes.instanceNodes.end());
+    nodes.resize(params.scene.instance_node_offset + instance_node_capacity(params.scene.instance_count));
+    params.bvhMem = createSceneBuffer(context, nodes);
+}
 
-    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now( ) - start );
-    auto seconds = elapsed.count() / 1000.0;
-    std::cout << "Total elapsed (sec): " << seconds << std::endl;
-    std::cout << "Total frames: " << frames_count << std::endl;
+// Length of the longest light list a hit can get in wf_shadow: a cell of the
+// light grid, or else all the lights
+static int pathLightCount()
+{
+    if (params.lightGrid.cells.empty())
+        return params.scene.light_count;
+    int most = 0;
+    for (auto &cell : params.lightGrid.cells)
+        most = std::max(most, (int)cell.s[1]);
+    return most;
+}
 
-    double fps = frames_count / seconds;
+// Shadow rays a wf_shadow pass can append for pixels paths with the current
+// lights. Passes after the first one take turns with the previous pass on two
+// such stretches of the queue.
+static ::size_t shadowPassLength(::size_t pixels)
+{
+    return pixels * std::max(1, std::min(WF_SHADOW_SLOTS, pathLightCount()));
+}
 
-    std::cout << "FPS: " << fps << std::endl;
+static ::size_t shadowQueueLength(::size_t pixels)
+{
+    return shadowPassLength(pixels) * (pathLightCount() > WF_SHADOW_SLOTS ? 2 : 1);
+}
 
-    glfwDestroyWindow(window);
+// Device memory sized to the output: wavefront queues, accumulation history
+// and the per-device images of --multi-device
+static void allocateFrameBuffers(const Context &context, int width, int height)
+{
+    const ::size_t pixels = width * height;
+    if (params.wavefront) {
+        // one path per pixel, so no queue outgrows the frame
+        for (int i = 0; i < 2; ++i)
+            params.rayQueues[i] = Buffer(context, CL_MEM_READ_WRITE, pixels * sizeof(wf_ray));
+        params.shadowQueue = Buffer(context, CL_MEM_READ_WRITE, shadowQueueLength(pixels) * sizeof(wf_shadow_ray));
+        params.accum = Buffer(context, CL_MEM_READ_WRITE, pixels * sizeof(cl_float4));
+        params.counters = Buffer(context, CL_MEM_READ_WRITE, WF_COUNTERS * sizeof(cl_uint));
+    }
+    if (params.accumulate)
+        params.history = Buffer(context, CL_MEM_READ_WRITE, pixels * sizeof(cl_float4));
+    for (auto &share : params.shares) {
+        share.image = Image2D(context, CL_MEM_WRITE_ONLY, ImageFormat(CL_RGBA, CL_FLOAT), width, height);
+        if (params.accumulate)
+            share.history = Buffer(context, CL_MEM_READ_WRITE, pixels * sizeof(cl_float4));
+    }
+}
 
-    glfwTerminate();
+// Builds rt.cl for params.d and uploads the initial scene, shared by the interop and headless paths
+bool initKernel(const Context &context, int width, int height, const char *sceneFile = NULL, scene_factory factory = create_scene)
+{
+    params.context = context;
+    // Create a command queue and use the selected device
+    params.q = CommandQueue(context, params.d, params.profiler || params.scaler ? CL_QUEUE_PROFILING_ENABLE : 0);
+    params.kernels.clear();
+    params.kernelOptions.clear();
+
+    if (!initScene(width, height, sceneFile, factory))
+        return false;
+
+    createSceneBuffers(context);
+    allocateFrameBuffers(context, width, height);
+    if (params.persistent)
+        params.tileCounter = Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
+
+    selectKernel();
+    return true;
+}
 
+// Non-blocking uploads read straight from the host arrays, so they have to
+// land before the arrays are edited again
+void waitForUploads()
+{
+    if (params.uploaded() != NULL) {
+        params.uploaded.wait();
+        params.uploaded = Event();
+    }
+}
 
-    std::cin.get();
+// Scene edits go through these so the next frame uploads only what changed.
+// Sphere indices follow the BVH order of params.spheres.
+void setSphere(int index, const rt_sphere &sphere)
+{
+    waitForUploads();
+    params.spheres[index] = sphere;
+    mark_dirty(params.sphereDirty, index);
+}
+
+void setLight(int index, const rt_light &light)
+{
+    waitForUploads();
+    params.lights[index] = light;
+    mark_dirty(params.lightDirty, index);
+}
+
+// Instance indices follow the scene file (their material), not the tree order
+void setInstance(int index, const cl_float4 worldToObject[3])
+{
+    waitForUploads();
+    for (auto &instance : params.meshes.instances) {
+        if (instance.material != index) continue;
+        for (int i = 0; i < 3; i++)
+            instance.world_to_object[i] = worldToObject[i];
+    }
+    params.instancesDirty = true;
+}
+
+template<typename T>
+void uploadRange(const Buffer &buffer, const std::vector<T> &items, dirty_range &range)
+{
+    if (!is_dirty(range)) return;
+    params.q.enqueueWriteBuffer(buffer, CL_FALSE, range.begin * sizeof(T), (range.end - range.begin) * sizeof(T), items.data() + range.begin, NULL, &params.uploaded);
+    profileEvent(StageUpload, params.uploaded);
+    clear_range(range);
+}
+
+// Repacks the edited spheres and writes their slices of both device streams
+void uploadSpheres(dirty_range &range)
+{
+    const ::size_t count = params.scene.sphere_count;
+    const ::size_t materialFloat4s = SPHERE_STREAM_FLOAT4S - 1;
+    pack_spheres(params.spheres.data(), (int)count, (int)range.begin, (int)range.end, params.sphereStreams.data());
+    dirty_range materials = { count + range.begin * materialFloat4s, count + range.end * materialFloat4s };
+    uploadRange(params.sphereMem, params.sphereStreams, range);
+    uploadRange(params.sphereMem, params.sphereStreams, materials);
+}
+
+// Writes the edited lights. With a light grid or tree (before or after the
+// edit) it and its placement in the scene are rebuilt and written whole; one
+// of another size gets a new buffer, and the kernels are rebound to it.
+void uploadLights(dirty_range &range)
+{
+    const bool hadIndex = hasLightIndex();
+    if (packLights()) {
+        params.lightMem = createSceneBuffer(params.context, params.lightData);
+        params.kernelOptions.clear();
+        params.sceneDirty = true;
+        clear_range(range);
+        return;
+    }
+    if (hadIndex || hasLightIndex()) {
+        params.sceneDirty = true;
+        range.begin = 0;
+        range.end = params.lights.size();
+    }
+    // byte range of lightData, the grid or tree follows the lights
+    dirty_range bytes = { range.begin * sizeof(rt_light), range.end * sizeof(rt_light) };
+    if (hasLightIndex())
+        bytes.end = params.lightData.size();
+    uploadRange(params.lightMem, params.lightData, bytes);
+    clear_range(range);
+}
+
+// Rebuilds the instance tree after instances moved and writes it with the
+// instances in their new order. Only the top level changes, the object trees
+// and triangles stay as they were uploaded.
+void uploadInstances()
+{
+    triangle_meshes &meshes = params.meshes;
+    build_instance_tree(meshes);
+    const ::size_t count = meshes.instances.size();
+    const ::size_t first = geometry_float4s(params.scene) - count * INSTANCE_FLOAT4S;
+    memcpy(params.sphereStreams.data() + first, meshes.instances.data(), count * sizeof(rt_instance));
+    dirty_range instances = { first, first + count * INSTANCE_FLOAT4S };
+    uploadRange(params.sphereMem, params.sphereStreams, instances);
+    params.q.enqueueWriteBuffer(params.bvhMem, CL_FALSE, params.scene.instance_node_offset * sizeof(rt_bvh_node),
+        meshes.instanceNodes.size() * sizeof(rt_bvh_node), meshes.instanceNodes.data(), NULL, &params.uploaded);
+    profileEvent(StageUpload, params.uploaded);
+    params.instancesDirty = false;
+}
+
+// Enqueues non-blocking writes for the regions edited since the last frame,
+// params.uploaded tracks the last of them (the queue is in order)
+void uploadSceneChanges()
+{
+    const bool lightsEdited = is_dirty(params.lightDirty);
+    if (lightsEdited)
+        uploadLights(params.lightDirty);
+
+    // depth, light setup or materials may call for another kernel variant,
+    // and the accumulated image is stale
+    if (params.sceneDirty || is_dirty(params.sphereDirty) || lightsEdited) {
+        selectKernel();
+        params.sample = -1;
+    }
+    if (params.instancesDirty) {
+        uploadInstances();
+        params.sample = -1;
+    }
+
+    if (params.sceneDirty) {
+        params.q.enqueueWriteBuffer(params.sceneMem, CL_FALSE, 0, sizeof(rt_scene), &params.scene, NULL, &params.uploaded);
+        profileEvent(StageUpload, params.uploaded);
+        params.sceneDirty = false;
+    }
+    if (is_dirty(params.sphereDirty)) {
+        // moved spheres change the bounds of their ancestors
+        dirty_range nodes = refit_bvh(params.bvh, params.spheres.data());
+        uploadRange(params.bvhMem, params.bvh, nodes);
+        uploadSpheres(params.sphereDirty);
+    }
+}
+
+static bool sameCamera(const rt_camera &a, const rt_camera &b)
+{
+    return a.position.s[0] == b.position.s[0] && a.position.s[1] == b.position.s[1] && a.position.s[2] == b.position.s[2] &&
+        a.rotation.w == b.rotation.w && a.rotation.v.s[0] == b.rotation.v.s[0] &&
+        a.rotation.v.s[1] == b.rotation.v.s[1] && a.rotation.v.s[2] == b.rotation.v.s[2];
+}
+
+// Sample count of the frame about to be traced with --accumulate, 0 restarts the mean
+static int nextSample()
+{
+    if (params.sample < 0 || !sameCamera(params.camera, params.sampleCamera))
+        params.sample = 0;
+    else if (params.sample < ACCUMULATE_MAX_SAMPLES)
+        params.sample++;
+    params.sampleCamera = params.camera;
+    return params.sample;
+}
+
+// R2 low-discrepancy offset inside the pixel, sample 0 is the unjittered ray
+static void sampleJitter(int sample, cl_float jitter[2])
+{
+    const double a1 = 0.7548776662466927, a2 = 0.5698402909980532;
+    jitter[0] = (cl_float)(fmod(0.5 + sample * a1, 1.0) - 0.5);
+    jitter[1] = (cl_float)(fmod(0.5 + sample * a2, 1.0) - 0.5);
+}
+
+static void enqueuePass(Kernel &kernel, unsigned items)
+{
+    Event ev;
+    NDRange local(WF_GROUP_SIZE);
+    NDRange global(WF_GROUP_SIZE * divup(items, WF_GROUP_SIZE));
+    params.q.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, NULL, traceEvent(ev));
+    recordTrace(ev);
+}
+
+// Queue lengths live on the device, so every pass is launched for the whole
+// frame and the items past the live count return at once
+static void enqueueWavefront(const Image &output)
+{
+    const unsigned pixels = (unsigned)params.scene.canvas_width * (unsigned)params.scene.canvas_height;
+    wavefront_kernels &wf = params.wf;
+
+    // light edits can lengthen the light lists past what the queue was sized for
+    const unsigned shadows = (unsigned)shadowPassLength(pixels);
+    if (params.shadowQueue.getInfo<CL_MEM_SIZE>() < shadowQueueLength(pixels) * sizeof(wf_shadow_ray)) {
+        params.shadowQueue = Buffer(params.context, CL_MEM_READ_WRITE, shadowQueueLength(pixels) * sizeof(wf_shadow_ray));
+        wf.shade.setArg(6, params.shadowQueue);
+        wf.shadow.setArg(5, params.shadowQueue);
+        wf.connect.setArg(5, params.shadowQueue);
+    }
+    const int shadowPasses = (int)divup(pathLightCount(), WF_SHADOW_SLOTS);
+
+    params.q.enqueueFillBuffer(params.counters, (cl_uint)0, 0, WF_COUNTERS * sizeof(cl_uint));
+    wf.generate.setArg(7, cameraFrame(params.scene, params.camera));
+    if (params.accumulate) {
+        cl_float2 jitter;
+        sampleJitter(params.sample, jitter.s);
+        wf.generate.setArg(8, jitter);
+        wf.output.setArg(7, params.sample);
+    }
+    enqueuePass(wf.generate, pixels);
+
+    const int depth = std::min((int)params.scene.reflect_depth, MAX_RECURSION_DEPTH);
+    for (int bounce = 0; bounce < depth; ++bounce) {
+        const Buffer &rays = params.rayQueues[bounce % 2];
+        wf.extend.setArg(4, rays);
+        wf.extend.setArg(6, bounce);
+        enqueuePass(wf.extend, pixels);
+
+        // one pass unless a hit sees more than WF_SHADOW_SLOTS lights
+        wf.shadow.setArg(4, rays);
+        wf.shadow.setArg(8, bounce);
+        wf.connect.setArg(4, rays);
+        for (int pass = 0; pass < shadowPasses; ++pass) {
+            // the queue length counts from the start of the pass's half
+            const cl_uint first = (pass % 2) * shadows;
+            params.q.enqueueFillBuffer(params.counters, first, WF_SHADOW_COUNTER * sizeof(cl_uint), sizeof(cl_uint));
+            wf.shadow.setArg(9, pass * WF_SHADOW_SLOTS);
+            wf.connect.setArg(7, first);
+            enqueuePass(wf.shadow, pixels);
+            enqueuePass(wf.connect, shadows);
+        }
+
+        wf.shade.setArg(4, rays);
+        wf.shade.setArg(5, params.rayQueues[(bounce + 1) % 2]);
+        wf.shade.setArg(9, bounce);
+        enqueuePass(wf.shade, pixels);
+    }
+
+    wf.output.setArg(5, output);
+    enqueuePass(wf.output, pixels);
+}
+
+// Enqueues the trace of params.camera into output with the rt megakernel or the wavefront passes
+void enqueueTrace(const Image &output)
+{
+    params.traceEvents.clear();
+    if (params.accumulate)
+        nextSample();
+    if (params.wavefront) {
+        enqueueWavefront(output);
+        return;
+    }
+
+    const unsigned width = (unsigned)params.scene.canvas_width;
+    const unsigned height = (unsigned)params.scene.canvas_height;
+    NDRange local(16,16);
+    NDRange global(local[0] * divup(width, local[0]),local[1] * divup(height, local[1]));
+    if (params.persistent) {
+        // no more groups than tiles, the rest would only find the counter exhausted
+        const unsigned groups = std::min(params.persistentGroups, divup(width, TILE_SIZE) * divup(height, TILE_SIZE));
+        local = NDRange(TILE_SIZE, TILE_SIZE);
+        global = NDRange(TILE_SIZE * groups, TILE_SIZE);
+        params.q.enqueueFillBuffer(params.tileCounter, (cl_uint)0, 0, sizeof(cl_uint));
+    }
+    params.k.setArg(1, output);
+    params.k.setArg(5, cameraFrame(params.scene, params.camera));
+    if (params.accumulate) {
+        cl_float2 jitter;
+        sampleJitter(params.sample, jitter.s);
+        params.k.setArg(7, jitter);
+        params.k.setArg(8, params.sample);
+    }
+
+    Event kernelEv;
+    params.q.enqueueNDRangeKernel(params.k, cl::NullRange, global, local, NULL, &kernelEv);
+    recordTrace(kernelEv);
+}
+
+// Device time of the trace commands, first start to last end
+static double traceMs(const std::vector<Event> &events)
+{
+    cl_ulong start = 0, end = 0;
+    for (auto &ev : events) {
+        cl_ulong s = ev.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+        cl_ulong e = ev.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+        if (start == 0 || s < start) start = s;
+        if (e > end) end = e;
+    }
+    return end > start ? (end - start) * 1e-6 : 0;
+}
+
+// --target-ms: feeds a finished trace to the scaler and resizes the canvas for
+// the next one. The canvas is part of the scene, so the upload restarts accumulation
+static void adaptResolution(double ms, int pixels)
+{
+    if (!params.scaler || !params.scaler->update(ms, pixels))
+        return;
+    setCanvas(params.scene, params.scaler->width(), params.scaler->height());
+    params.sceneDirty = true;
+}
+
+// CPU backend counterpart of uploadSceneChanges: the tracer reads the host
+// arrays, so edits only need the BVH refit
+void traceOnCpu(cl_float4 *pixels)
+{
+    if (is_dirty(params.sphereDirty))
+        refit_bvh(params.bvh, params.spheres.data());
+    if (params.instancesDirty)
+        build_instance_tree(params.meshes);
+    if (params.sceneDirty || params.instancesDirty || is_dirty(params.sphereDirty) || is_dirty(params.lightDirty))
+        params.sample = -1;
+    params.sceneDirty = false;
+    params.instancesDirty = false;
+    clear_range(params.sphereDirty);
+    clear_range(params.lightDirty);
+
+    const rt_camera_frame camera = cameraFrame(params.scene, params.camera);
+    const triangle_meshes &meshes = params.meshes;
+    cpu_frame frame = { &params.scene, &camera, params.bvh.data(), params.spheres.data(), params.lights.data(),
+        meshes.nodes.data(), meshes.instanceNodes.data(), meshes.vertices.data(), meshes.triangles.data(),
+        meshes.instances.data(), meshes.materials.data(), pixels };
+    if (params.accumulate) {
+        frame.sample = nextSample();
+        sampleJitter(frame.sample, frame.jitter);
+        frame.history = params.cpuHistory.data();
+    }
+    const time_point start = std::chrono::steady_clock::now();
+    params.cpu->render(frame);
+    profileTime(StageKernel, start);
+}
+
+// Splits the canvas rows in proportion to the measured speed of each device, in
+// multiples of the 16 row work-groups. Every device keeps at least one group of
+// rows so it stays measured; until all are measured the split is even.
+static void balanceShares()
+{
+    const int height = (int)params.scene.canvas_height;
+    const int count = (int)params.shares.size();
+    double total = 0;
+    bool measured = true;
+    for (auto &share : params.shares) {
+        measured &= share.msPerRow > 0;
+        total += share.msPerRow > 0 ? 1 / share.msPerRow : 0;
+    }
+
+    int y = 0;
+    for (int i = 0; i < count; ++i) {
+        device_share &share = params.shares[i];
+        const double part = measured ? 1 / share.msPerRow / total : 1.0 / count;
+        const int reserved = 16 * (count - 1 - i);
+        int rows = (int)(height * part / 16 + 0.5) * 16;
+        rows = std::min(std::max(16, rows), height - y - reserved);
+        rows = std::max(0, std::min(rows, height - y));
+        if (i == count - 1)
+            rows = height - y;
+        share.y0 = y;
+        share.rows = rows;
+        y += rows;
+    }
+}
+
+// --multi-device: each device traces its rows into its own image and the rows
+// are read straight into pixels, which holds the whole frame on return
+void traceMultiDevice(cl_float4 *pixels)
+{
+    const time_point start = std::chrono::steady_clock::now();
+    uploadSceneChanges();
+    if (params.accumulate)
+        nextSample();
+    // moved rows would blend into another device's history, so the split
+    // only changes when the accumulation restarts anyway
+    if (!params.accumulate || params.sample == 0)
+        balanceShares();
+
+    // the scene is written through params.q, the other queues wait for it
+    std::vector<Event> waitList;
+    if (params.uploaded() != NULL)
+        waitList.push_back(params.uploaded);
+    cl_float2 jitter;
+    if (params.accumulate)
+        sampleJitter(params.sample, jitter.s);
+
+    const rt_camera_frame camera = cameraFrame(params.scene, params.camera);
+    const unsigned width = (unsigned)params.scene.canvas_width;
+    for (auto &share : params.shares) {
+        if (share.rows <= 0) continue;
+        share.k.setArg(5, camera);
+        if (params.accumulate) {
+            share.k.setArg(7, jitter);
+            share.k.setArg(8, params.sample);
+        }
+        NDRange local(16,16);
+        NDRange global(local[0] * divup(width, local[0]), local[1] * divup(share.rows, local[1]));
+        share.q.enqueueNDRangeKernel(share.k, NDRange(0, share.y0), global, local, waitList.empty() ? NULL : &waitList, &share.traced);
+
+        cl::size_t<3> origin;
+        cl::size_t<3> region;
+        origin[1] = share.y0;
+        region[0] = width;
+        region[1] = share.rows;
+        region[2] = 1;
+        share.q.enqueueReadImage(share.image, CL_FALSE, origin, region, 0, 0, pixels + share.y0 * width, NULL, &share.read);
+        share.q.flush();
+    }
+
+    for (auto &share : params.shares) {
+        if (share.rows <= 0) continue;
+        share.read.wait();
+        cl_ulong begin = share.traced.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+        cl_ulong end = share.traced.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+        const double msPerRow = (end - begin) * 1e-6 / share.rows;
+        share.msPerRow = share.msPerRow > 0 ? share.msPerRow + 0.25 * (msPerRow - share.msPerRow) : msPerRow;
+    }
+    profileTime(StageKernel, start);
+}
+
+// The backends that produce the frame in host memory instead of a CL image
+static bool tracesToHost()
+{
+    return params.cpu || params.multiDevice;
+}
+
+static void traceToHost(cl_float4 *pixels)
+{
+    if (params.cpu)
+        traceOnCpu(pixels);
+    else
+        traceMultiDevice(pixels);
+}
+
+// One context over every device of the platform, each with its own queue,
+// output image and history (allocated by initKernel); the scene buffers are shared
+static int initMultiDevice(const char *sceneFile, scene_factory factory)
+{
+    try {
+        Platform lPlatform = getPlatform();
+        std::vector<Device> devices;
+        lPlatform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+        Context context(devices);
+
+        params.shares.clear();
+        for (auto &device : devices) {
+            std::cout << "Device: " << device.getInfo<CL_DEVICE_NAME>() << std::endl;
+            device_share share;
+            share.d = device;
+            share.q = CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE);
+            share.y0 = share.rows = 0;
+            share.msPerRow = 0;
+            params.shares.push_back(share);
+        }
+        // uploads go through the first device
+        params.d = devices[0];
+        if (!initKernel(context, wind_width, wind_height, sceneFile, factory))
+            return 245;
+    } catch(Error error) {
+        std::cout << error.what() << "(" << error.err() << ")" << std::endl;
+        if (params.p() != NULL) {
+            for (auto &share : params.shares)
+                std::cout << "Log:\n" << params.p.getBuildInfo<CL_PROGRAM_BUILD_LOG>(share.d) << std::endl;
+        }
+        return 249;
+    }
     return 0;
 }
 
-inline unsigned divup(unsigned a, unsigned b)
+// Plain CL context on any device type with a regular Image2D as the kernel output,
+// shared by the headless and batch render modes. The CPU backend only needs the scene.
+int initHeadless(const char *sceneFile, scene_factory factory = create_scene)
 {
-	return (a + b - 1) / b;
+    if (params.cpu) {
+        std::cout << "CPU backend: " << params.cpu->threadCount() << " threads, " << CpuTracer::isa() << std::endl;
+        return initScene(wind_width, wind_height, sceneFile, factory) ? 0 : 245;
+    }
+    if (params.multiDevice)
+        return initMultiDevice(sceneFile, factory);
+
+    try {
+        Platform lPlatform = getPlatform();
+        std::vector<Device> devices;
+        lPlatform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+        // prefer a GPU, but CPU-only platforms (pocl) are fine too
+        params.d = devices[0];
+        for (unsigned d=0; d<devices.size(); ++d) {
+            if (devices[d].getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_GPU) {
+                params.d = devices[d];
+                break;
+            }
+        }
+        std::cout << "Device: " << params.d.getInfo<CL_DEVICE_NAME>() << std::endl;
+
+        Context context(params.d);
+        if (!initKernel(context, wind_width, wind_height, sceneFile, factory))
+            return 245;
+
+        params.image = Image2D(context, CL_MEM_WRITE_ONLY, ImageFormat(CL_RGBA, CL_FLOAT), wind_width, wind_height);
+    } catch(Error error) {
+        std::cout << error.what() << "(" << error.err() << ")" << std::endl;
+        if (params.p() != NULL) {
+            std::string val = params.p.getBuildInfo<CL_PROGRAM_BUILD_LOG>(params.d);
+            std::cout<<"Log:\n"<<val<<std::endl;
+        }
+        return 249;
+    }
+    return 0;
+}
+
+// Renders without a window or GL context, output is read back to the host every frame
+int runHeadless(int frames, const char *outFile)
+{
+    int res = initHeadless(NULL);
+    if (res) return res;
+
+    std::vector<cl_float4> pixels(wind_width * wind_height);
+
+    const auto start = std::chrono::steady_clock::now();
+    auto currentTime = start;
+
+    for (int i = 0; i < frames; ++i)
+    {
+        auto newTime = std::chrono::steady_clock::now();
+        std::chrono::duration<double> frameTime = (newTime - currentTime);
+        currentTime = newTime;
+
+        profileBeginFrame();
+        processHeadlessStep(frameTime.count(), pixels);
+        profileEndFrame(newTime);
+    }
+    profileFinish();
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now( ) - start );
+    auto seconds = elapsed.count() / 1000.0;
+    std::cout << "Total elapsed (sec): " << seconds << std::endl;
+    std::cout << "Total frames: " << frames << std::endl;
+    std::cout << "FPS: " << frames / seconds << std::endl;
+
+    if (outFile && !write_image(outFile, pixels.data(), wind_width, wind_height))
+        return 246;
+
+    return 0;
+}
+
+void setCamera(const camera_key &key)
+{
+    params.camera.position = { key.position[0], key.position[1], key.position[2], 0 };
+    params.camera.rotation = cameraRotation(key.pitch, key.yaw).GetStruct();
+}
+
+typedef struct {
+    const char *sceneFile;
+    const char *cameraFile;
+    const char *outPattern;
+    int frames;
+} render_job;
+
+// Offline rendering of a camera path. Frames are read back with non-blocking reads
+// into pinned staging memory and written by FrameWriter, so the queue keeps
+// tracing while earlier frames are encoded.
+int runRender(const render_job &job)
+{
+    int res = initHeadless(job.sceneFile);
+    if (res) return res;
+
+    std::vector<camera_key> path;
+    if (job.cameraFile) {
+        if (!load_camera_path(job.cameraFile, path))
+            return 245;
+    } else {
+        camera_key key;
+        memset(&key, 0, sizeof(camera_key));
+        path.assign(job.frames, key);
+    }
+    if (path.empty()) {
+        std::cout << "Nothing to render" << std::endl;
+        return 0;
+    }
+
+    const ::size_t frameBytes = wind_width * wind_height * sizeof(cl_float4);
+    Buffer staging[STAGING_SLOTS];
+    std::vector<cl_float4> hostStaging[STAGING_SLOTS];
+    cl_float4 *stagingPtr[STAGING_SLOTS];
+    bool ok = true;
+    const auto start = std::chrono::steady_clock::now();
+    try {
+        for (int i = 0; i < STAGING_SLOTS; ++i) {
+            if (tracesToHost()) {
+                hostStaging[i].resize(wind_width * wind_height);
+                stagingPtr[i] = hostStaging[i].data();
+                continue;
+            }
+            // mapping an ALLOC_HOST_PTR buffer gives page-locked memory the read can DMA into
+            staging[i] = Buffer(params.context, CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_WRITE, frameBytes);
+            stagingPtr[i] = (cl_float4*)params.q.enqueueMapBuffer(staging[i], CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, frameBytes);
+        }
+
+        cl::size_t<3> origin;
+        cl::size_t<3> region;
+        region[0] = wind_width;
+        region[1] = wind_height;
+        region[2] = 1;
+
+        FrameWriter writer(STAGING_SLOTS);
+        std::vector<char> fname(job.outPattern ? strlen(job.outPattern) + 32 : 0);
+        for (unsigned i = 0; i < path.size(); ++i) {
+            const time_point frameStart = std::chrono::steady_clock::now();
+            profileBeginFrame();
+            int slot = i % STAGING_SLOTS;
+            // the writer still owns this staging memory until its previous frame is on disk
+            writer.waitForSlot(slot);
+
+            setCamera(path[i]);
+
+            frame_job frame;
+            frame.pixels = stagingPtr[slot];
+            frame.width = wind_width;
+            frame.height = wind_height;
+            frame.slot = slot;
+
+            if (tracesToHost()) {
+                // the frame is complete on return, frame.ready stays empty
+                traceToHost(stagingPtr[slot]);
+            } else {
+                uploadSceneChanges();
+                enqueueTrace(params.image);
+                params.q.enqueueReadImage(params.image, CL_FALSE, origin, region, 0, 0, stagingPtr[slot], NULL, &frame.ready);
+                params.q.flush();
+                profileEvent(StageReadback, frame.ready);
+            }
+
+            if (job.outPattern) {
+                snprintf(fname.data(), fname.size(), job.outPattern, (int)i);
+                frame.fname = fname.data();
+                writer.submit(frame);
+            }
+            profileEndFrame(frameStart);
+        }
+        ok = writer.finish();
+
+        if (!tracesToHost()) {
+            for (int i = 0; i < STAGING_SLOTS; ++i)
+                params.q.enqueueUnmapMemObject(staging[i], stagingPtr[i]);
+            params.q.finish();
+        }
+        profileFinish();
+    } catch(Error error) {
+        std::cout << error.what() << "(" << error.err() << ")" << std::endl;
+        return 249;
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now( ) - start );
+    auto seconds = elapsed.count() / 1000.0;
+    std::cout << "Total elapsed (sec): " << seconds << std::endl;
+    std::cout << "Total frames: " << path.size() << std::endl;
+    std::cout << "FPS: " << path.size() / seconds << std::endl;
+
+    return ok ? 0 : 246;
+}
+
+// Circle around the preset's center looking at it, one revolution over the path
+static std::vector<camera_key> orbitPath(const scene_preset &preset, int frames)
+{
+    const float PI_F = 3.14159265358979f;
+    std::vector<camera_key> path(frames);
+    for (int i = 0; i < frames; ++i) {
+        float a = 2 * PI_F * i / frames;
+        camera_key &key = path[i];
+        key.position[0] = preset.center[0] - preset.radius * sinf(a);
+        key.position[1] = preset.center[1] + preset.height;
+        key.position[2] = preset.center[2] - preset.radius * cosf(a);
+        key.pitch = -atanf(preset.height / preset.radius) * 180 / PI_F;
+        key.yaw = a * 180 / PI_F;
+    }
+    return path;
+}
+
+typedef struct {
+    std::vector<std::string> scenes;
+    std::vector<std::pair<int, int> > sizes;
+    const char *cameraFile;
+    const char *reportFile;
+    int frames;
+    int warmup;
+} bench_job;
+
+typedef struct {
+    std::string scene;
+    int width;
+    int height;
+    int spheres;
+    int lights;
+    double mraysPerSec;
+    stage_stats frame;
+    stage_stats kernel;
+} bench_result;
+
+// Traces one preset at one size along the path. Frames are finished one at a
+// time and never read back, so frame times measure the tracer alone.
+static int runBenchCase(const scene_preset &preset, const std::vector<camera_key> &path, int warmup, bench_result &result)
+{
+    // a fresh profiler per case, set before init so the queue gets profiling enabled
+    FrameProfiler profiler(NULL);
+    params.profiler = &profiler;
+    int res = initHeadless(NULL, preset.create);
+    if (res) {
+        params.profiler = NULL;
+        return res;
+    }
+
+    std::vector<cl_float4> pixels(tracesToHost() ? wind_width * wind_height : 0);
+    double seconds = 0;
+    try {
+        for (int i = -warmup; i < (int)path.size(); ++i) {
+            // warm-up frames come before the first beginFrame, so nothing is recorded for them
+            const time_point frameStart = std::chrono::steady_clock::now();
+            if (i >= 0)
+                profileBeginFrame();
+            setCamera(path[i < 0 ? 0 : i]);
+            if (tracesToHost()) {
+                traceToHost(pixels.data());
+            } else {
+                uploadSceneChanges();
+                enqueueTrace(params.image);
+                params.q.finish();
+            }
+            if (i >= 0) {
+                seconds += elapsedMs(frameStart) / 1000;
+                profileEndFrame(frameStart);
+            }
+        }
+        profiler.collect(true);
+    } catch(Error error) {
+        std::cout << error.what() << "(" << error.err() << ")" << std::endl;
+        res = 249;
+    }
+    params.profiler = NULL;
+    if (res) return res;
+
+    result.scene = preset.name;
+    result.width = wind_width;
+    result.height = wind_height;
+    result.spheres = params.scene.sphere_count;
+    result.lights = params.scene.light_count;
+    // primary rays only, shadow and reflection rays depend on the scene
+    result.mraysPerSec = (double)wind_width * wind_height * path.size() / seconds * 1e-6;
+    profiler.stats(StageFrame, result.frame);
+    if (!profiler.stats(StageKernel, result.kernel))
+        result.kernel = result.frame;
+    return 0;
+}
+
+// s as a JSON string literal: quotes, backslashes and control characters escaped
+static std::string jsonString(const std::string &s)
+{
+    std::string quoted = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if ((unsigned char)c < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", (unsigned char)c);
+            quoted += code;
+        } else
+            quoted += c;
+    }
+    return quoted + "\"";
+}
+
+static void writeStats(std::ofstream &out, const char *name, const stage_stats &st)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "\"%s\": {\"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f}",
+        name, st.mean, st.p50, st.p95, st.p99, st.max);
+    out << buf;
+}
+
+static bool writeBenchReport(const char *fname, const bench_job &job, const std::string &device, const std::vector<bench_result> &results)
+{
+    std::ofstream out(fname);
+    if (!out.is_open()) {
+        std::cout << "Unable to open file " << fname << std::endl;
+        return false;
+    }
+    out << "{\n  \"device\": " << jsonString(device) << ",\n";
+    out << "  \"backend\": \"" << (params.cpu ? "cpu" : params.multiDevice ? "cl-multi" : params.wavefront ? "cl-wavefront" : params.persistent ? "cl-persistent" : "cl") << "\",\n";
+    out << "  \"camera\": " << jsonString(job.cameraFile ? job.cameraFile : "orbit") << ",\n";
+    out << "  \"warmup\": " << job.warmup << ",\n";
+    out << "  \"results\": [";
+    char buf[256];
+    for (unsigned i = 0; i < results.size(); ++i) {
+        const bench_result &r = results[i];
+        snprintf(buf, sizeof(buf), "\"width\": %d, \"height\": %d, \"spheres\": %d, \"lights\": %d, \"frames\": %d, \"mrays_per_s\": %.3f",
+            r.width, r.height, r.spheres, r.lights, r.frame.frames, r.mraysPerSec);
+        out << (i ? ",\n" : "\n") << "    {\"scene\": " << jsonString(r.scene) << ", " << buf << ",\n      ";
+        writeStats(out, "frame_ms", r.frame);
+        out << ",\n      ";
+        writeStats(out, "kernel_ms", r.kernel);
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+    out.close();
+    if (out.fail()) {
+        std::cout << "Unable to write file " << fname << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Replays a camera path over the scene presets at fixed sizes and reports
+// primary Mrays/s and frame time percentiles per case
+int runBench(const bench_job &job)
+{
+    std::vector<camera_key> recorded;
+    if (job.cameraFile) {
+        if (!load_camera_path(job.cameraFile, recorded))
+            return 245;
+        if (recorded.empty()) {
+            std::cout << "Nothing to render" << std::endl;
+            return 0;
+        }
+    }
+
+    std::vector<bench_result> results;
+    for (auto &name : job.scenes) {
+        const scene_preset *preset = findPreset(name);
+        std::vector<camera_key> path = job.cameraFile ? recorded : orbitPath(*preset, job.frames);
+        for (auto &size : job.sizes) {
+            wind_width = size.first;
+            wind_height = size.second;
+            bench_result result;
+            int res = runBenchCase(*preset, path, job.warmup, result);
+            if (res) return res;
+            results.push_back(result);
+        }
+    }
+
+    std::string device;
+    if (params.cpu)
+        device = std::string("CPU ") + CpuTracer::isa() + " x" + std::to_string(params.cpu->threadCount());
+    else if (params.multiDevice) {
+        for (auto &share : params.shares)
+            device += (device.empty() ? "" : " + ") + share.d.getInfo<CL_DEVICE_NAME>();
+    } else
+        device = params.d.getInfo<CL_DEVICE_NAME>();
+
+    char line[160];
+    std::cout << "Device: " << device << std::endl;
+    snprintf(line, sizeof(line), "%-8s %10s %8s %10s %10s %10s %10s %10s", "scene", "size", "frames", "Mrays/s", "mean ms", "p50 ms", "p95 ms", "p99 ms");
+    std::cout << line << std::endl;
+    for (auto &r : results) {
+        std::string size = std::to_string(r.width) + "x" + std::to_string(r.height);
+        snprintf(line, sizeof(line), "%-8s %10s %8d %10.2f %10.3f %10.3f %10.3f %10.3f", r.scene.c_str(), size.c_str(), r.frame.frames,
+            r.mraysPerSec, r.frame.mean, r.frame.p50, r.frame.p95, r.frame.p99);
+        std::cout << line << std::endl;
+    }
+
+    if (job.reportFile && !writeBenchReport(job.reportFile, job, device, results))
+        return 246;
+    return 0;
+}
+
+// Resizes the output of a headless context; the kernels are kept, only the
+// size dependent memory is reallocated and the buffer arguments set again
+static void resizeOutput(int width, int height)
+{
+    wind_width = width;
+    wind_height = height;
+    setCanvas(params.scene, width, height);
+    params.sceneDirty = true;
+    if (params.cpu) {
+        if (params.accumulate)
+            params.cpuHistory.assign(width * height, cl_float4());
+        return;
+    }
+    waitForUploads();
+    allocateFrameBuffers(params.context, width, height);
+    if (!params.multiDevice)
+        params.image = Image2D(params.context, CL_MEM_WRITE_ONLY, ImageFormat(CL_RGBA, CL_FLOAT), width, height);
+    params.kernelOptions.clear();
+    selectKernel();
+}
+
+// Replaces the scene of a running context; the previous one stays if the file fails to load
+static bool reloadScene(const char *sceneFile)
+{
+    if (!params.cpu)
+        waitForUploads();
+    rt_scene scene = params.scene;
+    std::vector<rt_sphere> spheres = params.spheres;
+    std::vector<rt_light> lights = params.lights;
+    std::vector<rt_bvh_node> bvh = params.bvh;
+    triangle_meshes meshes = params.meshes;
+    std::vector<int> sphereSlot = params.sphereSlot;
+    if (!initScene(wind_width, wind_height, sceneFile)) {
+        params.scene = scene;
+        params.spheres = spheres;
+        params.lights = lights;
+        params.bvh = bvh;
+        params.meshes = meshes;
+        params.sphereSlot = sphereSlot;
+        return false;
+    }
+    if (!params.cpu) {
+        createSceneBuffers(params.context);
+        params.kernelOptions.clear();
+        selectKernel();
+    }
+    return true;
+}
+
+// Traces samples frames of the current camera into a fresh mean and reads the result into pixels
+static void renderSamples(int samples, std::vector<cl_float4> &pixels)
+{
+    pixels.resize(wind_width * wind_height);
+    params.sample = -1;
+    for (int i = 0; i < samples; ++i) {
+        if (tracesToHost()) {
+            traceToHost(pixels.data());
+        } else {
+            uploadSceneChanges();
+            enqueueTrace(params.image);
+        }
+    }
+    if (tracesToHost()) return;
+
+    cl::size_t<3> origin;
+    cl::size_t<3> region;
+    region[0] = wind_width;
+    region[1] = wind_height;
+    region[2] = 1;
+    params.q.enqueueReadImage(params.image, CL_TRUE, origin, region, 0, 0, pixels.data());
+}
+
+static bool parseLightType(const std::string &name, lightType &type)
+{
+    if (name == "ambient") type = Ambient;
+    else if (name == "point") type = Point;
+    else if (name == "direct") type = Direct;
+    else return false;
+    return true;
+}
+
+// State of the client connection, kept between its requests
+typedef struct {
+    camera_key camera;
+    int samples;
+    std::vector<cl_float4> pixels;
+    std::vector<unsigned char> encoded;
+} server_session;
+
+// Handles one request line and writes the reply. Returns false when the
+// client asked to disconnect; shutdown also clears running.
+static bool serveRequest(SocketServer &server, const std::string &line, server_session &session, bool &running)
+{
+    std::istringstream in(line);
+    std::string command;
+    in >> command;
+    std::string reply = "ok";
+
+    if (command.empty()) {
+        return true;
+    } else if (command == "quit") {
+        server.writeLine(reply);
+        return false;
+    } else if (command == "shutdown") {
+        server.writeLine(reply);
+        running = false;
+        return false;
+    } else if (command == "scene") {
+        std::string file;
+        in >> file;
+        if (file.empty() || !reloadScene(file.c_str()))
+            reply = "error unable to load scene " + file;
+        else
+            reply = "ok " + std::to_string(params.scene.sphere_count) + " " + std::to_string(params.scene.light_count);
+    } else if (command == "size") {
+        int width = 0, height = 0;
+        std::string size;
+        in >> size;
+        if (sscanf(size.c_str(), "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+            reply = "error expected size WxH";
+        else if (width != wind_width || height != wind_height)
+            resizeOutput(width, height);
+    } else if (command == "camera") {
+        camera_key key;
+        if (!(in >> key.position[0] >> key.position[1] >> key.position[2] >> key.pitch >> key.yaw))
+            reply = "error expected camera x y z pitch yaw";
+        else
+            session.camera = key;
+    } else if (command == "samples") {
+        int samples = 0;
+        if (!(in >> samples) || samples <= 0)
+            reply = "error expected samples N";
+        else
+            session.samples = samples;
+    } else if (command == "sphere") {
+        int index;
+        cl_float center[3], radius, color[3], reflect;
+        cl_int specular;
+        if (!(in >> index >> center[0] >> center[1] >> center[2] >> radius >> color[0] >> color[1] >> color[2] >> specular >> reflect))
+            reply = "error expected sphere index x y z radius r g b specular reflect";
+        else if (index < 0 || index >= (int)params.sphereSlot.size())
+            reply = "error no sphere " + std::to_string(index);
+        else
+            setSphere(params.sphereSlot[index], create_spheres({ center[0], center[1], center[2] }, { color[0], color[1], color[2] }, radius, specular, reflect));
+    } else if (command == "instance") {
+        int index;
+        cl_float position[3], scale, rotation[3];
+        if (!(in >> index >> position[0] >> position[1] >> position[2] >> scale >> rotation[0] >> rotation[1] >> rotation[2]) || !(scale > 0))
+            reply = "error expected instance index x y z scale rx ry rz";
+        else if (index < 0 || index >= params.scene.instance_count)
+            reply = "error no instance " + std::to_string(index);
+        else {
+            cl_float4 worldToObject[3];
+            instance_transform(scale, rotation, { position[0], position[1], position[2], 0 }, worldToObject);
+            setInstance(index, worldToObject);
+        }
+    } else if (command == "light") {
+        int index;
+        std::string typeName;
+        cl_float intensity, v[3] = { 0, 0, 0 };
+        lightType type;
+        if (!(in >> index >> typeName >> intensity) || !parseLightType(typeName, type))
+            reply = "error expected light index ambient|point|direct intensity [x y z [radius]]";
+        else if (type != Ambient && !(in >> v[0] >> v[1] >> v[2]))
+            reply = "error expected the light position or direction";
+        else if (index < 0 || index >= params.scene.light_count)
+            reply = "error no light " + std::to_string(index);
+        else {
+            cl_float4 vec = { v[0], v[1], v[2], 0 };
+            cl_float4 zero = { 0, 0, 0, 0 };
+            rt_light light = create_light(type, intensity, type == Point ? vec : zero, type == Direct ? vec : zero);
+            cl_float radius;
+            if (type == Point && in >> radius && radius > 0)
+                light.radius = radius;
+            setLight(index, light);
+        }
+    } else if (command == "render") {
+        std::string format = "png";
+        in >> format;
+        if (!is_image_format_supported(("." + format).c_str())) {
+            reply = "error unknown format " + format;
+        } else {
+            setCamera(session.camera);
+            renderSamples(session.samples, session.pixels);
+            encode_image(format.c_str(), session.pixels.data(), wind_width, wind_height, session.encoded);
+            // the payload follows the header line, its size tells the client how much to read
+            std::ostringstream header;
+            header << "frame " << format << " " << wind_width << " " << wind_height << " " << session.encoded.size();
+            return server.writeLine(header.str()) && server.write(session.encoded.data(), session.encoded.size());
+        }
+    } else {
+        reply = "error unknown command " + command;
+    }
+    return server.writeLine(reply);
+}
+
+// rt serve: keeps the context, the built kernels and the scene resident and
+// renders the jobs of one client at a time, so a job costs no context creation
+// or kernel build. Accumulation is always on, samples averages that many
+// jittered frames per render.
+int runServer(const char *socketPath, const char *sceneFile)
+{
+    params.accumulate = true;
+    int res = initHeadless(sceneFile);
+    if (res) return res;
+
+    SocketServer server(socketPath);
+    if (!server.isOpen())
+        return 251;
+    std::cout << "Listening on " << socketPath << std::endl;
+
+    server_session session;
+    memset(&session.camera, 0, sizeof(camera_key));
+    session.samples = 1;
+    bool running = true;
+    while (running && server.accept()) {
+        std::string line;
+        while (server.readLine(line)) {
+            bool open;
+            try {
+                open = serveRequest(server, line, session, running);
+            } catch(Error error) {
+                std::cout << error.what() << "(" << error.err() << ")" << std::endl;
+                open = server.writeLine(std::string("error ") + error.what() + "(" + std::to_string(error.err()) + ")");
+            }
+            if (!open) break;
+        }
+        server.closeClient();
+    }
+    return 0;
+}
+
+// GL sharing context on the first GPU with cl_khr_gl_sharing, plus the event
+// sync entry points when both sides support them
+static void initInterop(GLFWwindow *window)
+{
+    Platform lPlatform = getPlatform();
+    // Select the default platform and create a context using this platform and the GPU
+#ifdef OS_LNX
+    cl_context_properties cps[] = {
+        CL_GL_CONTEXT_KHR, (cl_context_properties)glfwGetGLXContext(window),
+        CL_GLX_DISPLAY_KHR, (cl_context_properties)glfwGetX11Display(),
+        CL_CONTEXT_PLATFORM, (cl_context_properties)lPlatform(),
+        0
+    };
+#endif
+#ifdef OS_WIN
+    cl_context_properties cps[] = {
+        CL_GL_CONTEXT_KHR, (cl_context_properties)glfwGetWGLContext(window),
+        CL_WGL_HDC_KHR, (cl_context_properties)GetDC(glfwGetWin32Window(window)),
+        CL_CONTEXT_PLATFORM, (cl_context_properties)lPlatform(),
+        0
+    };
+#endif
+    std::vector<Device> devices;
+    lPlatform.getDevices(CL_DEVICE_TYPE_GPU, &devices);
+    // Get a list of devices on this platform
+    for (unsigned d=0; d<devices.size(); ++d) {
+        if (checkExtnAvailability(devices[d],CL_GL_SHARING_EXT)) {
+            params.d = devices[d];
+            break;
+        }
+    }
+    Context context(params.d, cps);
+    initKernel(context, wind_width, wind_height);
+
+    params.eventSync = checkExtnAvailability(params.d, CL_GL_EVENT_EXT) && glfwExtensionSupported("GL_ARB_cl_event");
+    if (params.eventSync) {
+        params.createEventFromGLsync = (createEventFromGLsync_fn)clGetExtensionFunctionAddressForPlatform(lPlatform(), "clCreateEventFromGLsyncKHR");
+        rparams.createSyncFromCLevent = (createSyncFromCLevent_fn)glfwGetProcAddress("glCreateSyncFromCLeventARB");
+        params.eventSync = params.createEventFromGLsync != NULL && rparams.createSyncFromCLevent != NULL;
+    }
+    std::cout << (params.eventSync ? "Using GL/CL event sync" : "GL/CL event sync unavailable, finishing every frame") << std::endl;
+}
+
+static void printUsage(const char *name)
+{
+    std::cout << "Usage: " << name << " [--backend=cl|cpu] [--multi-device] [--wavefront] [--persistent] [--accumulate [--light-samples N]] [--profile] [--profile-out frames.csv|jsonl] [--record-camera path.txt] [--target-ms N] [--headless WxH [--frames N] [--out file.ppm|png|exr]]" << std::endl;
+    std::cout << "       " << name << " render [--backend=cl|cpu] [--multi-device] [--wavefront] [--persistent] [--accumulate [--light-samples N]] [--profile] [--profile-out frames.csv|jsonl] [--size WxH] [--scene s.json] [--camera path.txt | --frames N] [--out frames/%05d.exr]" << std::endl;
+    std::cout << "       " << name << " bench [--backend=cl|cpu] [--multi-device] [--wavefront] [--persistent] [--accumulate [--light-samples N]] [--scene default|grid|lights|mirror]... [--size WxH]... [--camera path.txt | --frames N] [--warmup N] [--report bench.json]" << std::endl;
+    std::cout << "       " << name << " serve --socket path.sock [--backend=cl|cpu] [--multi-device] [--wavefront] [--persistent] [--light-samples N] [--size WxH] [--scene s.json]" << std::endl;
+    std::cout << "       " << name << " convert <s.json|default|grid|lights|mirror> <out.rtsc>" << std::endl;
+}
+
+// Options shared by every mode, the CPU tracer and profiler are created by main
+static bool cpuBackend = false;
+static bool profile = false;
+static const char *profileOut = NULL;
+static bool wavefront = false;
+static bool accumulate = false;
+static bool persistent = false;
+static bool multiDevice = false;
+static int lightSamples = 0;
+
+static bool parseCommonOption(int argc, char **argv, int &i)
+{
+    std::string arg = argv[i];
+    if (arg == "--backend=cpu")
+        cpuBackend = true;
+    else if (arg == "--backend=cl")
+        cpuBackend = false;
+    else if (arg == "--wavefront")
+        wavefront = true;
+    else if (arg == "--accumulate")
+        accumulate = true;
+    else if (arg == "--persistent")
+        persistent = true;
+    else if (arg == "--multi-device")
+        multiDevice = true;
+    else if (arg == "--light-samples" && i + 1 < argc)
+        lightSamples = std::max(0, atoi(argv[++i]));
+    else if (arg == "--profile")
+        profile = true;
+    else if (arg == "--profile-out" && i + 1 < argc) {
+        profile = true;
+        profileOut = argv[++i];
+    } else
+        return false;
+    return true;
+}
+
+// Refuses option combinations no mode can honour
+static bool checkCommonOptions(const char *name)
+{
+    if (wavefront && persistent) {
+        std::cout << "--persistent is a build option of the rt megakernel, it cannot be combined with --wavefront" << std::endl;
+        printUsage(name);
+        return false;
+    }
+    if (wavefront && lightSamples > 0) {
+        std::cout << "--light-samples samples lights in the rt megakernel, it cannot be combined with --wavefront" << std::endl;
+        printUsage(name);
+        return false;
+    }
+    if (multiDevice && (wavefront || persistent)) {
+        std::cout << "--multi-device traces with the rt kernel, it cannot be combined with --wavefront or --persistent" << std::endl;
+        printUsage(name);
+        return false;
+    }
+    return true;
+}
+
+// Reads a whole argument as a finite number: "inf", "nan" and trailing
+// characters are refused
+static bool parseNumber(const char *arg, double &value)
+{
+    char *end;
+    value = strtod(arg, &end);
+    return end != arg && *end == '\0' && std::isfinite(value);
+}
+
+static bool parseSize(const char *arg)
+{
+    return sscanf(arg, "%dx%d", &wind_width, &wind_height) == 2 && wind_width > 0 && wind_height > 0;
+}
+
+// Checks the output pattern formats exactly one frame number
+static bool isFramePattern(const char *pattern)
+{
+    int conversions = 0;
+    for (const char *c = pattern; *c; ++c) {
+        if (*c != '%') continue;
+        if (*++c == '%') continue;
+        while (*c >= '0' && *c <= '9') ++c;
+        if (*c != 'd') return false;
+        ++conversions;
+    }
+    return conversions == 1 && is_image_format_supported(pattern);
+}
+
+static int parseRender(int argc, char **argv)
+{
+    render_job job;
+    memset(&job, 0, sizeof(render_job));
+    job.frames = 1;
+    wind_width = 1280;
+    wind_height = 720;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--size" && i + 1 < argc && parseSize(argv[i + 1])) {
+            ++i;
+        } else if (arg == "--scene" && i + 1 < argc) {
+            job.sceneFile = argv[++i];
+        } else if (arg == "--camera" && i + 1 < argc) {
+            job.cameraFile = argv[++i];
+        } else if (arg == "--frames" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            job.frames = atoi(argv[++i]);
+        } else if (arg == "--out" && i + 1 < argc && isFramePattern(argv[i + 1])) {
+            job.outPattern = argv[++i];
+        } else if (parseCommonOption(argc, argv, i)) {
+            continue;
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (!checkCommonOptions(argv[0]))
+        return 1;
+    std::unique_ptr<CpuTracer> cpu(cpuBackend ? new CpuTracer() : NULL);
+    std::unique_ptr<FrameProfiler> profiler(profile ? new FrameProfiler(profileOut) : NULL);
+    params.cpu = cpu.get();
+    params.profiler = profiler.get();
+    params.wavefront = wavefront;
+    params.accumulate = accumulate;
+    params.persistent = persistent;
+    params.multiDevice = multiDevice;
+    params.lightSamples = lightSamples;
+    return runRender(job);
+}
+
+static int parseBench(int argc, char **argv)
+{
+    bench_job job;
+    job.cameraFile = NULL;
+    job.reportFile = NULL;
+    job.frames = 120;
+    job.warmup = 10;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--size" && i + 1 < argc && parseSize(argv[i + 1])) {
+            job.sizes.push_back(std::make_pair(wind_width, wind_height));
+            ++i;
+        } else if (arg == "--scene" && i + 1 < argc && findPreset(argv[i + 1])) {
+            job.scenes.push_back(argv[++i]);
+        } else if (arg == "--camera" && i + 1 < argc) {
+            job.cameraFile = argv[++i];
+        } else if (arg == "--frames" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            job.frames = atoi(argv[++i]);
+        } else if (arg == "--warmup" && i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+            job.warmup = atoi(argv[++i]);
+        } else if (arg == "--report" && i + 1 < argc) {
+            job.reportFile = argv[++i];
+        } else if (parseCommonOption(argc, argv, i)) {
+            continue;
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (!checkCommonOptions(argv[0]))
+        return 1;
+    if (profile) {
+        std::cout << "bench profiles every case, use --report instead of --profile" << std::endl;
+        printUsage(argv[0]);
+        return 1;
+    }
+    if (job.scenes.empty()) {
+        for (auto &preset : scene_presets)
+            job.scenes.push_back(preset.name);
+    }
+    if (job.sizes.empty()) {
+        job.sizes.push_back(std::make_pair(1280, 720));
+        job.sizes.push_back(std::make_pair(1920, 1080));
+    }
+    // bench always profiles, one profiler per case
+    std::unique_ptr<CpuTracer> cpu(cpuBackend ? new CpuTracer() : NULL);
+    params.cpu = cpu.get();
+    params.wavefront = wavefront;
+    params.accumulate = accumulate;
+    params.persistent = persistent;
+    params.multiDevice = multiDevice;
+    params.lightSamples = lightSamples;
+    return runBench(job);
+}
+
+static int parseServe(int argc, char **argv)
+{
+    const char *socketPath = NULL;
+    const char *sceneFile = NULL;
+    wind_width = 1280;
+    wind_height = 720;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--socket" && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else if (arg == "--size" && i + 1 < argc && parseSize(argv[i + 1])) {
+            ++i;
+        } else if (arg == "--scene" && i + 1 < argc) {
+            sceneFile = argv[++i];
+        } else if (parseCommonOption(argc, argv, i)) {
+            continue;
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (!checkCommonOptions(argv[0]))
+        return 1;
+    if (!socketPath) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    std::unique_ptr<CpuTracer> cpu(cpuBackend ? new CpuTracer() : NULL);
+    std::unique_ptr<FrameProfiler> profiler(profile ? new FrameProfiler(profileOut) : NULL);
+    params.cpu = cpu.get();
+    params.profiler = profiler.get();
+    params.wavefront = wavefront;
+    params.persistent = persistent;
+    params.multiDevice = multiDevice;
+    params.lightSamples = lightSamples;
+    return runServer(socketPath, sceneFile);
+}
+
+// Writes a JSON scene or a preset as a binary scene with its BVH already built
+static int runConvert(const char *input, const char *output)
+{
+    const scene_preset *preset = findPreset(input);
+    if (!initScene(1, 1, preset ? NULL : input, preset ? preset->create : create_scene))
+        return 245;
+    if (!save_scene_binary(output, params.scene, params.spheres, params.lights, params.bvh, params.meshes))
+        return 246;
+    const triangle_meshes &meshes = params.meshes;
+    std::cout << output << ": " << params.scene.sphere_count << " spheres, " << params.scene.light_count
+        << " lights, " << params.scene.triangle_count << " triangles in " << params.scene.instance_count << " instances, "
+        << params.bvh.size() + meshes.nodes.size() + meshes.instanceNodes.size() << " BVH nodes" << std::endl;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+	srand(time(nullptr));
+
+    if (argc > 1 && std::string(argv[1]) == "render")
+        return parseRender(argc, argv);
+    if (argc > 1 && std::string(argv[1]) == "bench")
+        return parseBench(argc, argv);
+    if (argc > 1 && std::string(argv[1]) == "serve")
+        return parseServe(argc, argv);
+    if (argc > 1 && std::string(argv[1]) == "convert") {
+        if (argc != 4) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        return runConvert(argv[2], argv[3]);
+    }
+
+    bool headless = false;
+    int frames = 100;
+    bool framesGiven = false;
+    const char *outFile = NULL;
+    const char *recordFile = NULL;
+    double targetMs = 0;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--headless" && i + 1 < argc) {
+            if (!parseSize(argv[++i])) {
+                printUsage(argv[0]);
+                return 1;
+            }
+            headless = true;
+        } else if (arg == "--frames" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            frames = atoi(argv[++i]);
+            framesGiven = true;
+        } else if (arg == "--out" && i + 1 < argc && is_image_format_supported(argv[i + 1])) {
+            outFile = argv[++i];
+        } else if (arg == "--record-camera" && i + 1 < argc) {
+            recordFile = argv[++i];
+        } else if (arg == "--target-ms" && i + 1 < argc && parseNumber(argv[i + 1], targetMs) && targetMs > 0) {
+            ++i;
+        } else if (parseCommonOption(argc, argv, i)) {
+            continue;
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (!checkCommonOptions(argv[0]))
+        return 1;
+    // the window renders until it is closed, it has no frame count or output file
+    if (!headless && (framesGiven || outFile)) {
+        std::cout << "--frames and --out need --headless" << std::endl;
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    std::unique_ptr<CpuTracer> cpu(cpuBackend ? new CpuTracer() : NULL);
+    std::unique_ptr<FrameProfiler> profiler(profile ? new FrameProfiler(profileOut) : NULL);
+    params.cpu = cpu.get();
+    params.profiler = profiler.get();
+    params.wavefront = wavefront;
+    params.accumulate = accumulate;
+    params.persistent = persistent;
+    params.multiDevice = multiDevice;
+    params.lightSamples = lightSamples;
+
+    if (headless)
+        return runHeadless(frames, outFile);
+
+    if (!glfwInit())
+        return 255;
+
+          GLFWmonitor* monitor = glfwGetPrimaryMonitor();
+    const GLFWvidmode* mode    = glfwGetVideoMode(monitor);
+
+    glfwWindowHint(GLFW_RED_BITS    , mode->redBits    );
+    glfwWindowHint(GLFW_GREEN_BITS  , mode->greenBits  );
+    glfwWindowHint(GLFW_BLUE_BITS   , mode->blueBits   );
+    glfwWindowHint(GLFW_REFRESH_RATE, mode->refreshRate);
+
+    wind_width  = mode->width;
+    wind_height = mode->height;
+    //wind_width = 800;
+    //wind_height = 600;
+
+    std::unique_ptr<ResolutionScaler> scaler(targetMs > 0 ? new ResolutionScaler(wind_width, wind_height, targetMs, MIN_RESOLUTION_SCALE) : NULL);
+    params.scaler = scaler.get();
+
+    GLFWwindow* window;
+
+    glfwSetErrorCallback(glfw_error_callback);
+
+    window = glfwCreateWindow(wind_width,wind_height,"RT", monitor,NULL);
+    if (!window) {
+        glfwTerminate();
+        return 254;
+    }
+	
+    glfwMakeContextCurrent(window);
+
+    if(!gladLoadGL()) {
+        printf("gladLoadGL failed!\n");
+        return 253;
+    }
+    printf("OpenGL %d.%d\n", GLVersion.major, GLVersion.minor);
+
+    cl_int errCode;
+    try {
+        if (params.cpu) {
+            std::cout << "CPU backend: " << params.cpu->threadCount() << " threads, " << CpuTracer::isa() << std::endl;
+            initScene(wind_width, wind_height, NULL);
+        } else if (params.multiDevice) {
+            // no GL sharing across devices, frames go through host memory like the CPU backend
+            int res = initHeadless(NULL);
+            if (res) return res;
+        } else {
+            initInterop(window);
+        }
+
+        // create opengl stuff
+        rparams.prg = initShaders(ASSETS_DIR "/rt.vert", ASSETS_DIR "/rt.frag");
+        for (int i = 0; i < INTEROP_SLOTS; ++i) {
+            rparams.tex[i] = createTexture2D(wind_width,wind_height);
+            if (params.scaler) {
+                // bilinear upscale of the traced corner, texel centers still map 1:1 at full size
+                glBindTexture(GL_TEXTURE_2D, rparams.tex[i]);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+                glBindTexture(GL_TEXTURE_2D, 0);
+            }
+        }
+        GLuint vbo  = createBuffer(12,vertices,GL_STATIC_DRAW);
+        GLuint tbo  = createBuffer(8,texcords,GL_STATIC_DRAW);
+        GLuint ibo;
+        glGenBuffers(1,&ibo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER,sizeof(uint)*6,indices,GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,0);
+        // bind vao
+        glGenVertexArrays(1,&rparams.vao);
+        glBindVertexArray(rparams.vao);
+        // attach vbo
+        glBindBuffer(GL_ARRAY_BUFFER,vbo);
+        glVertexAttribPointer(0,3,GL_FLOAT,GL_FALSE,0,NULL);
+        glEnableVertexAttribArray(0);
+        // attach tbo
+        glBindBuffer(GL_ARRAY_BUFFER,tbo);
+        glVertexAttribPointer(1,2,GL_FLOAT,GL_FALSE,0,NULL);
+        glEnableVertexAttribArray(1);
+        // attach ibo
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,ibo);
+        glBindVertexArray(0);
+        // create opengl texture references using opengl textures
+        for (int i = 0; i < INTEROP_SLOTS && !tracesToHost(); ++i) {
+            params.tex[i] = ImageGL(params.context,CL_MEM_READ_WRITE,GL_TEXTURE_2D,0,rparams.tex[i],&errCode);
+            if (errCode!=CL_SUCCESS) {
+                std::cout<<"Failed to create OpenGL texture refrence: "<<errCode<<std::endl;
+                return 250;
+            }
+        }
+
+    } catch(Error error) {
+        std::cout << error.what() << "(" << error.err() << ")" << std::endl;
+        std::string val = params.p.getBuildInfo<CL_PROGRAM_BUILD_LOG>(params.d);
+        std::cout<<"Log:\n"<<val<<std::endl;
+        return 249;
+    }
+
+	glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+	glfwSetCursorPosCallback(window, glfw_mouse_callback);
+    glfwSetKeyCallback(window,glfw_key_callback);
+    glfwSetFramebufferSizeCallback(window,glfw_framebuffer_size_callback);
+
+    const auto start = std::chrono::steady_clock::now();
+    int frames_count = 0;
+    
+
+	glfwSwapInterval(0);
+
+	auto currentTime = std::chrono::steady_clock::now();
+    std::vector<camera_key> recorded;
+
+    while (!glfwWindowShouldClose(window)) 
+	{
+        ++frames_count;
+
+		auto newTime = std::chrono::steady_clock::now();
+		std::chrono::duration<double> frameTime = (newTime - currentTime);
+		currentTime = newTime;
+        profileBeginFrame();
+
+        // without event sync everything is serialised, so the texture just traced is presented
+        int traceSlot = params.eventSync ? frames_count % INTEROP_SLOTS : 0;
+        int presentSlot = params.eventSync ? (frames_count + 1) % INTEROP_SLOTS : 0;
+
+        // process call
+        if (tracesToHost())
+            processCpuStep(frameTime.count());
+        else
+            processTimeStep(frameTime.count(), traceSlot);
+        if (recordFile) {
+            // UpdateScene has applied this frame's input, the key reproduces the frame
+            camera_key key = { { params.camera.position.x, params.camera.position.y, params.camera.position.z }, pitch, yaw };
+            recorded.push_back(key);
+        }
+        // render call
+        renderFrame(presentSlot);
+        // swap front and back buffers
+        glfwSwapBuffers(window);
+        profileEndFrame(newTime);
+        // poll for events
+        glfwPollEvents();
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now( ) - start );
+    auto seconds = elapsed.count() / 1000.0;
+    std::cout << "Total elapsed (sec): " << seconds << std::endl;
+    std::cout << "Total frames: " << frames_count << std::endl;
+
+    double fps = frames_count / seconds;
+
+    std::cout << "FPS: " << fps << std::endl;
+    if (params.scaler)
+        std::cout << "Resolution: " << params.scaler->width() << "x" << params.scaler->height() << " for " << params.scaler->target() << " ms" << std::endl;
+
+    if (recordFile && save_camera_path(recordFile, recorded))
+        std::cout << "Camera path: " << recorded.size() << " frames written to " << recordFile << std::endl;
+
+    if (!params.cpu)
+        params.q.finish();
+    profileFinish();
+    for (int i = 0; i < INTEROP_SLOTS; ++i) {
+        deleteSync(params.slots[i].tracedGL);
+        deleteSync(params.slots[i].presented);
+        deleteSync(params.slots[i].acquireFence);
+    }
+
+    glfwDestroyWindow(window);
+
+    glfwTerminate();
+
+
+    std::cin.get();
+    return 0;
 }
 
-void processTimeStep(double frameRate)
+void processTimeStep(double frameRate, int slot)
 {
+    interop_slot &sync = params.slots[slot];
     cl::Event ev;
     try {
-        glFinish();
+        std::vector<Event> waitList;
+        if (params.eventSync) {
+            // keeps at most INTEROP_SLOTS frames in flight, normally already complete
+            if (sync.traced() != NULL)
+                sync.traced.wait();
+            deleteSync(sync.tracedGL);
+            deleteSync(sync.acquireFence);
+
+            // the acquire waits for GL to stop sampling this texture instead of a glFinish
+            if (sync.presented) {
+                cl_int err;
+                waitList.push_back(Event(params.createEventFromGLsync(params.context(), (cl_GLsync)sync.presented, &err)));
+                if (err != CL_SUCCESS) {
+                    std::cout<<"Failed creating event from GL sync: "<<err<<std::endl;
+                    exit(248);
+                }
+                sync.acquireFence = sync.presented;
+                sync.presented = 0;
+            }
+        } else {
+            glFinish();
+        }
+        // the previous trace into this texture is complete, so are its commands
+        if (!sync.kernels.empty()) {
+            adaptResolution(traceMs(sync.kernels), sync.width * sync.height);
+            sync.kernels.clear();
+        }
 
         std::vector<Memory> objs;
         objs.clear();
-        objs.push_back(params.tex);
+        objs.push_back(params.tex[slot]);
         // flush opengl commands and wait for object acquisition
-        cl_int res = params.q.enqueueAcquireGLObjects(&objs,NULL,&ev);
-        ev.wait();
+        cl_int res = params.q.enqueueAcquireGLObjects(&objs, waitList.empty() ? NULL : &waitList, &ev);
         if (res!=CL_SUCCESS) {
             std::cout<<"Failed acquiring GL object: "<<res<<std::endl;
             exit(248);
         }
-        
-		NDRange local(16,16);
-		NDRange global(local[0] * divup(wind_width, local[0]),local[1] * divup(wind_height, local[1]));
-
-		UpdateScene(params.scene, frameRate);
-
-		params.q.enqueueWriteBuffer(params.sceneMem, CL_TRUE, 0, sizeof(rt_scene), &params.scene, NULL, NULL);
-
-        params.q.enqueueNDRangeKernel(params.k,cl::NullRange, global, local);
+        profileEvent(StageAcquire, ev);
+        if (!params.eventSync)
+            ev.wait();
+
+		UpdateScene(params.camera, frameRate);
+
+		uploadSceneChanges();
+		enqueueTrace(params.tex[slot]);
+        sync.width = (int)params.scene.canvas_width;
+        sync.height = (int)params.scene.canvas_height;
+        if (params.scaler)
+            sync.kernels = params.traceEvents;
         // release opengl object
-        res = params.q.enqueueReleaseGLObjects(&objs);
-        ev.wait();
+        res = params.q.enqueueReleaseGLObjects(&objs, NULL, &sync.traced);
         if (res!=CL_SUCCESS) {
             std::cout<<"Failed releasing GL object: "<<res<<std::endl;
             exit(247);
         }
-        params.q.finish();
+        profileEvent(StageRelease, sync.traced);
+
+        if (params.eventSync) {
+            // submit without waiting, GL waits on the release when this texture is presented
+            params.q.flush();
+            sync.tracedGL = rparams.createSyncFromCLevent(params.context(), sync.traced(), 0);
+        } else {
+            params.q.finish();
+        }
+    } catch(Error err) {
+        std::cout << err.what() << "(" << err.err() << ")" << std::endl;
+    }
+}
+
+void processHeadlessStep(double frameRate, std::vector<cl_float4> &pixels)
+{
+    try {
+		UpdateScene(params.camera, frameRate);
+        if (tracesToHost()) {
+            traceToHost(pixels.data());
+            return;
+        }
+
+		uploadSceneChanges();
+		enqueueTrace(params.image);
+
+        Event readEv;
+
+        cl::size_t<3> origin;
+        cl::size_t<3> region;
+        region[0] = wind_width;
+        region[1] = wind_height;
+        region[2] = 1;
+        params.q.enqueueReadImage(params.image, CL_TRUE, origin, region, 0, 0, pixels.data(), NULL, &readEv);
+        profileEvent(StageReadback, readEv);
     } catch(Error err) {
         std::cout << err.what() << "(" << err.err() << ")" << std::endl;
     }
 }
 
-void renderFrame()
+// Window mode on the CPU and multi-device backends: the frame is uploaded into the first texture
+void processCpuStep(double frameRate)
 {
+    interop_slot &sync = params.slots[0];
+    UpdateScene(params.camera, frameRate);
+    sync.width = (int)params.scene.canvas_width;
+    sync.height = (int)params.scene.canvas_height;
+    params.cpuPixels.resize(sync.width * sync.height);
+    const time_point traceStart = std::chrono::steady_clock::now();
+    try {
+        traceToHost(params.cpuPixels.data());
+    } catch(Error err) {
+        std::cout << err.what() << "(" << err.err() << ")" << std::endl;
+    }
+    const double traceTime = elapsedMs(traceStart);
+
+    const time_point start = std::chrono::steady_clock::now();
+    glBindTexture(GL_TEXTURE_2D, rparams.tex[0]);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, sync.width, sync.height, GL_RGBA, GL_FLOAT, params.cpuPixels.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+    profileTime(StageUpload, start);
+
+    adaptResolution(traceTime, sync.width * sync.height);
+}
+
+void renderFrame(int slot)
+{
+    interop_slot &sync = params.slots[slot];
+
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     glClearColor(0.2,0.2,0.2,0.0);
     glEnable(GL_DEPTH_TEST);
@@ -532,15 +2855,31 @@ void renderFrame()
     // get uniform locations
     int mat_loc = glGetUniformLocation(rparams.prg,"matrix");
     int tex_loc = glGetUniformLocation(rparams.prg,"tex");
+    int extent_loc = glGetUniformLocation(rparams.prg,"extent");
     // bind texture
     glActiveTexture(GL_TEXTURE0);
     glUniform1i(tex_loc,0);
-    glBindTexture(GL_TEXTURE_2D,rparams.tex);
+    if (params.eventSync) {
+        // nothing traced into this texture yet (first frame)
+        if (!sync.tracedGL) return;
+        // GPU-side wait for the kernel that wrote the texture, the CPU carries on
+        glWaitSync(sync.tracedGL, 0, GL_TIMEOUT_IGNORED);
+    }
+    if (params.profiler)
+        params.profiler->beginQuery(params.profileFrame, StageDraw);
+    glBindTexture(GL_TEXTURE_2D,rparams.tex[slot]);
     glGenerateMipmap(GL_TEXTURE_2D);
     // set project matrix
     glUniformMatrix4fv(mat_loc,1,GL_FALSE,matrix);
+    // the traced corner of the texture, stretched over the window
+    glUniform2f(extent_loc,(float)sync.width,(float)sync.height);
     // now render stuff
     glBindVertexArray(rparams.vao);
     glDrawElements(GL_TRIANGLES,6,GL_UNSIGNED_INT,0);
     glBindVertexArray(0);
+    if (params.profiler)
+        params.profiler->endQuery();
+
+    if (params.eventSync)
+        sync.presented = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 }
@@ -3,6 +3,14 @@
 #ifndef SCENE_H
 #define SCENE_H
 
+// Tracing limits shared by the CPU backend, the BVH builders and rt.cl, which
+// gets them as -D build options (see kernelOptions in rt.cpp)
+#define MAX_RECURSION_DEPTH 5
+#define T_MIN 0.05f
+// Deepest tree the builders make, so the traversal stacks never overflow
+#define BVH_MAX_DEPTH 64
+#define BVH_STACK_SIZE BVH_MAX_DEPTH
+
 typedef struct {
 	cl_float4 center;
 	cl_float4 color;
@@ -11,17 +19,83 @@ typedef struct {
 	cl_int specular;
 } rt_sphere;
 
+// Device layout of the spheres (rt_sphere is the host one): a single buffer
+// holding sphere_count float4s with the centre in xyz and the radius in w,
+// the only data the traversal loops read, followed by the materials
+typedef struct {
+	cl_float4 color;
+	cl_float reflect;
+	cl_int specular;
+} rt_material;
+
+// float4s per sphere in the device buffer, one of geometry and the material
+#define SPHERE_STREAM_FLOAT4S (1 + sizeof(rt_material) / sizeof(cl_float4))
+
+// Flattened BVH node. Inner nodes have count == 0 and their children stored
+// next to each other at left_first and left_first + 1; leaves reference
+// count spheres starting at left_first, or triangles of a mesh object from
+// its first triangle on, or instances in the top-level tree.
+typedef struct {
+	cl_float4 bbox_min;
+	cl_float4 bbox_max;
+	cl_int left_first;
+	cl_int count;
+} rt_bvh_node;
+
+// Placement of a mesh object (see mesh_io.h). The rows of world_to_object
+// map a world point (x, y, z, 1) into the object, where rays are traced
+// against the object's own BVH; its transpose takes normals back out.
+typedef struct {
+	cl_float4 world_to_object[3];
+	cl_int root;			// first node of the object BVH in the mesh node buffer
+	cl_int first_triangle;	// leaves of the object BVH count triangles from here
+	cl_int material;		// index in the mesh materials, also the instance's place in the scene file
+} rt_instance;
+
+// float4s per instance in the device buffer
+#define INSTANCE_FLOAT4S (sizeof(rt_instance) / sizeof(cl_float4))
+
+// Light tree node for --light-samples, see light_tree.h. The bounds cover
+// the positions of the lights below, intensity is their summed magnitude.
+typedef struct {
+	cl_float4 bbox_min;
+	cl_float4 bbox_max;
+	cl_float intensity;
+	cl_int left;		// first child, the second one is next to it
+	cl_int light;		// index in the lights of a leaf, -1 for inner nodes
+	cl_float reach;		// largest radius of the lights below, 0 if one of them is unbounded
+} rt_light_node;
+
 typedef enum { Ambient, Point, Direct } lightType;
 
+// A point light with a radius fades out smoothly and reaches nothing beyond
+// it, see light_grid.h; radius 0 lights everything as before
 typedef struct {
 	lightType type;
 	cl_float intensity;
+	cl_float radius;
 	cl_float4 position;
 	cl_float4 direction;
 } rt_light;
 
+// Camera as it is moved around, the kernels get it as an rt_camera_frame
+typedef struct {
+	cl_float4 position;
+	quaternion rotation;
+} rt_camera;
+
+// Ray generation basis, rebuilt for every frame from rt_camera and the canvas
+// and viewport sizes: the ray through canvas point (x, y) starts at origin and
+// goes along x * right + y * up + forward. Changes every frame, so it is passed
+// to the kernel by value instead of living in the scene buffer.
+typedef struct {
+	cl_float4 origin;
+	cl_float4 right;
+	cl_float4 up;
+	cl_float4 forward;
+} rt_camera_frame;
+
 typedef struct {
-	cl_float4 camera_pos;
 	cl_float4 bg_color;
 	cl_float canvas_width;
 	cl_float canvas_height;
@@ -33,10 +107,44 @@ typedef struct {
 	cl_int sphere_count;
 	cl_int light_count;
 
-	quaternion camera_rotation;
+	// placement of the light grid, all zero without one
+	cl_float4 light_grid_min;
+	cl_int4 light_grid_dims;		// cells per axis, w the cell count including the outside cell
+	cl_float light_grid_cell;
+
+	// light tree of --light-samples, 0 without one
+	cl_int light_node_count;
+	cl_int light_global_count;	// lights outside the tree
 
-	rt_sphere spheres[64];
-	rt_light lights[16];
+	// triangle meshes (see mesh_io.h): a material per instance, the vertices
+	// and triangles of the objects, then the instances follow the sphere
+	// materials. The object BVHs follow the sphere BVH from node
+	// mesh_node_offset, the top-level BVH over the instances starts at
+	// instance_node_offset. Hits on triangle i are numbered sphere_count + i.
+	cl_int instance_count;
+	cl_int vertex_count;
+	cl_int triangle_count;
+	cl_int mesh_node_offset;
+	cl_int instance_node_offset;
 } rt_scene;
 
+// Queue entries of the wavefront passes in rt.cl, the host only sizes the queues with them
+typedef struct {
+	cl_float4 o;
+	cl_float4 d;
+	cl_float throughput;
+	cl_int pixel;
+	cl_float t;
+	cl_int sphere;
+	cl_int instance;
+	cl_int shadowFirst;
+	cl_int shadowCount;
+} wf_ray;
+
+typedef struct {
+	cl_float4 contribution;
+	cl_int path;
+	cl_int light;
+} wf_shadow_ray;
+
 #endif
\ No newline at end of file
@@ -0,0 +1,788 @@
+#include "scene_io.h"
+#include "instance_tree.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+
+#ifdef OS_WIN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Just enough JSON for scene files: objects, arrays, numbers, strings, literals
+typedef struct json_value {
+	enum { Null, Bool, Number, String, Array, Object } type;
+	double number;
+	std::string str;
+	std::vector<json_value> items;
+	std::vector<std::pair<std::string, json_value> > members;
+
+	const json_value *get(const char *name) const
+	{
+		for (auto &m : members)
+			if (m.first == name) return &m.second;
+		return nullptr;
+	}
+} json_value;
+
+typedef struct {
+	const char *cur;
+	const char *end;
+	std::string error;
+} json_parser;
+
+static void skip_space(json_parser &p)
+{
+	while (p.cur < p.end && isspace((unsigned char)*p.cur))
+		p.cur++;
+}
+
+static bool fail(json_parser &p, const char *message)
+{
+	if (p.error.empty())
+		p.error = message;
+	return false;
+}
+
+static bool parse_value(json_parser &p, json_value &value);
+
+static bool parse_string(json_parser &p, std::string &str)
+{
+	// called on the opening quote
+	p.cur++;
+	while (p.cur < p.end && *p.cur != '"') {
+		char ch = *p.cur++;
+		if (ch == '\\') {
+			if (p.cur == p.end) break;
+			ch = *p.cur++;
+			switch (ch) {
+			case 'n': ch = '\n'; break;
+			case 't': ch = '\t'; break;
+			case 'r': ch = '\r'; break;
+			case 'b': ch = '\b'; break;
+			case 'f': ch = '\f'; break;
+			case 'u': return fail(p, "unicode escapes are not supported");
+			default: break;
+			}
+		}
+		str.push_back(ch);
+	}
+	if (p.cur == p.end)
+		return fail(p, "unterminated string");
+	p.cur++;
+	return true;
+}
+
+static bool parse_members(json_parser &p, json_value &value)
+{
+	value.type = json_value::Object;
+	p.cur++;
+	skip_space(p);
+	if (p.cur < p.end && *p.cur == '}') {
+		p.cur++;
+		return true;
+	}
+	while (true) {
+		skip_space(p);
+		if (p.cur == p.end || *p.cur != '"')
+			return fail(p, "expected member name");
+		std::pair<std::string, json_value> member;
+		if (!parse_string(p, member.first)) return false;
+		skip_space(p);
+		if (p.cur == p.end || *p.cur != ':')
+			return fail(p, "expected ':'");
+		p.cur++;
+		if (!parse_value(p, member.second)) return false;
+		value.members.push_back(member);
+		skip_space(p);
+		if (p.cur < p.end && *p.cur == ',') {
+			p.cur++;
+			continue;
+		}
+		if (p.cur < p.end && *p.cur == '}') {
+			p.cur++;
+			return true;
+		}
+		return fail(p, "expected ',' or '}'");
+	}
+}
+
+static bool parse_items(json_parser &p, json_value &value)
+{
+	value.type = json_value::Array;
+	p.cur++;
+	skip_space(p);
+	if (p.cur < p.end && *p.cur == ']') {
+		p.cur++;
+		return true;
+	}
+	while (true) {
+		value.items.push_back(json_value());
+		if (!parse_value(p, value.items.back())) return false;
+		skip_space(p);
+		if (p.cur < p.end && *p.cur == ',') {
+			p.cur++;
+			continue;
+		}
+		if (p.cur < p.end && *p.cur == ']') {
+			p.cur++;
+			return true;
+		}
+		return fail(p, "expected ',' or ']'");
+	}
+}
+
+static bool parse_literal(json_parser &p, const char *word)
+{
+	size_t len = strlen(word);
+	if ((size_t)(p.end - p.cur) < len || strncmp(p.cur, word, len) != 0)
+		return fail(p, "unexpected character");
+	p.cur += len;
+	return true;
+}
+
+static bool parse_value(json_parser &p, json_value &value)
+{
+	skip_space(p);
+	if (p.cur == p.end)
+		return fail(p, "unexpected end of file");
+
+	value.type = json_value::Null;
+	value.number = 0;
+	switch (*p.cur) {
+	case '{': return parse_members(p, value);
+	case '[': return parse_items(p, value);
+	case '"':
+		value.type = json_value::String;
+		return parse_string(p, value.str);
+	case 't':
+		value.type = json_value::Bool;
+		value.number = 1;
+		return parse_literal(p, "true");
+	case 'f':
+		value.type = json_value::Bool;
+		return parse_literal(p, "false");
+	case 'n':
+		return parse_literal(p, "null");
+	default: {
+		// the buffer is null terminated, strtod stops at the first non-number character
+		char *next;
+		value.number = strtod(p.cur, &next);
+		if (next == p.cur)
+			return fail(p, "unexpected character");
+		value.type = json_value::Number;
+		p.cur = next;
+		return true;
+	}
+	}
+}
+
+// Scene fields
+
+static bool read_number(const json_value &obj, const char *name, cl_float &out, std::string &error)
+{
+	const json_value *v = obj.get(name);
+	if (!v) return true;
+	if (v->type != json_value::Number) {
+		error = std::string("'") + name + "' must be a number";
+		return false;
+	}
+	out = (cl_float)v->number;
+	return true;
+}
+
+static bool read_vector(const json_value &obj, const char *name, cl_float4 &out, std::string &error)
+{
+	const json_value *v = obj.get(name);
+	if (!v) return true;
+	if (v->type != json_value::Array || v->items.size() != 3) {
+		error = std::string("'") + name + "' must be an array of 3 numbers";
+		return false;
+	}
+	for (int i = 0; i < 3; i++) {
+		if (v->items[i].type != json_value::Number) {
+			error = std::string("'") + name + "' must be an array of 3 numbers";
+			return false;
+		}
+		out.s[i] = (cl_float)v->items[i].number;
+	}
+	out.s[3] = 0;
+	return true;
+}
+
+static bool read_sphere(const json_value &obj, rt_sphere &sphere, std::string &error)
+{
+	memset(&sphere, 0, sizeof(rt_sphere));
+	sphere.radius = 1;
+	cl_float specular = 0;
+	if (!read_vector(obj, "center", sphere.center, error)) return false;
+	if (!read_vector(obj, "color", sphere.color, error)) return false;
+	if (!read_number(obj, "radius", sphere.radius, error)) return false;
+	if (!read_number(obj, "reflect", sphere.reflect, error)) return false;
+	if (!read_number(obj, "specular", specular, error)) return false;
+	sphere.specular = (cl_int)specular;
+	return true;
+}
+
+static bool read_light(const json_value &obj, rt_light &light, std::string &error)
+{
+	memset(&light, 0, sizeof(rt_light));
+	const json_value *type = obj.get("type");
+	if (!type || type->type != json_value::String) {
+		error = "light 'type' must be \"ambient\", \"point\" or \"direct\"";
+		return false;
+	}
+	if (type->str == "ambient")
+		light.type = Ambient;
+	else if (type->str == "point")
+		light.type = Point;
+	else if (type->str == "direct")
+		light.type = Direct;
+	else {
+		error = "unknown light type '" + type->str + "'";
+		return false;
+	}
+	if (!read_number(obj, "intensity", light.intensity, error)) return false;
+	if (!read_number(obj, "radius", light.radius, error)) return false;
+	if (light.radius < 0) {
+		error = "light 'radius' must not be negative";
+		return false;
+	}
+	if (!read_vector(obj, "position", light.position, error)) return false;
+	if (!read_vector(obj, "direction", light.direction, error)) return false;
+	return true;
+}
+
+// Mesh files are looked up next to the scene file unless their path is absolute
+static std::string mesh_path(const char *sceneFile, const std::string &file)
+{
+	if (file.empty() || file[0] == '/' || file[0] == '\\' || (file.size() > 1 && file[1] == ':'))
+		return file;
+	const std::string scene = sceneFile;
+	const size_t slash = scene.find_last_of("/\\");
+	return slash == std::string::npos ? file : scene.substr(0, slash + 1) + file;
+}
+
+// Entries naming the same file share one object, loaded on first use
+static bool read_mesh(const json_value &obj, const char *sceneFile, std::map<std::string, mesh_object> &objects, triangle_meshes &meshes, std::string &error)
+{
+	const json_value *file = obj.get("file");
+	if (!file || file->type != json_value::String) {
+		error = "mesh 'file' must be a string";
+		return false;
+	}
+	rt_material material;
+	memset(&material, 0, sizeof(rt_material));
+	cl_float specular = 0, scale = 1;
+	cl_float4 position = { 0, 0, 0, 0 }, rotation = { 0, 0, 0, 0 };
+	if (!read_vector(obj, "color", material.color, error)) return false;
+	if (!read_number(obj, "reflect", material.reflect, error)) return false;
+	if (!read_number(obj, "specular", specular, error)) return false;
+	if (!read_number(obj, "scale", scale, error)) return false;
+	if (!read_vector(obj, "position", position, error)) return false;
+	if (!read_vector(obj, "rotation", rotation, error)) return false;
+	if (!(scale > 0)) {
+		error = "mesh 'scale' must be positive";
+		return false;
+	}
+	material.specular = (cl_int)specular;
+
+	const std::string path = mesh_path(sceneFile, file->str);
+	auto found = objects.find(path);
+	if (found == objects.end()) {
+		mesh_object object;
+		if (!load_mesh(path.c_str(), meshes, object)) {
+			error = "unable to load mesh " + file->str;
+			return false;
+		}
+		found = objects.insert(std::make_pair(path, object)).first;
+	}
+	cl_float4 worldToObject[3];
+	instance_transform(scale, rotation.s, position, worldToObject);
+	add_instance(meshes, found->second, material, worldToObject);
+	return true;
+}
+
+static bool read_scene(const json_value &root, const char *fname, rt_scene &scene, std::vector<rt_sphere> &spheres, std::vector<rt_light> &lights, triangle_meshes &meshes, std::string &error)
+{
+	if (root.type != json_value::Object) {
+		error = "scene must be an object";
+		return false;
+	}
+	if (!read_vector(root, "bg_color", scene.bg_color, error)) return false;
+	cl_float depth = (cl_float)scene.reflect_depth;
+	if (!read_number(root, "reflect_depth", depth, error)) return false;
+	scene.reflect_depth = (cl_int)depth;
+
+	spheres.clear();
+	lights.clear();
+	meshes = triangle_meshes();
+	const json_value *list = root.get("spheres");
+	if (list) {
+		if (list->type != json_value::Array) {
+			error = "'spheres' must be an array";
+			return false;
+		}
+		for (auto &item : list->items) {
+			rt_sphere sphere;
+			if (!read_sphere(item, sphere, error)) return false;
+			spheres.push_back(sphere);
+		}
+	}
+	list = root.get("lights");
+	if (list) {
+		if (list->type != json_value::Array) {
+			error = "'lights' must be an array";
+			return false;
+		}
+		for (auto &item : list->items) {
+			rt_light light;
+			if (!read_light(item, light, error)) return false;
+			lights.push_back(light);
+		}
+	}
+	list = root.get("meshes");
+	if (list) {
+		if (list->type != json_value::Array) {
+			error = "'meshes' must be an array";
+			return false;
+		}
+		std::map<std::string, mesh_object> objects;
+		for (auto &item : list->items)
+			if (!read_mesh(item, fname, objects, meshes, error)) return false;
+		build_instance_tree(meshes);
+	}
+	scene.sphere_count = spheres.size();
+	scene.light_count = lights.size();
+	return true;
+}
+
+bool load_scene(const char *fname, rt_scene &scene, std::vector<rt_sphere> &spheres, std::vector<rt_light> &lights, triangle_meshes &meshes)
+{
+	std::ifstream file(fname, std::ios::in | std::ios::binary);
+	if (!file.is_open()) {
+		std::cout << "Unable to open file " << fname << std::endl;
+		return false;
+	}
+	std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	json_parser p;
+	p.cur = text.c_str();
+	p.end = p.cur + text.size();
+	json_value root;
+	std::string error;
+	if (parse_value(p, root)) {
+		skip_space(p);
+		if (p.cur != p.end)
+			fail(p, "trailing characters");
+	}
+	if (!p.error.empty()) {
+		int line = 1;
+		for (const char *c = text.c_str(); c < p.cur; c++)
+			if (*c == '\n') line++;
+		std::cout << fname << ":" << line << ": " << p.error << std::endl;
+		return false;
+	}
+	if (!read_scene(root, fname, scene, spheres, lights, meshes, error)) {
+		std::cout << fname << ": " << error << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool load_camera_path(const char *fname, std::vector<camera_key> &keys)
+{
+	std::ifstream file(fname);
+	if (!file.is_open()) {
+		std::cout << "Unable to open file " << fname << std::endl;
+		return false;
+	}
+	keys.clear();
+	std::string line;
+	int lineNo = 0;
+	while (std::getline(file, line)) {
+		lineNo++;
+		size_t first = line.find_first_not_of(" \t\r");
+		if (first == std::string::npos || line[first] == '#')
+			continue;
+		std::istringstream in(line);
+		camera_key key;
+		if (!(in >> key.position[0] >> key.position[1] >> key.position[2] >> key.pitch >> key.yaw)) {
+			std::cout << fname << ":" << lineNo << ": expected \"x y z pitch yaw\"" << std::endl;
+			return false;
+		}
+		keys.push_back(key);
+	}
+	return true;
+}
+
+bool save_camera_path(const char *fname, const std::vector<camera_key> &keys)
+{
+	std::ofstream file(fname);
+	if (!file.is_open()) {
+		std::cout << "Unable to open file " << fname << std::endl;
+		return false;
+	}
+	file << "# x y z pitch yaw\n";
+	file.precision(9);
+	for (auto &key : keys)
+		file << key.position[0] << " " << key.position[1] << " " << key.position[2] << " " << key.pitch << " " << key.yaw << "\n";
+	file.close();
+	if (file.fail()) {
+		std::cout << "Unable to write file " << fname << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void pack_spheres(const rt_sphere *spheres, int count, int begin, int end, cl_float4 *streams)
+{
+	rt_material *materials = (rt_material*)(streams + count);
+	for (int i = begin; i < end; ++i) {
+		streams[i] = spheres[i].center;
+		streams[i].s[3] = spheres[i].radius;
+		materials[i].color = spheres[i].color;
+		materials[i].reflect = spheres[i].reflect;
+		materials[i].specular = spheres[i].specular;
+	}
+}
+
+void unpack_spheres(const cl_float4 *streams, int count, rt_sphere *spheres)
+{
+	const rt_material *materials = (const rt_material*)(streams + count);
+	for (int i = 0; i < count; ++i) {
+		memset(&spheres[i], 0, sizeof(rt_sphere));
+		spheres[i].center = streams[i];
+		spheres[i].center.s[3] = 0;
+		spheres[i].radius = streams[i].s[3];
+		spheres[i].color = materials[i].color;
+		spheres[i].reflect = materials[i].reflect;
+		spheres[i].specular = materials[i].specular;
+	}
+}
+
+// float4s of a mesh material in the device buffer
+#define MATERIAL_FLOAT4S (sizeof(rt_material) / sizeof(cl_float4))
+
+size_t geometry_float4s(const rt_scene &scene)
+{
+	return (size_t)scene.sphere_count * SPHERE_STREAM_FLOAT4S + (size_t)scene.instance_count * (MATERIAL_FLOAT4S + INSTANCE_FLOAT4S)
+		+ scene.vertex_count + scene.triangle_count;
+}
+
+void pack_meshes(const triangle_meshes &meshes, int sphereCount, cl_float4 *streams)
+{
+	rt_material *materials = (rt_material*)(streams + sphereCount) + sphereCount;
+	std::copy(meshes.materials.begin(), meshes.materials.end(), materials);
+	cl_float4 *vertices = (cl_float4*)(materials + meshes.materials.size());
+	std::copy(meshes.vertices.begin(), meshes.vertices.end(), vertices);
+	cl_int4 *triangles = (cl_int4*)(vertices + meshes.vertices.size());
+	memcpy(triangles, meshes.triangles.data(), meshes.triangles.size() * sizeof(cl_int4));
+	memcpy(triangles + meshes.triangles.size(), meshes.instances.data(), meshes.instances.size() * sizeof(rt_instance));
+}
+
+void unpack_meshes(const cl_float4 *streams, const rt_scene &scene, triangle_meshes &meshes)
+{
+	const rt_material *materials = (const rt_material*)(streams + scene.sphere_count) + scene.sphere_count;
+	meshes.materials.assign(materials, materials + scene.instance_count);
+	const cl_float4 *vertices = (const cl_float4*)(materials + scene.instance_count);
+	meshes.vertices.assign(vertices, vertices + scene.vertex_count);
+	const cl_int4 *triangles = (const cl_int4*)(vertices + scene.vertex_count);
+	meshes.triangles.assign(triangles, triangles + scene.triangle_count);
+	const rt_instance *instances = (const rt_instance*)(triangles + scene.triangle_count);
+	meshes.instances.assign(instances, instances + scene.instance_count);
+}
+
+static const char SCENE_FILE_MAGIC[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', 0 };
+
+bool is_binary_scene(const char *fname)
+{
+	const size_t len = strlen(fname);
+	return len > 5 && strcmp(fname + len - 5, ".rtsc") == 0;
+}
+
+static cl_ulong alignOffset(cl_ulong offset)
+{
+	return (offset + SCENE_FILE_ALIGNMENT - 1) / SCENE_FILE_ALIGNMENT * SCENE_FILE_ALIGNMENT;
+}
+
+// Writes bytes at offset, zero padding from the current position
+static void writeSection(std::ofstream &file, cl_ulong offset, const void *data, size_t bytes)
+{
+	const cl_ulong pos = (cl_ulong)file.tellp();
+	if (offset > pos)
+		file.write(std::string((size_t)(offset - pos), '\0').data(), offset - pos);
+	if (bytes)
+		file.write((const char*)data, bytes);
+}
+
+bool save_scene_binary(const char *fname, const rt_scene &scene, const std::vector<rt_sphere> &spheres, const std::vector<rt_light> &lights, const std::vector<rt_bvh_node> &nodes,
+	const triangle_meshes &meshes)
+{
+	scene_file_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic));
+	header.version = SCENE_FILE_VERSION;
+	header.sphere_size = SPHERE_STREAM_FLOAT4S * sizeof(cl_float4);
+	header.light_size = sizeof(rt_light);
+	header.node_size = sizeof(rt_bvh_node);
+	header.material_size = sizeof(rt_material);
+	header.instance_size = sizeof(rt_instance);
+	header.bg_color = scene.bg_color;
+	header.reflect_depth = scene.reflect_depth;
+	header.sphere_count = (cl_int)spheres.size();
+	header.light_count = (cl_int)lights.size();
+	header.node_count = (cl_int)nodes.size();
+	header.instance_count = (cl_int)meshes.instances.size();
+	header.vertex_count = (cl_int)meshes.vertices.size();
+	header.triangle_count = (cl_int)meshes.triangles.size();
+	header.mesh_node_count = (cl_int)meshes.nodes.size();
+	header.instance_node_count = (cl_int)meshes.instanceNodes.size();
+
+	rt_scene layout;
+	memset(&layout, 0, sizeof(layout));
+	layout.sphere_count = header.sphere_count;
+	layout.instance_count = header.instance_count;
+	layout.vertex_count = header.vertex_count;
+	layout.triangle_count = header.triangle_count;
+	std::vector<cl_float4> streams(geometry_float4s(layout));
+
+	header.sphere_offset = alignOffset(sizeof(header));
+	header.light_offset = alignOffset(header.sphere_offset + streams.size() * sizeof(cl_float4));
+	header.node_offset = alignOffset(header.light_offset + lights.size() * sizeof(rt_light));
+
+	std::ofstream file(fname, std::ios::binary);
+	if (!file.is_open()) {
+		std::cout << "Unable to open file " << fname << std::endl;
+		return false;
+	}
+	file.write((const char*)&header, sizeof(header));
+	pack_spheres(spheres.data(), header.sphere_count, 0, header.sphere_count, streams.data());
+	pack_meshes(meshes, header.sphere_count, streams.data());
+	writeSection(file, header.sphere_offset, streams.data(), streams.size() * sizeof(cl_float4));
+	writeSection(file, header.light_offset, lights.data(), lights.size() * sizeof(rt_light));
+	// the node section holds the sphere tree, the object trees and the
+	// instance tree with its whole reserve, in that order
+	std::vector<rt_bvh_node> allNodes = nodes;
+	allNodes.insert(allNodes.end(), meshes.nodes.begin(), meshes.nodes.end());
+	allNodes.insert(allNodes.end(), meshes.instanceNodes.begin(), meshes.instanceNodes.end());
+	rt_bvh_node unused;
+	memset(&unused, 0, sizeof(unused));
+	allNodes.resize(nodes.size() + meshes.nodes.size() + instance_node_capacity(header.instance_count), unused);
+	writeSection(file, header.node_offset, allNodes.data(), allNodes.size() * sizeof(rt_bvh_node));
+	file.close();
+	if (file.fail()) {
+		std::cout << "Unable to write file " << fname << std::endl;
+		return false;
+	}
+	return true;
+}
+
+static bool sectionFits(cl_ulong offset, cl_ulong bytes, size_t fileSize)
+{
+	return offset % SCENE_FILE_ALIGNMENT == 0 && offset <= fileSize && bytes <= fileSize - offset;
+}
+
+// Node references of a tree over prims primitives: children after their
+// parent (refit_bvh walks the nodes backwards), leaves within the primitives,
+// and no deeper than the traversal stack of the kernel and the CPU backend
+static const char *checkTree(const rt_bvh_node *nodes, int count, int prims)
+{
+	// parents come first, so a node's depth is final when the loop reaches it
+	std::vector<int> depth(count, 0);
+	for (int i = 0; i < count; ++i) {
+		const rt_bvh_node &node = nodes[i];
+		if (node.count < 0 || node.left_first < 0)
+			return "bad BVH node";
+		// an empty scene is a single empty leaf
+		if (prims == 0 && count == 1 && node.count == 0)
+			break;
+		if (node.count == 0 ? node.left_first <= i || node.left_first + 1 >= count
+				: node.left_first > prims - node.count)
+			return "bad BVH node";
+		if (depth[i] >= BVH_MAX_DEPTH)
+			return "BVH too deep";
+		for (int child = node.left_first; node.count == 0 && child <= node.left_first + 1; ++child)
+			depth[child] = std::max(depth[child], depth[i] + 1);
+	}
+	return NULL;
+}
+
+// Trees of the mesh objects the instances use, each covering the nodes up to
+// the next object's root and the triangles up to its first triangle
+static const char *checkObjects(const rt_bvh_node *nodes, int nodeCount, const rt_instance *instances, int instanceCount, int triangleCount)
+{
+	std::vector<std::pair<int, int> > objects;
+	for (int i = 0; i < instanceCount; ++i) {
+		const rt_instance &instance = instances[i];
+		if (instance.root < 0 || instance.root >= nodeCount || instance.first_triangle < 0 || instance.first_triangle >= triangleCount
+				|| instance.material < 0 || instance.material >= instanceCount)
+			return "bad instance";
+		objects.push_back(std::make_pair(instance.root, instance.first_triangle));
+	}
+	std::sort(objects.begin(), objects.end());
+	objects.erase(std::unique(objects.begin(), objects.end()), objects.end());
+	for (size_t i = 0; i < objects.size(); ++i) {
+		const bool last = i + 1 == objects.size();
+		const int endNode = last ? nodeCount : objects[i + 1].first;
+		const int endTriangle = last ? triangleCount : objects[i + 1].second;
+		if (endNode == objects[i].first || endTriangle <= objects[i].second)
+			return "bad instance";
+		const char *error = checkTree(nodes + objects[i].first, endNode - objects[i].first, endTriangle - objects[i].second);
+		if (error)
+			return error;
+	}
+	return NULL;
+}
+
+// Header, tree, triangle and instance checks, the kernel trusts every index it follows
+static const char *checkScene(const void *base, size_t size)
+{
+	if (size < sizeof(scene_file_header))
+		return "file too short";
+	const scene_file_header *header = (const scene_file_header*)base;
+	if (memcmp(header->magic, SCENE_FILE_MAGIC, sizeof(header->magic)) != 0)
+		return "not a binary scene";
+	if (header->version != SCENE_FILE_VERSION)
+		return "unsupported version";
+	if (header->sphere_size != SPHERE_STREAM_FLOAT4S * sizeof(cl_float4) || header->light_size != sizeof(rt_light)
+			|| header->node_size != sizeof(rt_bvh_node) || header->material_size != sizeof(rt_material)
+			|| header->instance_size != sizeof(rt_instance))
+		return "record layout differs from this build";
+	if (header->sphere_count < 0 || header->light_count < 0 || header->node_count < 0 || header->instance_count < 0
+			|| header->vertex_count < 0 || header->triangle_count < 0 || header->mesh_node_count < 0 || header->instance_node_count < 0)
+		return "negative count";
+
+	rt_scene layout;
+	memset(&layout, 0, sizeof(layout));
+	layout.sphere_count = header->sphere_count;
+	layout.instance_count = header->instance_count;
+	layout.vertex_count = header->vertex_count;
+	layout.triangle_count = header->triangle_count;
+	const cl_ulong nodeCount = (cl_ulong)header->node_count + header->mesh_node_count + instance_node_capacity(header->instance_count);
+	if (!sectionFits(header->sphere_offset, (cl_ulong)geometry_float4s(layout) * sizeof(cl_float4), size)
+		|| !sectionFits(header->light_offset, (cl_ulong)header->light_count * sizeof(rt_light), size)
+		|| !sectionFits(header->node_offset, nodeCount * sizeof(rt_bvh_node), size))
+		return "section out of bounds";
+	if (header->node_count < 1)
+		return "missing BVH";
+	if ((header->triangle_count > 0) != (header->mesh_node_count > 0))
+		return "missing mesh BVH";
+	if ((header->instance_count > 0) != (header->instance_node_count > 0)
+			|| header->instance_node_count > instance_node_capacity(header->instance_count))
+		return "missing instance BVH";
+
+	const rt_bvh_node *nodes = (const rt_bvh_node*)((const char*)base + header->node_offset);
+	const rt_bvh_node *meshNodes = nodes + header->node_count;
+	const char *error = checkTree(nodes, header->node_count, header->sphere_count);
+	if (!error)
+		error = checkTree(meshNodes + header->mesh_node_count, header->instance_node_count, header->instance_count);
+	if (error)
+		return error;
+
+	// the triangles and then the instances end the sphere section
+	const cl_float4 *geometry = (const cl_float4*)((const char*)base + header->sphere_offset);
+	const rt_instance *instances = (const rt_instance*)(geometry + geometry_float4s(layout)) - header->instance_count;
+	const cl_int4 *triangles = (const cl_int4*)instances - header->triangle_count;
+	for (int i = 0; i < header->triangle_count; ++i) {
+		const cl_int4 &triangle = triangles[i];
+		for (int v = 0; v < 3; v++)
+			if (triangle.s[v] < 0 || triangle.s[v] >= header->vertex_count)
+				return "bad triangle";
+	}
+	return checkObjects(meshNodes, header->mesh_node_count, instances, header->instance_count, header->triangle_count);
+}
+
+bool map_scene(const char *fname, mapped_scene &mapped)
+{
+	void *base = NULL;
+	size_t size = 0;
+#ifdef OS_WIN
+	HANDLE file = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		std::cout << "Unable to open file " << fname << std::endl;
+		return false;
+	}
+	LARGE_INTEGER fileSize;
+	HANDLE mapping = NULL;
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0) {
+		size = (size_t)fileSize.QuadPart;
+		mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	}
+	if (mapping) {
+		base = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+		// the view keeps the file open
+		CloseHandle(mapping);
+	}
+	CloseHandle(file);
+#else
+	int fd = open(fname, O_RDONLY);
+	if (fd < 0) {
+		std::cout << "Unable to open file " << fname << std::endl;
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		size = (size_t)st.st_size;
+		base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (base == MAP_FAILED)
+			base = NULL;
+	}
+	close(fd);
+#endif
+	if (!base) {
+		std::cout << "Unable to map file " << fname << std::endl;
+		return false;
+	}
+
+	const char *error = checkScene(base, size);
+	if (error) {
+		std::cout << fname << ": " << error << std::endl;
+		mapped_scene failed = { base, size };
+		unmap_scene(failed);
+		return false;
+	}
+
+	const scene_file_header *header = (const scene_file_header*)base;
+	memset(&mapped, 0, sizeof(mapped));
+	mapped.base = base;
+	mapped.size = size;
+	mapped.scene.bg_color = header->bg_color;
+	mapped.scene.reflect_depth = header->reflect_depth;
+	mapped.scene.sphere_count = header->sphere_count;
+	mapped.scene.light_count = header->light_count;
+	mapped.scene.instance_count = header->instance_count;
+	mapped.scene.vertex_count = header->vertex_count;
+	mapped.scene.triangle_count = header->triangle_count;
+	mapped.scene.mesh_node_offset = header->node_count;
+	mapped.scene.instance_node_offset = header->node_count + header->mesh_node_count;
+	mapped.spheres = (cl_float4*)((char*)base + header->sphere_offset);
+	mapped.lights = (rt_light*)((char*)base + header->light_offset);
+	mapped.nodes = (rt_bvh_node*)((char*)base + header->node_offset);
+	mapped.node_count = mapped.scene.instance_node_offset + instance_node_capacity(header->instance_count);
+	mapped.instance_node_count = header->instance_node_count;
+	return true;
+}
+
+void unmap_scene(mapped_scene &mapped)
+{
+	if (!mapped.base)
+		return;
+#ifdef OS_WIN
+	UnmapViewOfFile(mapped.base);
+#else
+	munmap(mapped.base, mapped.size);
+#endif
+	memset(&mapped, 0, sizeof(mapped));
+}
@@ -0,0 +1,116 @@
+#include <cstddef>
+#include <vector>
+
+#include "scene.h"
+#include "mesh_io.h"
+
+#ifndef SCENE_IO_H
+#define SCENE_IO_H
+
+// Reads spheres, lights, bg_color and reflect_depth from a JSON scene file:
+//
+// { "bg_color": [0,0,0], "reflect_depth": 3,
+//   "spheres": [ { "center": [0,-1,3], "radius": 1, "color": [1,0,0],
+//                  "specular": 500, "reflect": 0.4 } ],
+//   "lights":  [ { "type": "ambient", "intensity": 0.2 },
+//                { "type": "point", "intensity": 0.6, "position": [2,1,0], "radius": 8 },
+//                { "type": "direct", "intensity": 0.2, "direction": [1,4,4] } ],
+//   "meshes":  [ { "file": "bunny.obj", "scale": 10, "position": [0,0,4],
+//                  "rotation": [0,90,0], "color": [1,1,1], "specular": 10,
+//                  "reflect": 0 } ] }
+//
+// A point light radius is optional, without one the light reaches everywhere.
+// Mesh files (OBJ or PLY) are relative to the scene file, see load_mesh. Every
+// mesh entry is an instance (see instance_tree.h); entries naming the same file
+// share one copy of its triangles and BVH. Rotations are in degrees about x,
+// y and z, in that order.
+// The canvas and viewport fields are left untouched, they depend on the output size.
+bool load_scene(const char *fname, rt_scene &scene, std::vector<rt_sphere> &spheres, std::vector<rt_light> &lights, triangle_meshes &meshes);
+
+// One camera placement per frame, pitch and yaw in degrees as driven by the mouse
+typedef struct {
+	cl_float position[3];
+	cl_float pitch;
+	cl_float yaw;
+} camera_key;
+
+// Text file with a "x y z pitch yaw" line per frame; empty lines and lines
+// starting with # are skipped
+bool load_camera_path(const char *fname, std::vector<camera_key> &keys);
+// Writes keys in the format read by load_camera_path
+bool save_camera_path(const char *fname, const std::vector<camera_key> &keys);
+
+// Writes spheres[begin, end) into streams, the device layout of count spheres
+// (see rt_material)
+void pack_spheres(const rt_sphere *spheres, int count, int begin, int end, cl_float4 *streams);
+void unpack_spheres(const cl_float4 *streams, int count, rt_sphere *spheres);
+
+// float4s of the whole device sphere buffer: the sphere streams followed by
+// the mesh materials, vertices, triangles and instances (see rt_scene)
+size_t geometry_float4s(const rt_scene &scene);
+// Writes the mesh arrays after the streams of sphereCount spheres. unpack_meshes
+// leaves the BVHs out, they live in the node buffer.
+void pack_meshes(const triangle_meshes &meshes, int sphereCount, cl_float4 *streams);
+void unpack_meshes(const cl_float4 *streams, const rt_scene &scene, triangle_meshes &meshes);
+
+// Binary scene files (.rtsc) store the arrays exactly as the kernel reads them,
+// spheres already packed in leaf order next to their BVH and the meshes after
+// them as in the device buffers, the object and instance BVHs included, so
+// loading one maps the file
+// instead of parsing it and building the tree. Every array starts on a
+// SCENE_FILE_ALIGNMENT boundary, which lets the mapped pages back the device
+// buffers directly.
+#define SCENE_FILE_VERSION 4
+#define SCENE_FILE_ALIGNMENT 4096
+
+typedef struct {
+	char magic[8];			// "RTSCENE\0"
+	cl_uint version;
+	// record sizes of the writer, a build with another layout rejects the file
+	cl_uint sphere_size;
+	cl_uint light_size;
+	cl_uint node_size;
+	cl_uint material_size;
+	cl_uint instance_size;
+	cl_float4 bg_color;
+	cl_int reflect_depth;
+	cl_int sphere_count;
+	cl_int light_count;
+	cl_int node_count;
+	// the sphere section continues with the mesh arrays, the node section
+	// with the object BVHs and the instance BVH, which has the
+	// instance_node_capacity nodes of its reserve in the file
+	cl_int instance_count;
+	cl_int vertex_count;
+	cl_int triangle_count;
+	cl_int mesh_node_count;
+	cl_int instance_node_count;
+	// byte offsets from the start of the file
+	cl_ulong sphere_offset;
+	cl_ulong light_offset;
+	cl_ulong node_offset;
+} scene_file_header;
+
+// A binary scene mapped copy-on-write, writes through the pointers never reach the file
+typedef struct {
+	void *base;
+	size_t size;
+	rt_scene scene;			// canvas and viewport fields are zero
+	cl_float4 *spheres;		// device layout, see geometry_float4s
+	rt_light *lights;
+	rt_bvh_node *nodes;		// the sphere BVH, the object BVHs, then the instance BVH
+	int node_count;			// of all of them, with the reserve of the instance BVH
+	int instance_node_count;
+} mapped_scene;
+
+// True for file names ending in .rtsc
+bool is_binary_scene(const char *fname);
+// Writes a scene with its built BVHs, nodes must be the tree over spheres and
+// meshes must have its instance tree built
+bool save_scene_binary(const char *fname, const rt_scene &scene, const std::vector<rt_sphere> &spheres, const std::vector<rt_light> &lights, const std::vector<rt_bvh_node> &nodes,
+	const triangle_meshes &meshes);
+// Maps fname and checks the header and the node references; mapped is only filled on success
+bool map_scene(const char *fname, mapped_scene &mapped);
+void unmap_scene(mapped_scene &mapped);
+
+#endif
@@ -0,0 +1,126 @@
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_SSE2
+#endif
+
+#ifndef SIMD_H
+#define SIMD_H
+
+// Packet of SIMD_WIDTH floats for the CPU tracer: AVX2 when the compiler
+// targets it (RT_CPU_AVX2 in CMake), SSE2 on any other x86, scalar elsewhere.
+// Masks are vfloat too, with all bits set in the selected lanes.
+
+#if defined(__AVX2__)
+
+#define SIMD_WIDTH 8
+#define SIMD_ISA "AVX2"
+
+struct vfloat {
+	__m256 v;
+	vfloat() {}
+	vfloat(__m256 x) : v(x) {}
+	vfloat(float x) : v(_mm256_set1_ps(x)) {}
+};
+
+inline vfloat load(const float *p) { return _mm256_load_ps(p); }
+inline void store(float *p, vfloat a) { _mm256_store_ps(p, a.v); }
+inline vfloat operator+(vfloat a, vfloat b) { return _mm256_add_ps(a.v, b.v); }
+inline vfloat operator-(vfloat a, vfloat b) { return _mm256_sub_ps(a.v, b.v); }
+inline vfloat operator*(vfloat a, vfloat b) { return _mm256_mul_ps(a.v, b.v); }
+inline vfloat operator/(vfloat a, vfloat b) { return _mm256_div_ps(a.v, b.v); }
+inline vfloat operator-(vfloat a) { return _mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f)); }
+inline vfloat sqrt(vfloat a) { return _mm256_sqrt_ps(a.v); }
+inline vfloat vmin(vfloat a, vfloat b) { return _mm256_min_ps(a.v, b.v); }
+inline vfloat vmax(vfloat a, vfloat b) { return _mm256_max_ps(a.v, b.v); }
+inline vfloat operator<(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline vfloat operator<=(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline vfloat operator>(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline vfloat operator>=(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+inline vfloat operator==(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ); }
+inline vfloat operator&(vfloat a, vfloat b) { return _mm256_and_ps(a.v, b.v); }
+inline vfloat operator|(vfloat a, vfloat b) { return _mm256_or_ps(a.v, b.v); }
+// a & ~b
+inline vfloat andnot(vfloat a, vfloat b) { return _mm256_andnot_ps(b.v, a.v); }
+inline vfloat select(vfloat mask, vfloat a, vfloat b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+inline int movemask(vfloat mask) { return _mm256_movemask_ps(mask.v); }
+
+#elif defined(SIMD_SSE2)
+
+#define SIMD_WIDTH 4
+#define SIMD_ISA "SSE2"
+
+struct vfloat {
+	__m128 v;
+	vfloat() {}
+	vfloat(__m128 x) : v(x) {}
+	vfloat(float x) : v(_mm_set1_ps(x)) {}
+};
+
+inline vfloat load(const float *p) { return _mm_load_ps(p); }
+inline void store(float *p, vfloat a) { _mm_store_ps(p, a.v); }
+inline vfloat operator+(vfloat a, vfloat b) { return _mm_add_ps(a.v, b.v); }
+inline vfloat operator-(vfloat a, vfloat b) { return _mm_sub_ps(a.v, b.v); }
+inline vfloat operator*(vfloat a, vfloat b) { return _mm_mul_ps(a.v, b.v); }
+inline vfloat operator/(vfloat a, vfloat b) { return _mm_div_ps(a.v, b.v); }
+inline vfloat operator-(vfloat a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)); }
+inline vfloat sqrt(vfloat a) { return _mm_sqrt_ps(a.v); }
+inline vfloat vmin(vfloat a, vfloat b) { return _mm_min_ps(a.v, b.v); }
+inline vfloat vmax(vfloat a, vfloat b) { return _mm_max_ps(a.v, b.v); }
+inline vfloat operator<(vfloat a, vfloat b) { return _mm_cmplt_ps(a.v, b.v); }
+inline vfloat operator<=(vfloat a, vfloat b) { return _mm_cmple_ps(a.v, b.v); }
+inline vfloat operator>(vfloat a, vfloat b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline vfloat operator>=(vfloat a, vfloat b) { return _mm_cmpge_ps(a.v, b.v); }
+inline vfloat operator==(vfloat a, vfloat b) { return _mm_cmpeq_ps(a.v, b.v); }
+inline vfloat operator&(vfloat a, vfloat b) { return _mm_and_ps(a.v, b.v); }
+inline vfloat operator|(vfloat a, vfloat b) { return _mm_or_ps(a.v, b.v); }
+inline vfloat andnot(vfloat a, vfloat b) { return _mm_andnot_ps(b.v, a.v); }
+inline vfloat select(vfloat mask, vfloat a, vfloat b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+inline int movemask(vfloat mask) { return _mm_movemask_ps(mask.v); }
+
+#else
+
+#define SIMD_WIDTH 1
+#define SIMD_ISA "scalar"
+
+// Masks are stored as 0 / 1 in the scalar build
+struct vfloat {
+	float v;
+	vfloat() {}
+	vfloat(float x) : v(x) {}
+};
+
+inline vfloat load(const float *p) { return *p; }
+inline void store(float *p, vfloat a) { *p = a.v; }
+inline vfloat operator+(vfloat a, vfloat b) { return a.v + b.v; }
+inline vfloat operator-(vfloat a, vfloat b) { return a.v - b.v; }
+inline vfloat operator*(vfloat a, vfloat b) { return a.v * b.v; }
+inline vfloat operator/(vfloat a, vfloat b) { return a.v / b.v; }
+inline vfloat operator-(vfloat a) { return -a.v; }
+inline vfloat sqrt(vfloat a) { return std::sqrt(a.v); }
+inline vfloat vmin(vfloat a, vfloat b) { return a.v < b.v ? a.v : b.v; }
+inline vfloat vmax(vfloat a, vfloat b) { return a.v > b.v ? a.v : b.v; }
+inline vfloat operator<(vfloat a, vfloat b) { return a.v < b.v ? 1.0f : 0.0f; }
+inline vfloat operator<=(vfloat a, vfloat b) { return a.v <= b.v ? 1.0f : 0.0f; }
+inline vfloat operator>(vfloat a, vfloat b) { return a.v > b.v ? 1.0f : 0.0f; }
+inline vfloat operator>=(vfloat a, vfloat b) { return a.v >= b.v ? 1.0f : 0.0f; }
+inline vfloat operator==(vfloat a, vfloat b) { return a.v == b.v ? 1.0f : 0.0f; }
+inline vfloat operator&(vfloat a, vfloat b) { return a.v != 0 && b.v != 0 ? 1.0f : 0.0f; }
+inline vfloat operator|(vfloat a, vfloat b) { return a.v != 0 || b.v != 0 ? 1.0f : 0.0f; }
+inline vfloat andnot(vfloat a, vfloat b) { return a.v != 0 && b.v == 0 ? 1.0f : 0.0f; }
+inline vfloat select(vfloat mask, vfloat a, vfloat b) { return mask.v != 0 ? a : b; }
+inline int movemask(vfloat mask) { return mask.v != 0; }
+
+#endif
+
+inline bool any(vfloat mask) { return movemask(mask) != 0; }
+inline bool none(vfloat mask) { return movemask(mask) == 0; }
+
+// OpenCL fmin/fmax: a NaN operand yields the other one
+inline vfloat fmin(vfloat a, vfloat b) { return select(b == b, vmin(a, b), a); }
+inline vfloat fmax(vfloat a, vfloat b) { return select(b == b, vmax(a, b), a); }
+
+#endif
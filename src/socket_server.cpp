@@ -0,0 +1,181 @@
+#include "socket_server.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#ifndef OS_WIN
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// a client closing early must not kill the server with SIGPIPE
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+// Clears the way for bind: nothing at path, or a socket file left behind by
+// a server that did not exit cleanly, which is removed. Any other file, and
+// a socket some server still accepts connections on, are left alone.
+static bool removeStaleSocket(const char *path, const sockaddr_un &addr)
+{
+	struct stat st;
+	if (lstat(path, &st) != 0) {
+		if (errno == ENOENT)
+			return true;
+		std::cout << "Unable to check " << path << ": " << strerror(errno) << std::endl;
+		return false;
+	}
+	if (!S_ISSOCK(st.st_mode)) {
+		std::cout << path << " exists and is not a socket" << std::endl;
+		return false;
+	}
+
+	int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (probe < 0) {
+		std::cout << "Unable to create socket: " << strerror(errno) << std::endl;
+		return false;
+	}
+	const bool live = connect(probe, (const sockaddr*)&addr, sizeof(addr)) == 0;
+	const int err = errno;
+	close(probe);
+	if (live) {
+		std::cout << "A server is already listening on " << path << std::endl;
+		return false;
+	}
+	if (err != ECONNREFUSED) {
+		std::cout << "Unable to check " << path << ": " << strerror(err) << std::endl;
+		return false;
+	}
+	if (unlink(path) != 0) {
+		std::cout << "Unable to remove stale socket " << path << ": " << strerror(errno) << std::endl;
+		return false;
+	}
+	return true;
+}
+
+SocketServer::SocketServer(const char *path)
+	: path(path), listenFd(-1), clientFd(-1)
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		std::cout << "Socket path too long: " << path << std::endl;
+		return;
+	}
+	strcpy(addr.sun_path, path);
+	if (!removeStaleSocket(path, addr))
+		return;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		std::cout << "Unable to create socket: " << strerror(errno) << std::endl;
+		return;
+	}
+#ifdef SO_NOSIGPIPE
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+	if (bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0) {
+		std::cout << "Unable to listen on " << path << ": " << strerror(errno) << std::endl;
+		close(fd);
+		return;
+	}
+	listenFd = fd;
+}
+
+SocketServer::~SocketServer()
+{
+	closeClient();
+	if (listenFd >= 0) {
+		close(listenFd);
+		unlink(path.c_str());
+	}
+}
+
+bool SocketServer::accept()
+{
+	closeClient();
+	while (listenFd >= 0) {
+		int fd = ::accept(listenFd, NULL, NULL);
+		if (fd >= 0) {
+			clientFd = fd;
+			return true;
+		}
+		if (errno != EINTR)
+			break;
+	}
+	return false;
+}
+
+bool SocketServer::readLine(std::string &line)
+{
+	while (clientFd >= 0) {
+		size_t end = received.find('\n');
+		if (end != std::string::npos) {
+			line = received.substr(0, end);
+			received.erase(0, end + 1);
+			if (!line.empty() && line[line.size() - 1] == '\r')
+				line.erase(line.size() - 1);
+			return true;
+		}
+		char buf[4096];
+		ssize_t n = recv(clientFd, buf, sizeof(buf), 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		received.append(buf, n);
+	}
+	return false;
+}
+
+bool SocketServer::write(const void *data, size_t size)
+{
+	const char *bytes = (const char*)data;
+	while (size > 0 && clientFd >= 0) {
+		ssize_t n = send(clientFd, bytes, size, SEND_FLAGS);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		bytes += n;
+		size -= n;
+	}
+	return size == 0;
+}
+
+bool SocketServer::writeLine(const std::string &line)
+{
+	std::string data = line + "\n";
+	return write(data.data(), data.size());
+}
+
+void SocketServer::closeClient()
+{
+	if (clientFd >= 0)
+		close(clientFd);
+	clientFd = -1;
+	received.clear();
+}
+
+#else
+
+SocketServer::SocketServer(const char *path)
+	: path(path), listenFd(-1), clientFd(-1)
+{
+	std::cout << "The render server needs Unix domain sockets" << std::endl;
+}
+
+SocketServer::~SocketServer() {}
+bool SocketServer::accept() { return false; }
+bool SocketServer::readLine(std::string &line) { return false; }
+bool SocketServer::write(const void *data, size_t size) { return false; }
+bool SocketServer::writeLine(const std::string &line) { return false; }
+void SocketServer::closeClient() {}
+
+#endif
@@ -0,0 +1,34 @@
+#include <string>
+
+#ifndef SOCKET_SERVER_H
+#define SOCKET_SERVER_H
+
+// Unix domain socket serving one client at a time. Requests are read as text
+// lines, replies are written as they are given (a header line, possibly
+// followed by a binary payload). Not available on Windows, isOpen stays false.
+class SocketServer {
+public:
+	// Binds and listens on path, replacing a stale socket file. Fails if path
+	// is another kind of file or a server is still listening on it.
+	explicit SocketServer(const char *path);
+	// Closes the sockets and removes the socket file
+	~SocketServer();
+
+	bool isOpen() const { return listenFd >= 0; }
+
+	// Blocks until the next client connects
+	bool accept();
+	// Next request line of the client without the line break; false once it disconnected
+	bool readLine(std::string &line);
+	bool write(const void *data, size_t size);
+	bool writeLine(const std::string &line);
+	void closeClient();
+
+private:
+	std::string path;
+	int listenFd;
+	int clientFd;
+	std::string received;	// bytes after the last complete line
+};
+
+#endif